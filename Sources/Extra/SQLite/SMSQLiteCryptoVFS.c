@@ -747,6 +747,12 @@ static int VFSCryptRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite_int64
 		return SQLITE_INTERNAL;
 	}
 	
+	if (iOfst < 0)
+	{
+		sqlite3_log(SQLITE_INTERNAL, "VFS error (VFSCryptRead): negative offset");
+		return SQLITE_INTERNAL;
+	}
+	
 	VFSCryptFile *p = (VFSCryptFile *)pFile;
 
 	SMSQLiteCryptoVFSSetFileCryptoError(SMCryptoFileErrorNo);
@@ -759,24 +765,16 @@ static int VFSCryptRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite_int64
 	}
 	
 	SMCryptoFileError error;
-
-	// Seek.
-	if (SMCryptoFileSeek(p->file, iOfst, SEEK_SET, &error) == false)
-	{
-		SMSQLiteCryptoVFSSetFileCryptoError(error);
-		sqlite3_log(SQLITE_IOERR_SEEK, "Crypto file error (SMCryptoFileSeek / VFSCryptRead) - error %d", error);
-		return SQLITE_IOERR_SEEK;
-	}
 	
 	// Read.
 	int64_t size;
 	
-	size = SMCryptoFileRead(p->file, zBuf, (uint64_t)iAmt, &error);
+	size = SMCryptoFilePRead(p->file, zBuf, (uint64_t)iAmt, (uint64_t)iOfst, &error);
 	
 	if (size == -1)
 	{
 		SMSQLiteCryptoVFSSetFileCryptoError(error);
-		sqlite3_log(SQLITE_IOERR_READ, "Crypto file error (SMCryptoFileRead / VFSCryptRead) - error %d", error);
+		sqlite3_log(SQLITE_IOERR_READ, "Crypto file error (SMCryptoFilePRead / VFSCryptRead) - error %d", error);
 		return SQLITE_IOERR_READ;
 	}
 	else if (size == iAmt)
@@ -800,6 +798,12 @@ static int VFSCryptWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite
 		return SQLITE_INTERNAL;
 	}
 	
+	if (iOfst < 0)
+	{
+		sqlite3_log(SQLITE_INTERNAL, "VFS error (VFSCryptWrite): negative offset");
+		return SQLITE_INTERNAL;
+	}
+	
 	VFSCryptFile *p = (VFSCryptFile *)pFile;
 	
 	SMSQLiteCryptoVFSSetFileCryptoError(SMCryptoFileErrorNo);
@@ -813,19 +817,11 @@ static int VFSCryptWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite
 	
 	SMCryptoFileError error;
 	
-	// Seek.
-	if (SMCryptoFileSeek(p->file, iOfst, SEEK_SET, &error) == false)
-	{
-		SMSQLiteCryptoVFSSetFileCryptoError(error);
-		sqlite3_log(SQLITE_IOERR_SEEK, "Crypto file error (SMCryptoFileSeek / VFSCryptWrite) - error %d", error);
-		return SQLITE_IOERR_SEEK;
-	}
-	
 	// Write.
-	if (SMCryptoFileWrite(p->file, zBuf, (uint64_t)iAmt, &error) == false)
+	if (SMCryptoFilePWrite(p->file, zBuf, (uint64_t)iAmt, (uint64_t)iOfst, &error) == false)
 	{
 		SMSQLiteCryptoVFSSetFileCryptoError(error);
-		sqlite3_log(SQLITE_IOERR_WRITE, "Crypto file error (SMCryptoFileWrite / VFSCryptWrite) - error %d", error);
+		sqlite3_log(SQLITE_IOERR_WRITE, "Crypto file error (SMCryptoFilePWrite / VFSCryptWrite) - error %d", error);
 		return SQLITE_IOERR_WRITE;
 	}
 	
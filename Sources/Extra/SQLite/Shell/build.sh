@@ -4,4 +4,4 @@
 base=$(cd "`dirname "$0"`"; pwd -P)
 
 # Build.
-clang "${base}/shell.c" "${base}/../SMSQLiteCryptoVFS.c" "${base}/../../../SMCryptoFile.c" -lsqlite3 -lz -lreadline -framework Security -I"${base}/../../../" -I"${base}/../" -DSQLITE_OMIT_LOAD_EXTENSION=1 -DSQLITE_OMIT_MEMORYDB=1 -DHAVE_READLINE=1 -o sqlite3
+clang "${base}/shell.c" "${base}/../SMSQLiteCryptoVFS.c" "${base}/../../../SMCryptoFile.c" "${base}/../../../SMCryptoXTS.c" "${base}/../../../SMCryptoBackend.c" -lsqlite3 -lz -lreadline -framework Security -I"${base}/../../../" -I"${base}/../" -DSQLITE_OMIT_LOAD_EXTENSION=1 -DSQLITE_OMIT_MEMORYDB=1 -DHAVE_READLINE=1 -o sqlite3
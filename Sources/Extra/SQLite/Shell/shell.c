@@ -579,6 +579,7 @@ const char * crypto_file_string_error(SMCryptoFileError error)
 		case SMCryptoFileErrorReadOnly:		return "file is read-only";
 		case SMCryptoFileErrorIO:			return "input / output error";
 		case SMCryptoFileErrorUnknown:		return "unknown";
+		case SMCryptoFileErrorIntegrity:	return "data integrity error";
 	}
 	
 	return "-";
@@ -0,0 +1,898 @@
+/*
+ * SMCryptoBackend.c
+ *
+ * Copyright 2021 Avérous Julien-Pierre
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <CommonCrypto/CommonCrypto.h>
+#include <dispatch/dispatch.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include <libkern/OSByteOrder.h>
+
+#if defined(SM_CRYPTO_OPENSSL) && SM_CRYPTO_OPENSSL
+#	include <openssl/evp.h>
+#endif
+
+#include "SMCryptoBackend.h"
+
+
+
+/*
+** Defines
+*/
+#pragma mark - Defines
+
+#define kCCModeXTS 				8
+
+#define kSMCryptoBackendEnvironment	"SMCRYPTOFILE_BACKEND"
+
+
+
+/*
+** Macros
+*/
+#pragma mark - Macros
+
+// Debug log.
+#if defined(DEBUG_LOG) && DEBUG_LOG
+#	define SMCryptoDebugLog(Str, Arg...) fprintf(stderr, Str, ## Arg)
+#else
+#	define SMCryptoDebugLog(Str, Arg...) ((void)0)
+#endif
+
+
+
+/*
+** Prototypes
+*/
+#pragma mark - Prototypes
+
+// -- Helpers --
+static void * obfuscated_dlsym(void *handle, const char *nm1, const char *nm2, const char *nm3);
+
+// -- CommonCrypto --
+static bool SMCryptoBackendCCAvailable(void);
+
+static bool SMCryptoBackendCCXTSInit(SMCryptoBackendContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize);
+static void SMCryptoBackendCCXTSClean(SMCryptoBackendContext *ctx);
+
+static bool SMCryptoBackendCCXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+static bool SMCryptoBackendCCXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+
+static bool SMCryptoBackendCCCBCEncrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output);
+static bool SMCryptoBackendCCCBCDecrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output);
+
+static bool		SMCryptoBackendCCPBKDF2(const char *password, size_t passwordLen, const void *salt, size_t saltLen, unsigned rounds, void *derivedKey, size_t derivedKeySize);
+static unsigned	SMCryptoBackendCCPBKDF2Calibrate(size_t passwordLen, size_t saltLen, size_t derivedKeySize, unsigned milliseconds);
+
+static bool		SMCryptoBackendCCSHA256(const void *input, size_t length, void *digest);
+
+// > Lazy CommonCrypto SPI.
+static CCCryptorStatus lazy_CCCryptorEncryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
+static CCCryptorStatus lazy_CCCryptorDecryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
+
+// -- Built-in --
+static bool SMCryptoBackendBuiltinAvailable(void);
+
+static bool SMCryptoBackendBuiltinXTSInit(SMCryptoBackendContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize);
+static void SMCryptoBackendBuiltinXTSClean(SMCryptoBackendContext *ctx);
+
+static bool SMCryptoBackendBuiltinXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+static bool SMCryptoBackendBuiltinXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+
+// -- Reference --
+static bool SMCryptoBackendReferenceXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+static bool SMCryptoBackendReferenceXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+
+// -- OpenSSL --
+#if defined(SM_CRYPTO_OPENSSL) && SM_CRYPTO_OPENSSL
+
+static bool SMCryptoBackendOpenSSLAvailable(void);
+
+static bool SMCryptoBackendOpenSSLXTSInit(SMCryptoBackendContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize);
+static void SMCryptoBackendOpenSSLXTSClean(SMCryptoBackendContext *ctx);
+
+static bool SMCryptoBackendOpenSSLXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+static bool SMCryptoBackendOpenSSLXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+
+static bool SMCryptoBackendOpenSSLCBCEncrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output);
+static bool SMCryptoBackendOpenSSLCBCDecrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output);
+
+static bool		SMCryptoBackendOpenSSLPBKDF2(const char *password, size_t passwordLen, const void *salt, size_t saltLen, unsigned rounds, void *derivedKey, size_t derivedKeySize);
+static unsigned	SMCryptoBackendOpenSSLPBKDF2Calibrate(size_t passwordLen, size_t saltLen, size_t derivedKeySize, unsigned milliseconds);
+
+static bool		SMCryptoBackendOpenSSLSHA256(const void *input, size_t length, void *digest);
+
+#endif
+
+
+
+/*
+** Globals
+*/
+#pragma mark - Globals
+
+static const SMCryptoBackend gBackendCommonCrypto = {
+	.identifier			= SMCryptoFileBackendCommonCrypto,
+	.name				= "commoncrypto",
+	.available			= SMCryptoBackendCCAvailable,
+	.xtsInit			= SMCryptoBackendCCXTSInit,
+	.xtsClean			= SMCryptoBackendCCXTSClean,
+	.xtsEncrypt			= SMCryptoBackendCCXTSEncrypt,
+	.xtsDecrypt			= SMCryptoBackendCCXTSDecrypt,
+	.cbcEncrypt			= SMCryptoBackendCCCBCEncrypt,
+	.cbcDecrypt			= SMCryptoBackendCCCBCDecrypt,
+	.pbkdf2				= SMCryptoBackendCCPBKDF2,
+	.pbkdf2Calibrate	= SMCryptoBackendCCPBKDF2Calibrate,
+	.sha256				= SMCryptoBackendCCSHA256,
+};
+
+// Built-in and reference backends only replace the XTS data path: the header and PBKDF2 run once per open, and stay on the system library.
+static const SMCryptoBackend gBackendBuiltin = {
+	.identifier			= SMCryptoFileBackendBuiltin,
+	.name				= "builtin",
+	.available			= SMCryptoBackendBuiltinAvailable,
+	.xtsInit			= SMCryptoBackendBuiltinXTSInit,
+	.xtsClean			= SMCryptoBackendBuiltinXTSClean,
+	.xtsEncrypt			= SMCryptoBackendBuiltinXTSEncrypt,
+	.xtsDecrypt			= SMCryptoBackendBuiltinXTSDecrypt,
+	.cbcEncrypt			= SMCryptoBackendCCCBCEncrypt,
+	.cbcDecrypt			= SMCryptoBackendCCCBCDecrypt,
+	.pbkdf2				= SMCryptoBackendCCPBKDF2,
+	.pbkdf2Calibrate	= SMCryptoBackendCCPBKDF2Calibrate,
+	.sha256				= SMCryptoBackendCCSHA256,
+};
+
+static const SMCryptoBackend gBackendReference = {
+	.identifier			= SMCryptoFileBackendReference,
+	.name				= "reference",
+	.available			= SMCryptoBackendBuiltinAvailable,
+	.xtsInit			= SMCryptoBackendBuiltinXTSInit,
+	.xtsClean			= SMCryptoBackendBuiltinXTSClean,
+	.xtsEncrypt			= SMCryptoBackendReferenceXTSEncrypt,
+	.xtsDecrypt			= SMCryptoBackendReferenceXTSDecrypt,
+	.cbcEncrypt			= SMCryptoBackendCCCBCEncrypt,
+	.cbcDecrypt			= SMCryptoBackendCCCBCDecrypt,
+	.pbkdf2				= SMCryptoBackendCCPBKDF2,
+	.pbkdf2Calibrate	= SMCryptoBackendCCPBKDF2Calibrate,
+	.sha256				= SMCryptoBackendCCSHA256,
+};
+
+#if defined(SM_CRYPTO_OPENSSL) && SM_CRYPTO_OPENSSL
+static const SMCryptoBackend gBackendOpenSSL = {
+	.identifier			= SMCryptoFileBackendOpenSSL,
+	.name				= "openssl",
+	.available			= SMCryptoBackendOpenSSLAvailable,
+	.xtsInit			= SMCryptoBackendOpenSSLXTSInit,
+	.xtsClean			= SMCryptoBackendOpenSSLXTSClean,
+	.xtsEncrypt			= SMCryptoBackendOpenSSLXTSEncrypt,
+	.xtsDecrypt			= SMCryptoBackendOpenSSLXTSDecrypt,
+	.cbcEncrypt			= SMCryptoBackendOpenSSLCBCEncrypt,
+	.cbcDecrypt			= SMCryptoBackendOpenSSLCBCDecrypt,
+	.pbkdf2				= SMCryptoBackendOpenSSLPBKDF2,
+	.pbkdf2Calibrate	= SMCryptoBackendOpenSSLPBKDF2Calibrate,
+	.sha256				= SMCryptoBackendOpenSSLSHA256,
+};
+#endif
+
+static const SMCryptoBackend *gBackends[] = {
+	&gBackendCommonCrypto,
+	&gBackendBuiltin,
+	&gBackendReference,
+#if defined(SM_CRYPTO_OPENSSL) && SM_CRYPTO_OPENSSL
+	&gBackendOpenSSL,
+#endif
+};
+
+
+
+/*
+** Backends
+*/
+#pragma mark - Backends
+
+const SMCryptoBackend * SMCryptoBackendGet(SMCryptoFileBackend identifier)
+{
+	// Explicit backend.
+	if (identifier != SMCryptoFileBackendDefault)
+	{
+		for (size_t i = 0; i < sizeof(gBackends) / sizeof(gBackends[0]); i++)
+		{
+			if (gBackends[i]->identifier == identifier)
+				return gBackends[i]->available() ? gBackends[i] : NULL;
+		}
+
+		return NULL;
+	}
+
+	// Default backend.
+	// > Environment override, to A/B test backends without rebuilding (ignored for setuid / setgid processes).
+	const char *envName = (issetugid() == 0 ? getenv(kSMCryptoBackendEnvironment) : NULL);
+
+	if (envName && *envName)
+	{
+		for (size_t i = 0; i < sizeof(gBackends) / sizeof(gBackends[0]); i++)
+		{
+			if (strcasecmp(gBackends[i]->name, envName) == 0 && gBackends[i]->available())
+				return gBackends[i];
+		}
+
+		SMCryptoDebugLog("Warning: Unknown or unavailable backend '%s' - use default.\n", envName);
+	}
+
+	// > Prefer the built-in engine when the CPU accelerates it: it avoids the SPI call overhead, and works where the SPI is missing.
+	if (SMCryptoXTSEngineIsAccelerated(SMCryptoXTSCurrentEngine()))
+		return &gBackendBuiltin;
+
+	return &gBackendCommonCrypto;
+}
+
+
+
+/*
+** Context
+*/
+#pragma mark - Context
+
+bool SMCryptoBackendContextInit(SMCryptoBackendContext *ctx, const SMCryptoBackend *backend, const void *dataKey, const void *tweakKey, size_t keySize)
+{
+	if (!ctx || !backend)
+		return false;
+
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->backend = backend;
+
+	if (backend->xtsInit(ctx, dataKey, tweakKey, keySize) == false)
+	{
+		SMCryptoBackendContextClean(ctx);
+		return false;
+	}
+
+	SMCryptoDebugLog("Info: Crypto backend: %s (XTS engine: %s).\n", backend->name, SMCryptoXTSEngineName(SMCryptoXTSCurrentEngine()));
+
+	return true;
+}
+
+void SMCryptoBackendContextClean(SMCryptoBackendContext *ctx)
+{
+	if (!ctx || !ctx->backend)
+		return;
+
+	ctx->backend->xtsClean(ctx);
+
+	memset_s(ctx, sizeof(*ctx), 0, sizeof(*ctx));
+}
+
+
+
+/*
+** CommonCrypto
+*/
+#pragma mark - CommonCrypto
+
+static bool SMCryptoBackendCCAvailable(void)
+{
+	return true;
+}
+
+
+#pragma mark > XTS
+
+static bool SMCryptoBackendCCXTSInit(SMCryptoBackendContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize)
+{
+	CCCryptorStatus	status;
+	CCCryptorRef	encryptor = NULL;
+	CCCryptorRef	decryptor = NULL;
+
+	// > Encryptor.
+    status = CCCryptorCreateWithMode(kCCEncrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, dataKey, keySize, tweakKey, keySize, 0, 0, &encryptor);
+
+	if (status != kCCSuccess)
+	{
+		SMCryptoDebugLog("Error: Can't create encrypt engine (%d).\n", status);
+		return false;
+	}
+
+	ctx->encryptor = encryptor;
+
+	// > Decryptor.
+	status = CCCryptorCreateWithMode(kCCDecrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, dataKey, keySize, tweakKey, keySize, 0, 0, &decryptor);
+
+	if (status != kCCSuccess)
+	{
+		SMCryptoDebugLog("Error: Can't create decrypt engine (%d).\n", status);
+		return false;
+	}
+
+	ctx->decryptor = decryptor;
+
+	// > Built-in XTS engine, used when the SPI is not available.
+	if (SMCryptoXTSContextInit(&ctx->xts, dataKey, tweakKey, keySize) == false)
+	{
+		SMCryptoDebugLog("Error: Can't create built-in XTS engine.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void SMCryptoBackendCCXTSClean(SMCryptoBackendContext *ctx)
+{
+	if (ctx->encryptor)
+		CCCryptorRelease((CCCryptorRef)ctx->encryptor);
+
+	if (ctx->decryptor)
+		CCCryptorRelease((CCCryptorRef)ctx->decryptor);
+
+	SMCryptoXTSContextClean(&ctx->xts);
+}
+
+static bool SMCryptoBackendCCXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	const uint8_t	*cinput = input;
+	uint8_t			*coutput = output;
+	size_t			count = length / unitSize;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		// > Generate the unit number tweak.
+		uint8_t		iv_tweak[kCCBlockSizeAES128];
+		uint64_t	*tw_int = (uint64_t *)iv_tweak;
+
+		tw_int[0] = OSSwapHostToLittleInt64(firstUnit + i);
+		tw_int[1] = 0;
+
+		// > Crypt.
+		CCCryptorStatus status = lazy_CCCryptorEncryptDataBlock((CCCryptorRef)ctx->encryptor, iv_tweak, cinput + i * unitSize, unitSize, coutput + i * unitSize);
+
+		// > SPI not available: fallback to built-in engine.
+		if (status == kCCUnimplemented)
+		{
+			SMCryptoXTSEncryptUnits(&ctx->xts, firstUnit + i, unitSize, cinput + i * unitSize, (count - i) * unitSize, coutput + i * unitSize);
+			return true;
+		}
+
+		if (status != kCCSuccess)
+			return false;
+	}
+
+	return true;
+}
+
+static bool SMCryptoBackendCCXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	const uint8_t	*cinput = input;
+	uint8_t			*coutput = output;
+	size_t			count = length / unitSize;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		// > Generate the unit number tweak.
+		uint8_t		iv_tweak[kCCBlockSizeAES128];
+		uint64_t	*tw_int = (uint64_t *)iv_tweak;
+
+		tw_int[0] = OSSwapHostToLittleInt64(firstUnit + i);
+		tw_int[1] = 0;
+
+		// > Decrypt.
+		CCCryptorStatus status = lazy_CCCryptorDecryptDataBlock((CCCryptorRef)ctx->decryptor, iv_tweak, cinput + i * unitSize, unitSize, coutput + i * unitSize);
+
+		// > SPI not available: fallback to built-in engine.
+		if (status == kCCUnimplemented)
+		{
+			SMCryptoXTSDecryptUnits(&ctx->xts, firstUnit + i, unitSize, cinput + i * unitSize, (count - i) * unitSize, coutput + i * unitSize);
+			return true;
+		}
+
+		if (status != kCCSuccess)
+			return false;
+	}
+
+	return true;
+}
+
+
+#pragma mark > CBC
+
+static bool SMCryptoBackendCCCBCEncrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output)
+{
+	CCCryptorStatus status = CCCrypt(kCCEncrypt, kCCAlgorithmAES, 0, key, keySize, iv, input, length, output, length, NULL);
+
+	if (status != kCCSuccess)
+	{
+		SMCryptoDebugLog("Error: Can't crypt CBC (%d).\n", status);
+		return false;
+	}
+
+	return true;
+}
+
+static bool SMCryptoBackendCCCBCDecrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output)
+{
+	CCCryptorStatus status = CCCrypt(kCCDecrypt, kCCAlgorithmAES, 0, key, keySize, iv, input, length, output, length, NULL);
+
+	if (status != kCCSuccess)
+	{
+		SMCryptoDebugLog("Error: Can't decrypt CBC (%d).\n", status);
+		return false;
+	}
+
+	return true;
+}
+
+
+#pragma mark > PBKDF2
+
+static bool SMCryptoBackendCCPBKDF2(const char *password, size_t passwordLen, const void *salt, size_t saltLen, unsigned rounds, void *derivedKey, size_t derivedKeySize)
+{
+	int status = CCKeyDerivationPBKDF(kCCPBKDF2, password, passwordLen, salt, saltLen, kCCPRFHmacAlgSHA256, rounds, derivedKey, derivedKeySize);
+
+	if (status != kCCSuccess)
+	{
+		SMCryptoDebugLog("Error: Can't derivate password (%d).\n", status);
+		return false;
+	}
+
+	return true;
+}
+
+static unsigned SMCryptoBackendCCPBKDF2Calibrate(size_t passwordLen, size_t saltLen, size_t derivedKeySize, unsigned milliseconds)
+{
+	return CCCalibratePBKDF(kCCPBKDF2, passwordLen, saltLen, kCCPRFHmacAlgSHA256, derivedKeySize, milliseconds);
+}
+
+
+#pragma mark > SHA-256
+
+static bool SMCryptoBackendCCSHA256(const void *input, size_t length, void *digest)
+{
+	if (length > UINT32_MAX)
+		return false;
+	
+	CC_SHA256(input, (CC_LONG)length, digest);
+	
+	return true;
+}
+
+
+#pragma mark > Lazy CommonCrypto SPI
+
+/*
+ SPI Header, needed for XTS.
+
+ Note :		Even if Apple offers to use XTS mode with kCCModeXTS (defined in public header), the functions necessary to use this mode are in a SPI header (work-in-progress).
+
+			The following lazy_ functions are bridges to this SPI functions. They didn't evolved since 10.7, and are used in libCoreStorage, so this should not be a problem to use them.
+			They are essential to do XTS with CommonCrypto. When they are not available, we fallback to the built-in engine (SMCryptoXTS), which is constant-time bitsliced when the CPU has no AES instructions.
+
+			I use dlopen / dlsym to prevent Apple to forbid MAS applications which try to use SMCryptoFile and its SPI CC functions.
+
+ Ticket :	rdar://16576209
+*/
+
+static CCCryptorStatus lazy_CCCryptorEncryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut)
+{
+	static dispatch_once_t	onceToken;
+	static CCCryptorStatus	(*ptr_CCCryptorEncryptDataBlock)(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
+
+	dispatch_once(&onceToken, ^{
+		void *handle = dlopen("/usr/lib/system/libcommonCrypto.dylib", RTLD_LAZY);
+
+		if (handle)
+			ptr_CCCryptorEncryptDataBlock = obfuscated_dlsym(handle, "CCCry", "ptorEncryptDa", "taBlock");
+	});
+
+	if (!ptr_CCCryptorEncryptDataBlock)
+		return kCCUnimplemented;
+
+	return ptr_CCCryptorEncryptDataBlock(cryptorRef, iv, dataIn, dataInLength, dataOut);
+}
+
+static CCCryptorStatus lazy_CCCryptorDecryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut)
+{
+	static dispatch_once_t	onceToken;
+	static CCCryptorStatus	(*ptr_CCCryptorDecryptDataBlock)(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
+
+	dispatch_once(&onceToken, ^{
+		void *handle = dlopen("/usr/lib/system/libcommonCrypto.dylib", RTLD_LAZY);
+
+		if (handle)
+			ptr_CCCryptorDecryptDataBlock = obfuscated_dlsym(handle, "CCCry", "ptorDecryptDa", "taBlock");
+	});
+
+	if (!ptr_CCCryptorDecryptDataBlock)
+		return kCCUnimplemented;
+
+	return ptr_CCCryptorDecryptDataBlock(cryptorRef, iv, dataIn, dataInLength, dataOut);
+}
+
+
+
+/*
+** Built-in
+*/
+#pragma mark - Built-in
+
+static bool SMCryptoBackendBuiltinAvailable(void)
+{
+	return true;
+}
+
+static bool SMCryptoBackendBuiltinXTSInit(SMCryptoBackendContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize)
+{
+	if (SMCryptoXTSContextInit(&ctx->xts, dataKey, tweakKey, keySize) == false)
+	{
+		SMCryptoDebugLog("Error: Can't create built-in XTS engine.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void SMCryptoBackendBuiltinXTSClean(SMCryptoBackendContext *ctx)
+{
+	SMCryptoXTSContextClean(&ctx->xts);
+}
+
+static bool SMCryptoBackendBuiltinXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	// Tweaks of consecutive units are derived and encrypted in batch.
+	SMCryptoXTSEncryptUnits(&ctx->xts, firstUnit, unitSize, input, length, output);
+
+	return true;
+}
+
+static bool SMCryptoBackendBuiltinXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	SMCryptoXTSDecryptUnits(&ctx->xts, firstUnit, unitSize, input, length, output);
+
+	return true;
+}
+
+
+
+/*
+** Reference
+*/
+#pragma mark - Reference
+
+static bool SMCryptoBackendReferenceXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	return SMCryptoXTSEncryptUnitsWithEngine(SMCryptoXTSEngineReference, &ctx->xts, firstUnit, unitSize, input, length, output);
+}
+
+static bool SMCryptoBackendReferenceXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	return SMCryptoXTSDecryptUnitsWithEngine(SMCryptoXTSEngineReference, &ctx->xts, firstUnit, unitSize, input, length, output);
+}
+
+
+
+/*
+** OpenSSL
+*/
+#pragma mark - OpenSSL
+
+#if defined(SM_CRYPTO_OPENSSL) && SM_CRYPTO_OPENSSL
+
+static bool SMCryptoBackendOpenSSLAvailable(void)
+{
+	return true;
+}
+
+
+#pragma mark > XTS
+
+static const EVP_CIPHER * SMCryptoBackendOpenSSLXTSCipher(size_t keySize)
+{
+	switch (keySize)
+	{
+		case kCCKeySizeAES128:
+			return EVP_aes_128_xts();
+		case kCCKeySizeAES256:
+			return EVP_aes_256_xts();
+		default:
+			return NULL;
+	}
+}
+
+static bool SMCryptoBackendOpenSSLXTSInit(SMCryptoBackendContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize)
+{
+	const EVP_CIPHER	*cipher = SMCryptoBackendOpenSSLXTSCipher(keySize);
+	uint8_t				key[2 * kCCKeySizeAES256];
+	bool				result = false;
+
+	// > No AES-192 XTS in OpenSSL: use the built-in engine for this key size.
+	if (!cipher)
+		return SMCryptoBackendBuiltinXTSInit(ctx, dataKey, tweakKey, keySize);
+
+	// > OpenSSL XTS key is data key | tweak key.
+	memcpy(key, dataKey, keySize);
+	memcpy(key + keySize, tweakKey, keySize);
+
+	// > Encryptor.
+	ctx->encryptor = EVP_CIPHER_CTX_new();
+
+	if (!ctx->encryptor || EVP_EncryptInit_ex(ctx->encryptor, cipher, NULL, key, NULL) != 1)
+	{
+		SMCryptoDebugLog("Error: Can't create OpenSSL encrypt engine.\n");
+		goto clean;
+	}
+
+	// > Decryptor.
+	ctx->decryptor = EVP_CIPHER_CTX_new();
+
+	if (!ctx->decryptor || EVP_DecryptInit_ex(ctx->decryptor, cipher, NULL, key, NULL) != 1)
+	{
+		SMCryptoDebugLog("Error: Can't create OpenSSL decrypt engine.\n");
+		goto clean;
+	}
+
+	result = true;
+
+clean:
+	memset_s(key, sizeof(key), 0, sizeof(key));
+
+	return result;
+}
+
+static void SMCryptoBackendOpenSSLXTSClean(SMCryptoBackendContext *ctx)
+{
+	if (ctx->encryptor)
+		EVP_CIPHER_CTX_free(ctx->encryptor);
+
+	if (ctx->decryptor)
+		EVP_CIPHER_CTX_free(ctx->decryptor);
+
+	SMCryptoXTSContextClean(&ctx->xts);
+}
+
+static bool SMCryptoBackendOpenSSLXTSCrypt(EVP_CIPHER_CTX *cipherCtx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	const uint8_t	*cinput = input;
+	uint8_t			*coutput = output;
+	size_t			count = length / unitSize;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		// > Generate the unit number tweak.
+		uint8_t		iv_tweak[kCCBlockSizeAES128];
+		uint64_t	*tw_int = (uint64_t *)iv_tweak;
+		int			outLength = 0;
+
+		tw_int[0] = OSSwapHostToLittleInt64(firstUnit + i);
+		tw_int[1] = 0;
+
+		// > Crypt / decrypt (an OpenSSL XTS update is a whole data-unit).
+		if (EVP_CipherInit_ex(cipherCtx, NULL, NULL, NULL, iv_tweak, -1) != 1)
+			return false;
+
+		if (EVP_CipherUpdate(cipherCtx, coutput + i * unitSize, &outLength, cinput + i * unitSize, (int)unitSize) != 1 || (size_t)outLength != unitSize)
+			return false;
+	}
+
+	return true;
+}
+
+static bool SMCryptoBackendOpenSSLXTSEncrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	if (!ctx->encryptor)
+		return SMCryptoBackendBuiltinXTSEncrypt(ctx, firstUnit, unitSize, input, length, output);
+
+	return SMCryptoBackendOpenSSLXTSCrypt(ctx->encryptor, firstUnit, unitSize, input, length, output);
+}
+
+static bool SMCryptoBackendOpenSSLXTSDecrypt(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	if (!ctx->decryptor)
+		return SMCryptoBackendBuiltinXTSDecrypt(ctx, firstUnit, unitSize, input, length, output);
+
+	return SMCryptoBackendOpenSSLXTSCrypt(ctx->decryptor, firstUnit, unitSize, input, length, output);
+}
+
+
+#pragma mark > CBC
+
+static bool SMCryptoBackendOpenSSLCBCCrypt(bool encrypt, const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output)
+{
+	const EVP_CIPHER	*cipher;
+	EVP_CIPHER_CTX		*cipherCtx;
+	int					outLength = 0;
+	int					finalLength = 0;
+	bool				result = false;
+
+	switch (keySize)
+	{
+		case kCCKeySizeAES128:
+			cipher = EVP_aes_128_cbc();
+			break;
+		case kCCKeySizeAES192:
+			cipher = EVP_aes_192_cbc();
+			break;
+		case kCCKeySizeAES256:
+			cipher = EVP_aes_256_cbc();
+			break;
+		default:
+			return false;
+	}
+
+	cipherCtx = EVP_CIPHER_CTX_new();
+
+	if (!cipherCtx)
+		return false;
+
+	if (EVP_CipherInit_ex(cipherCtx, cipher, NULL, key, iv, encrypt ? 1 : 0) != 1)
+		goto clean;
+
+	EVP_CIPHER_CTX_set_padding(cipherCtx, 0);
+
+	if (EVP_CipherUpdate(cipherCtx, output, &outLength, input, (int)length) != 1)
+		goto clean;
+
+	if (EVP_CipherFinal_ex(cipherCtx, (uint8_t *)output + outLength, &finalLength) != 1)
+		goto clean;
+
+	result = ((size_t)(outLength + finalLength) == length);
+
+clean:
+	EVP_CIPHER_CTX_free(cipherCtx);
+
+	if (!result)
+		SMCryptoDebugLog("Error: Can't %s CBC with OpenSSL.\n", encrypt ? "crypt" : "decrypt");
+
+	return result;
+}
+
+static bool SMCryptoBackendOpenSSLCBCEncrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output)
+{
+	return SMCryptoBackendOpenSSLCBCCrypt(true, key, keySize, iv, input, length, output);
+}
+
+static bool SMCryptoBackendOpenSSLCBCDecrypt(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output)
+{
+	return SMCryptoBackendOpenSSLCBCCrypt(false, key, keySize, iv, input, length, output);
+}
+
+
+#pragma mark > PBKDF2
+
+static bool SMCryptoBackendOpenSSLPBKDF2(const char *password, size_t passwordLen, const void *salt, size_t saltLen, unsigned rounds, void *derivedKey, size_t derivedKeySize)
+{
+	if (PKCS5_PBKDF2_HMAC(password, (int)passwordLen, salt, (int)saltLen, (int)rounds, EVP_sha256(), (int)derivedKeySize, derivedKey) != 1)
+	{
+		SMCryptoDebugLog("Error: Can't derivate password with OpenSSL.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static unsigned SMCryptoBackendOpenSSLPBKDF2Calibrate(size_t passwordLen, size_t saltLen, size_t derivedKeySize, unsigned milliseconds)
+{
+	// Time a derivation of sample rounds with dummy inputs, and scale it to the wanted duration (same approach as CCCalibratePBKDF).
+	const unsigned	sampleRounds = 10000;
+	char			password[passwordLen + 1];
+	uint8_t			salt[saltLen + 1];
+	uint8_t			derivedKey[derivedKeySize + 1];
+	struct timespec	start, end;
+
+	memset(password, 'a', sizeof(password));
+	memset(salt, 0, sizeof(salt));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (SMCryptoBackendOpenSSLPBKDF2(password, passwordLen, salt, saltLen, sampleRounds, derivedKey, derivedKeySize) == false)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// > Scale.
+	uint64_t elapsed = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+
+	if (elapsed == 0)
+		elapsed = 1;
+
+	uint64_t rounds = (uint64_t)sampleRounds * milliseconds * 1000000ULL / elapsed;
+
+	if (rounds < sampleRounds)
+		rounds = sampleRounds;
+	else if (rounds > UINT32_MAX)
+		rounds = UINT32_MAX;
+
+	return (unsigned)rounds;
+}
+
+
+#pragma mark > SHA-256
+
+static bool SMCryptoBackendOpenSSLSHA256(const void *input, size_t length, void *digest)
+{
+	if (EVP_Digest(input, length, digest, NULL, EVP_sha256(), NULL) != 1)
+	{
+		SMCryptoDebugLog("Error: Can't hash with OpenSSL.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+#endif
+
+
+
+/*
+** Random
+*/
+#pragma mark - Random
+
+void SMCryptoRandomCopyBytes(void *bytes, size_t count)
+{
+	// I don't want to link on Security framework just to use SecRandomCopyBytes, so…
+	static dispatch_once_t	onceToken;
+	static int				(*ptr_SecRandomCopyBytes)(const void * rnd, size_t count, uint8_t *bytes);
+	static void				**pptr_kSecRandomDefault;
+	static void				*ptr_kSecRandomDefault = NULL;
+
+	dispatch_once(&onceToken, ^{
+		void *handle = dlopen("/System/Library/Frameworks/Security.framework/Security", RTLD_LAZY);
+
+		if (handle)
+		{
+			ptr_SecRandomCopyBytes = obfuscated_dlsym(handle, "SecRandom", "Copy", "Bytes");
+			pptr_kSecRandomDefault = (void **)obfuscated_dlsym(handle, "kSec", "Random", "Default");
+
+			if (pptr_kSecRandomDefault)
+				ptr_kSecRandomDefault = *pptr_kSecRandomDefault;
+		}
+	});
+
+	if (ptr_SecRandomCopyBytes && ptr_SecRandomCopyBytes(ptr_kSecRandomDefault, count, bytes) == 0)
+		return;
+
+	// Fall back to less secure arc4random.
+	arc4random_buf(bytes, count);
+}
+
+
+
+/*
+** Helpers
+*/
+#pragma mark - Helpers
+
+// Obfuscate dlsym symbol names by cutting them in three parts.
+static void * obfuscated_dlsym(void *handle, const char *nm1, const char *nm2, const char *nm3)
+{
+	if (!nm1 || !nm2 || !nm3)
+		return NULL;
+
+	char buffer[1024] = { 0 };
+
+	strlcat(buffer, nm1, sizeof(buffer));
+	strlcat(buffer, nm2, sizeof(buffer));
+	strlcat(buffer, nm3, sizeof(buffer));
+
+	return dlsym(handle, buffer);
+}
@@ -0,0 +1,108 @@
+/*
+ * SMCryptoBackend.h
+ *
+ * Copyright 2021 Avérous Julien-Pierre
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * -- Informations --
+ *
+ * Crypto backends used by SMCryptoFile (private).
+ *
+ * A backend provides the key setup and batch crypt / decrypt of XTS data blocks, the CBC crypt / decrypt of the header, the PBKDF2 password derivation, and the SHA-256 of the authentication tree.
+ * It's selected when a file is created or opened (see SMCryptoFileOptions and the SMCRYPTOFILE_BACKEND environment variable).
+ *
+ * Available backends:
+ * - CommonCrypto: XTS with the CommonCrypto SPI (built-in XTS engine when the SPI is missing).
+ * - Built-in: fastest SMCryptoXTS engine for this CPU, CommonCrypto for the header, PBKDF2 and SHA-256.
+ * - Reference: SMCryptoXTS scalar reference engine, CommonCrypto for the header, PBKDF2 and SHA-256.
+ * - OpenSSL: EVP aes-*-xts (built-in engine for AES-192, which OpenSSL XTS lacks), aes-*-cbc, PKCS5_PBKDF2_HMAC and sha256. Only when built with SM_CRYPTO_OPENSSL=1 (and linked with libcrypto).
+ *
+ */
+
+
+#ifndef SMCRYPTOBACKEND_H_
+# define SMCRYPTOBACKEND_H_
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stddef.h>
+
+# include "SMCryptoFile.h"
+# include "SMCryptoXTS.h"
+
+
+/*
+** Types
+*/
+#pragma mark - Types
+
+typedef struct SMCryptoBackend SMCryptoBackend;
+
+typedef struct SMCryptoBackendContext
+{
+	const SMCryptoBackend	*backend;
+
+	SMCryptoXTSContext		xts;		// Built-in XTS engine context.
+	void					*encryptor;	// Library XTS encrypt context (CCCryptorRef, EVP_CIPHER_CTX *).
+	void					*decryptor;	// Library XTS decrypt context.
+} SMCryptoBackendContext;
+
+struct SMCryptoBackend
+{
+	SMCryptoFileBackend	identifier;
+	const char			*name;
+
+	bool		(*available)(void);
+
+	// -- Key setup --
+	bool		(*xtsInit)(SMCryptoBackendContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize);
+	void		(*xtsClean)(SMCryptoBackendContext *ctx);
+
+	// -- XTS block batch (consecutive data-units, the tweak of unit n is n) --
+	bool		(*xtsEncrypt)(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+	bool		(*xtsDecrypt)(const SMCryptoBackendContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+
+	// -- CBC header (no padding) --
+	bool		(*cbcEncrypt)(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output);
+	bool		(*cbcDecrypt)(const void *key, size_t keySize, const void *iv, const void *input, size_t length, void *output);
+
+	// -- PBKDF2 (HMAC-SHA256) --
+	bool		(*pbkdf2)(const char *password, size_t passwordLen, const void *salt, size_t saltLen, unsigned rounds, void *derivedKey, size_t derivedKeySize);
+	unsigned	(*pbkdf2Calibrate)(size_t passwordLen, size_t saltLen, size_t derivedKeySize, unsigned milliseconds); // Rounds count to spend milliseconds. 0 on error.
+
+	// -- SHA-256 (authentication tree) --
+	bool		(*sha256)(const void *input, size_t length, void *digest);
+};
+
+
+
+/*
+** Functions
+*/
+#pragma mark - Functions
+
+// -- Backends --
+const SMCryptoBackend *	SMCryptoBackendGet(SMCryptoFileBackend backend); // NULL if the backend is unknown or not available. SMCryptoFileBackendDefault is resolved to the best available backend.
+
+// -- Context --
+bool	SMCryptoBackendContextInit(SMCryptoBackendContext *ctx, const SMCryptoBackend *backend, const void *dataKey, const void *tweakKey, size_t keySize);
+void	SMCryptoBackendContextClean(SMCryptoBackendContext *ctx);
+
+// -- Random --
+void	SMCryptoRandomCopyBytes(void *bytes, size_t count);
+
+#endif
@@ -24,13 +24,18 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <aio.h>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <mach/mach.h>
+#include <pthread.h>
 
 #include "SMCryptoFile.h"
+#include "SMCryptoBackend.h"
 
 
 
@@ -39,21 +44,59 @@
 */
 #pragma mark - Defines
 
-#define kCCModeXTS 				8
-
 #define kCFMagicValue			0xC3160FF4
 #define kCFCheckValue			0xB4D9E5AC
 
-#define kCFCurrentVersion		1
+#define kCFLegacyVersion		1	// Fixed 256 bytes data blocks.
+#define kCFBlockSizeVersion		2	// Data block size stored in the prefix.
+#define kCFDataAlignVersion		3	// Data area alignment stored in the prefix.
+#define kCFCurrentVersion		4	// Flags stored in the prefix.
+
+#define kCFFlagSparse			0x01			// Never written blocks are holes (all crypted bytes to zero), read as zeros.
+#define kCFFlagLazyLength		0x02			// Header data length only written at sync points, recovered from the data size on open.
+#define kCFFlagDualHeader		0x04			// Header written alternately in two slots, the newest valid one is current.
+#define kCFFlagAuthenticated	0x08			// Data blocks authenticated by a hash tree in a side file, its root in the header.
+#define kCFFlagsKnown			(kCFFlagSparse | kCFFlagLazyLength | kCFFlagDualHeader | kCFFlagAuthenticated)
 
 #define kCFSaltSize				16
 
-#define kCFFileBlockSize		(16 * kCCBlockSizeAES128)	// 256 bytes.
-#define kCFFileCacheSize		(16 * kCFFileBlockSize)		// 4096 bytes.
+#define kCFFileMinBlockSize		(16 * kCCBlockSizeAES128)		// 256 bytes.
+#define kCFFileMaxBlockSize		(64 * 1024)						// 64 KiB.
+#define kCFFileDefaultBlockSize	kCFFileMinBlockSize				// 256 bytes (legacy block size).
+#define kCFFileDefaultCacheSize	(16 * kCFFileDefaultBlockSize)	// 4096 bytes.
+#define kCFFileMinCacheSize		kCFFileDefaultCacheSize			// 4096 bytes.
+#define kCFFileMaxCacheSize		(64 * 1024 * 1024)				// 64 MiB.
+#define kCFFileCacheSlotSize	(64 * 1024)						// 64 KiB (automatic slots count).
+#define kCFFileMaxCacheSlots	4096
+#define kCFFileMinDataAlignment	512								// Device sector.
+#define kCFFileMaxDataAlignment	(64 * 1024)						// 64 KiB.
+
+#define kCFFileReadAheadMaxSlots	8	// Automatic read-ahead: a quarter of the slots, up to this count.
+#define kCFFileReadAheadTrigger		2	// Sequential (or strided) reads in a row before reading ahead.
+#define kCFFileReadAheadNoRead		UINT64_MAX	// Pattern detection: no read yet (readAheadLastEnd).
+
+#define kCFFileStagingSize		(1024 * 1024)	// 1 MiB (crypted data of large writes and flushes, per disk write).
+#define kCFFileIOBatchMax		16				// Disk writes submitted at once (AIO_LISTIO_MAX on Darwin).
+
+#define kCFFileMinPreallocation	(1024 * 1024)			// 1 MiB.
+#define kCFFileMaxPreallocation	(1024 * 1024 * 1024)	// 1 GiB.
 
 #define kCFFilePrefixOffset		0
-#define kCFFileHeaderOffset		(kCFFilePrefixOffset + sizeof(SMCryptoFilePrefix))
-#define kCFFileDataOffset		(kCFFileHeaderOffset + sizeof(SMCryptoFileHeader))
+#define kCFFileLegacyPrefixSize	offsetof(SMCryptoFilePrefix, blockSizeShift)
+#define kCFFileV2PrefixSize		offsetof(SMCryptoFilePrefix, dataAlignShift)
+#define kCFFileV3PrefixSize		offsetof(SMCryptoFilePrefix, flags)
+
+#define kCFFileLegacyHeaderSize	offsetof(SMCryptoFileHeader, generation)
+#define kCFFileDualHeaderSize	offsetof(SMCryptoFileHeader, treeRoot)
+#define kCFFileDualHeaderSlots	2
+
+#define kCFTreeFileSuffix		"-tree"							// Side file of the authentication tree (path + suffix).
+#define kCFTreeHashSize			CC_SHA256_DIGEST_LENGTH			// 32 bytes.
+#define kCFTreePageSize			4096							// Leaf hashes page (read, verified and written as a whole).
+#define kCFTreePageLeaves		(kCFTreePageSize / kCFTreeHashSize)	// 128 leaves.
+#define kCFTreeMinCapacity		16								// Leaf pages capacity of the smallest tree.
+#define kCFTreeCachePages		64								// Leaf pages cached (256 KiB).
+#define kCFTreeAreas			2								// Page hashes areas per capacity: the committed one, and the spare one written by the next commit.
 
 
 
@@ -80,6 +123,8 @@ static atomic_uint_fast64_t gPwriteCount = 0;
 static atomic_uint_fast64_t gPreadSize = 0;
 static atomic_uint_fast64_t gPwriteSize = 0;
 
+static atomic_uint_fast64_t gListioCount = 0;
+
 static dispatch_once_t gOnceToken;
 
 #	define sm_init()																				\
@@ -88,6 +133,7 @@ static dispatch_once_t gOnceToken;
 				atexit_b(^{																			\
 					fprintf(stderr, "pread:  count=%llu; size=%llu\n", gPreadCount, gPreadSize);	\
 					fprintf(stderr, "pwrite: count=%llu; size=%llu\n", gPwriteCount, gPwriteSize);	\
+					fprintf(stderr, "listio: count=%llu\n", gListioCount);							\
 				});																					\
 			});																						\
 		})
@@ -110,9 +156,18 @@ static dispatch_once_t gOnceToken;
 			res;														\
 		})
 
+#	define sm_lio_listio(Mode, List, Count)							\
+		({																\
+			sm_init();													\
+			atomic_fetch_add(&gListioCount, 1);							\
+			int res = lio_listio(Mode, List, Count, NULL);				\
+			res;														\
+		})
+
 #else
 #	define sm_pread(FileDecriptor, Buffer, Size, Offset)	pread(FileDecriptor, Buffer, Size, Offset)
 #	define sm_pwrite(FileDecriptor, Buffer, Size, Offset)	pwrite(FileDecriptor, Buffer, Size, Offset)
+#	define sm_lio_listio(Mode, List, Count)					lio_listio(Mode, List, Count, NULL)
 #endif
 
 // Round up or down. Round should be a power of 2.
@@ -128,6 +183,15 @@ static dispatch_once_t gOnceToken;
 	})
 #endif
 
+// Min.
+#if !defined(MIN)
+#	define MIN(A, B) ({ \
+		__typeof__ (A) __A = (A);	\
+		__typeof__ (B) __B = (B);	\
+		__A < __B ? __A : __B;		\
+	})
+#endif
+
 
 
 /*
@@ -148,6 +212,15 @@ typedef struct SMCryptoFilePrefix
 	
 	uint8_t		headerIV[kCCBlockSizeAES128];	// Initial vector used to crypt / decrypt the header.
 	
+	// -- Version 2 --
+	uint8_t		blockSizeShift;					// Data block size, as a power of 2 (8 -> 256 bytes, 16 -> 64 KiB). Implicitly 8 in version 1.
+	
+	// -- Version 3 --
+	uint8_t		dataAlignShift;					// Data area alignment in file, as a power of 2 (9 -> 512 bytes, 16 -> 64 KiB). Implicitly 0 (data right after the header) before version 3.
+	
+	// -- Version 4 --
+	uint8_t		flags;							// File flags (kCFFlag*). Implicitly 0 before version 4.
+	
 } __attribute__ ((packed)) SMCryptoFilePrefix;
 
 typedef struct SMCryptoFileHeader
@@ -160,7 +233,47 @@ typedef struct SMCryptoFileHeader
 	uint8_t		xtsKey[kCCKeySizeAES256];		// Crypt key used to crypt / decrypt XTS data.
 	uint8_t		xtsTweak[kCCKeySizeAES256];		// Crypt key used to crypt / decrypt XTS data.
 	
-} __attribute__ ((packed)) SMCryptoFileHeader;	// 80 bytes = 640 bits = 5 AES block
+	// -- Dual header (kCFFlagDualHeader) --
+	uint64_t	generation;						// Count of header writes: the valid slot with the highest generation is current.
+	uint32_t	headerCRC;						// CRC32 of the header but this field and the padding, to detect a torn write.
+	uint32_t	reserved;						// Padding to the AES block size.
+	
+	// -- Authentication tree (kCFFlagAuthenticated) --
+	uint8_t		treeRoot[kCFTreeHashSize];		// Root hash of the tree of the data blocks, as of the last header write.
+	uint8_t		treeArea;						// Page hashes area of the side file holding the tree of treeRoot (0 or 1).
+	uint8_t		treeReserved[15];				// Padding to the AES block size.
+	
+} __attribute__ ((packed)) SMCryptoFileHeader;	// 144 bytes = 9 AES block (96 bytes = 6 AES block without authentication tree, 80 bytes = 5 AES block without dual header)
+
+typedef struct SMCryptoFileCacheSlot
+{
+	uint8_t		*data;			// Clear data (cacheSlotSize bytes).
+	uint64_t	*validBlocks;	// Bitmap of the blocks holding file data.
+	uint64_t	*dirtyBlocks;	// Bitmap of the blocks not synced with data in the file.
+	uint64_t	offset;			// Slot position in the file (slot number * cacheSlotSize).
+	int32_t		next;			// Next slot in the same lookup bucket (-1: none).
+	bool		used;			// The slot holds data of the file.
+	bool		dirty;			// At least one block is dirty.
+	bool		referenced;		// Accessed since the last pass of the eviction clock.
+	
+	// > Worker.
+	bool		busy;					// Handed to the worker, not collected yet (data owned by the worker until collected).
+	bool		workWrite;				// Worker task: write the dirty blocks (write-behind), else load the slot (read-ahead).
+	bool		workDone;				// Worker has finished (protected by workerMutex).
+	bool		workFailed;				// Worker failed to read, crypt or write (protected by workerMutex).
+	uint64_t	readAheadBlocks;		// Blocks loaded from the start of the slot.
+	uint64_t	readAheadFileLength;	// Bytes read from disk (following blocks are zeros).
+	uint64_t	writeEnd;				// End of the region written in background (reserved on disk when queued).
+} SMCryptoFileCacheSlot;
+
+typedef struct SMCryptoFileTreePage
+{
+	uint8_t		*leaves;		// Leaf hashes (kCFTreePageLeaves hashes).
+	uint64_t	number;			// Page number in the tree.
+	bool		used;			// The page holds leaves of the tree.
+	bool		dirty;			// Leaves not written in the side file, and page hash not updated.
+	bool		referenced;		// Accessed since the last pass of the eviction clock.
+} SMCryptoFileTreePage;
 
 struct SMCryptoFile
 {
@@ -168,23 +281,106 @@ struct SMCryptoFile
 	// > Back file.
 	int fd; // File descriptor.
 	
-	uint64_t fileDataLen;	// Concrete len of data on disk (including padding, but not header)
+	uint64_t fileDataLen;		// Concrete len of data written on disk (including padding, but not header)
+	uint64_t fileReservedEnd;	// End of the data written or queued for writing (batched flush, write-behind): gaps are filled and blocks read up to it.
+	
+	uint64_t preallocationSize;	// Disk space reserved ahead of the data as the file grows (0: none).
+	uint64_t preallocatedEnd;	// End of the data space reserved on disk (F_PREALLOCATE), past fileDataLen when some space is reserved ahead.
 	
 	// > Flags.
 	bool readonly;
+	bool noCache;	// The system cache is bypassed (F_NOCACHE).
 	
 	// > Cryptors.
-	CCCryptorRef dataEncrypt;
-	CCCryptorRef dataDecrypt;
+	const SMCryptoBackend	*backend;	// Crypto backend (header, password derivation, data).
+	SMCryptoBackendContext	dataCrypto;	// Data XTS keys.
+	
+	// > Layout.
+	uint64_t headerOffset;	// First header slot position in file (the prefix size depends on its version).
+	uint64_t dataOffset;	// First data block position in file.
+	uint64_t blockSize;		// Data block size (XTS data-unit).
+	bool sparse;			// Gaps are left as holes (kCFFlagSparse).
+	bool lazyLength;		// Header data length only written at sync points (kCFFlagLazyLength).
+	uint64_t headerSize;	// Crypted header size (depends on kCFFlagDualHeader).
+	uint64_t headerSlots;	// Header slots, written alternately (kCFFlagDualHeader), or 1.
+	bool authenticated;		// Data blocks authenticated by a hash tree (kCFFlagAuthenticated).
 	
 	// > Position.
 	uint64_t currentOffset;	// Current position in file (used for read / write).
 
 	// > Cache.
-	uint8_t		cachedData[kCFFileCacheSize]; // Clear data cache.
-	uint64_t	cachedDataOffset;	// Cache offset in the file.
-	uint64_t	cachedDataSize;		// Amount of data in the cache buffer. [0; kCFFileCacheSize]
-	bool		cachedDataDirty;	// Data in the cache is not synced with data in the file.
+	SMCryptoFileCacheSlot	*cacheSlots;		// Clear data slots (CLOCK eviction).
+	SMCryptoFileCacheSlot	**cacheFlushList;	// Dirty slots sorted for flush (cacheSlotCount entries).
+	int32_t					*cacheBuckets;		// Slot lookup by slot number: first slot of each bucket (-1: none).
+	uint32_t				cacheBucketsMask;	// Buckets count - 1.
+	SMCryptoFileCacheSlot	*cacheLastSlot;		// Last slot looked up (sequential access fast path).
+	
+	uint64_t	cacheSize;			// Cache capacity, cacheSlotCount * cacheSlotSize (requested size until the layout is prepared).
+	uint64_t	cacheSlotSize;		// Slot capacity, multiple of blockSize.
+	uint64_t	cacheSlotBlocks;	// Slot capacity, in blocks.
+	uint32_t	cacheSlotCount;		// Slots count (requested count, 0 for automatic, until the layout is prepared).
+	uint32_t	cacheClockHand;		// Next eviction candidate.
+	
+	// > Worker.
+	bool					workerRunning;		// Worker thread started.
+	bool					workerStop;			// Worker thread should exit (protected by workerMutex).
+	pthread_t				workerThread;
+	pthread_mutex_t			workerMutex;
+	pthread_cond_t			workerWork;			// Signaled when a slot is queued, or on stop.
+	pthread_cond_t			workerDone;			// Signaled when a slot task is done.
+	SMCryptoFileCacheSlot	**workerQueue;		// Ring of slots to load or write (cacheSlotCount entries, protected by workerMutex).
+	uint32_t				workerQueueHead;
+	uint32_t				workerQueueCount;
+	SMCryptoBackendContext	workerCrypto;		// Data XTS keys of the worker (backend contexts are not shared between threads).
+	uint8_t					*workerBuffer;		// Crypted data of the worker (cacheSlotSize bytes).
+	SMCryptoFileError		workerError;		// First write-behind error not reported yet (protected by workerMutex).
+	bool					workerFailed;		// workerError is set (protected by workerMutex).
+	
+	// > Read-ahead.
+	uint32_t				readAheadSlots;			// Slots loaded ahead of sequential reads (requested count, 0 for automatic, until the layout is prepared).
+	uint64_t				readAheadLastOffset;	// Pattern detection: last read offset,
+	uint64_t				readAheadLastEnd;		// its end,
+	int64_t					readAheadLastStride;	// the distance with the read before,
+	uint32_t				readAheadStreak;		// and the count of sequential or strided reads in a row.
+	uint64_t				readAheadAdvised;		// End of the region advised to the system.
+	
+	// > Write-behind.
+	uint32_t				writeBehindSlots;		// Full slots written by the worker while the next ones are filled (0: disabled).
+	uint32_t				writeBehindCount;		// Write-behind slots in flight.
+	
+	// > Mapping.
+	bool					mapData;		// Crypted data are read from a mapping of the file (read-only handles).
+	const uint8_t			*map;			// Mapping of the file, from its start (NULL: not mapped yet, or mapping failed).
+	uint64_t				mapLength;
+	int						mapAdvice;		// Current madvise() advice of the mapping.
+	
+	// > Authentication tree.
+	int						treeFd;				// Side file: leaf pages (block hashes) and page hashes areas, by capacity segments (see SMCryptoFileTreePageOffset).
+	uint64_t				treeBlocks;			// Blocks covered by the tree (leaves past them are zeros).
+	uint64_t				treePageCount;		// Leaf pages covered by the tree.
+	uint64_t				treeCapacity;		// Leaf pages capacity, power of 2 (at least kCFTreeMinCapacity).
+	uint8_t					*treeNodes;			// Tree nodes by heap index (node 1 is the root, node treeCapacity + p the hash of page p), 2 * treeCapacity hashes (locked).
+	size_t					treeNodesSize;
+	uint64_t				treeDirtyStart;		// Range of page hashes changed since the last commit.
+	uint64_t				treeDirtyEnd;
+	uint64_t				treeSpareStart;		// Range of page hashes the spare area misses on top of the dirty ones (changed by the last commit).
+	uint64_t				treeSpareEnd;
+	uint64_t				treeCommittedCapacity;	// Capacity of the committed area (the other area of its segment is the spare one).
+	uint64_t				*treeCopies;		// Copy of each leaf page holding its current leaves (bitmap, treeCopiesCapacity bits).
+	uint64_t				*treeCommittedCopies;	// Copy of each leaf page holding its committed leaves, never overwritten before the next commit.
+	uint64_t				treeCopiesCapacity;
+	SMCryptoFileTreePage	*treeCache;			// Leaf pages cache (CLOCK eviction, kCFTreeCachePages entries).
+	SMCryptoFileTreePage	*treeLastPage;		// Last page looked up.
+	uint32_t				treeClockHand;		// Next eviction candidate.
+	
+	// > Work buffers.
+	uint8_t		*cryptBuffer;		// Crypted data (cacheSlotSize + blockSize bytes).
+	uint8_t		*clearBlock;		// Clear block (blockSize bytes).
+	
+	void		*buffers;			// Locked allocation holding the cache and work buffers.
+	size_t		buffersSize;
+	
+	uint8_t		*stagingBuffer;		// Crypted data of large writes and flushes (kCFFileStagingSize bytes, allocated on first use). Only holds crypted data, so not locked.
 	
 	// > Header crypt key.
 	uint8_t		headerKey[kCCKeySizeAES256]; // Header crypt key.
@@ -203,6 +399,20 @@ typedef struct
 	uint64_t length;
 } SMCryptoRange;
 
+typedef struct
+{
+	struct aiocb	requests[kCFFileIOBatchMax];	// Writes, from the staging buffer.
+	unsigned		count;
+	uint64_t		stagingUsed;					// Bytes of the staging buffer used by the requests.
+} SMCryptoFileIOBatch;
+
+typedef struct
+{
+	const struct iovec	*iov;		// Segments.
+	int					index;		// Current segment.
+	size_t				offset;		// Position in the current segment.
+} SMCryptoIOVecCursor;
+
 
 
 /*
@@ -213,46 +423,151 @@ typedef struct
 // -- Helpers --
 static unsigned SMCryptoFileRealKeySize(SMCryptoFile *obj);
 
+static void SMCryptoFileDataWritten(SMCryptoFile *obj, uint64_t offset, uint64_t end);
 static bool SMCryptoFileFillGapToLength(SMCryptoFile *obj, uint64_t length, SMCryptoFileError *error);
+static bool SMCryptoFileFillGapByRuns(SMCryptoFile *obj, uint64_t length, SMCryptoFileError *error);
+static bool SMCryptoFileStagingPrepare(SMCryptoFile *obj);
 
 static int SMCryptoFileTemporaryFile(char *pathBuffer, size_t pathBufferSize);
+static bool SMCryptoFileSyncDescriptor(int fd, SMCryptoFileSyncType sync);
+
+static bool SMCryptoFileBlockSizeIsValid(uint64_t blockSize);
+static bool SMCryptoFileDataAlignmentIsValid(uint64_t dataAlignment);
+static bool SMCryptoFileCacheSizeIsValid(uint64_t cacheSize, uint64_t cacheSlots);
+static bool SMCryptoFilePreallocationSizeIsValid(uint64_t preallocationSize);
 
 // > Instance.
 static SMCryptoFile *	SMCryptoFileAlloc(void);
+static SMCryptoFile *	SMCryptoFileAllocWithOptions(const SMCryptoFileOptions *options, bool layout, SMCryptoFileError *error);
+static void				SMCryptoFileSetDescriptor(SMCryptoFile *obj, int fd);
 static bool				SMCryptoFileFree(SMCryptoFile *obj);
 
+static bool				SMCryptoFileLayoutPrepare(SMCryptoFile *obj, SMCryptoFileError *error);
+
 // > Prefix.
+static void		SMCryptoFilePrefixSetLayout(SMCryptoFilePrefix *prefix, uint64_t blockSize, uint64_t dataAlignment, uint8_t flags);
+static uint8_t	SMCryptoFilePrefixFlags(const SMCryptoFileOptions *options);
+static uint64_t	SMCryptoFilePrefixSize(const SMCryptoFilePrefix *prefix);
+
 static bool SMCryptoFilePrefixRead(SMCryptoFile *obj, SMCryptoFileError *error);
 static bool SMCryptoFilePrefixWrite(SMCryptoFile *obj, SMCryptoFileError *error);
 
 // > Headers.
 static bool SMCryptoFileHeaderSetDataLen(SMCryptoFile *obj, uint64_t len, bool flushNow, SMCryptoFileError *error);
-static bool SMCryptoFileHeaderFlush(SMCryptoFile *obj, SMCryptoFileError *error);
+static bool SMCryptoFileHeaderFlush(SMCryptoFile *obj, SMCryptoFileSyncType sync, SMCryptoFileError *error);
+static bool SMCryptoFileHeaderRecoverDataLen(SMCryptoFile *obj, SMCryptoFileError *error);
 
 static bool SMCryptoFileHeaderRead(SMCryptoFile *obj, SMCryptoFileError *error);
 static bool SMCryptoFileHeaderWrite(SMCryptoFile *obj, SMCryptoFileError *error);
+static bool SMCryptoFileHeaderWriteSlots(SMCryptoFile *obj, SMCryptoFileError *error);
+static uint32_t SMCryptoFileHeaderCRC(SMCryptoFile *obj, const SMCryptoFileHeader *header);
 
 // > Cache.
 static bool SMCryptoFileCacheFlush(SMCryptoFile *obj, SMCryptoFileError *error);
+static void SMCryptoFileCacheTruncate(SMCryptoFile *obj, uint64_t length);
+
+static bool						SMCryptoFileCacheBypassRead(SMCryptoFile *obj, SMCryptoIOVecCursor *cursor, uint64_t offset, uint64_t size, uint64_t *length, SMCryptoFileError *error);
+
+static bool						SMCryptoFileCacheBypassWrite(SMCryptoFile *obj, SMCryptoIOVecCursor *cursor, uint64_t offset, uint64_t size, uint64_t *length, SMCryptoFileError *error);
+
+static SMCryptoFileCacheSlot *	SMCryptoFileCachePrepareReading(SMCryptoFile *obj, uint64_t offset, SMCryptoFileError *error);
+static SMCryptoFileCacheSlot *	SMCryptoFileCachePrepareWriting(SMCryptoFile *obj, uint64_t offset, uint64_t size, SMCryptoFileError *error);
+
+static SMCryptoFileCacheSlot *	SMCryptoFileCacheSlotLookup(SMCryptoFile *obj, uint64_t slotNumber);
+static SMCryptoFileCacheSlot *	SMCryptoFileCacheSlotAcquire(SMCryptoFile *obj, uint64_t slotNumber, SMCryptoFileError *error);
+static void						SMCryptoFileCacheSlotRelease(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot);
+
+static bool			SMCryptoFileCacheSlotLoad(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, uint64_t firstBlock, uint64_t endBlock, SMCryptoFileError *error);
+static bool			SMCryptoFileCacheSlotFlush(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, SMCryptoFileError *error);
+static bool			SMCryptoFileCacheSlotPrepareFlush(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, uint64_t *endOffset, SMCryptoFileError *error);
+static bool			SMCryptoFileCacheSlotWrite(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, const SMCryptoBackendContext *crypto, uint8_t *buffer, SMCryptoFileError *error);
+static SMCryptoRange	SMCryptoFileCacheSlotValidRange(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, uint64_t offset);
+
+// > Read-ahead.
+static void		SMCryptoFileReadAheadUpdate(SMCryptoFile *obj, uint64_t offset, uint64_t size);
+static void		SMCryptoFileReadAheadSchedule(SMCryptoFile *obj, uint64_t slotNumber);
+
+// > Write-behind.
+static bool		SMCryptoFileWriteBehindSchedule(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, SMCryptoFileError *error);
+
+// > Worker.
+static void		SMCryptoFileWorkerQueue(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot);
+static void		SMCryptoFileWorkerCollect(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, bool cancel);
+static bool		SMCryptoFileWorkerTryCollect(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot);
+static void		SMCryptoFileWorkerCollectAll(SMCryptoFile *obj);
+static bool		SMCryptoFileWorkerCheckError(SMCryptoFile *obj, SMCryptoFileError *error);
+static bool		SMCryptoFileWorkerStart(SMCryptoFile *obj);
+static void		SMCryptoFileWorkerStop(SMCryptoFile *obj);
+static void *	SMCryptoFileWorkerMain(void *context);
+
+// > Mapping.
+static const uint8_t *	SMCryptoFileMapGet(SMCryptoFile *obj, uint64_t offset, uint64_t length);
+static void				SMCryptoFileMapAdvise(SMCryptoFile *obj, int advice);
+
+// > Preallocation.
+static bool		SMCryptoFilePreallocateTo(SMCryptoFile *obj, uint64_t end);
+static void		SMCryptoFilePreallocateGrowth(SMCryptoFile *obj, uint64_t end);
+
+// -- Authentication tree --
+static bool		SMCryptoFileTreeOpen(SMCryptoFile *obj, const char *path, int openFlags, SMCryptoFileError *error);
+static void		SMCryptoFileTreeUnlink(const char *path);
+static bool		SMCryptoFileTreeCommit(SMCryptoFile *obj, SMCryptoFileSyncType sync, SMCryptoFileError *error);
+
+static bool		SMCryptoFileTreeVerify(SMCryptoFile *obj, const uint8_t *blocks, uint64_t blocknum, uint64_t count, SMCryptoFileError *error);
+static bool		SMCryptoFileTreeUpdate(SMCryptoFile *obj, const uint8_t *blocks, uint64_t blocknum, uint64_t count, SMCryptoFileError *error);
 
-static bool SMCryptoFileCachePrepareReadingAtCurrentOffset(SMCryptoFile *obj, SMCryptoFileError *error);
-static bool SMCryptoFileCachePrepareWritingAtCurrentOffset(SMCryptoFile *obj, SMCryptoFileError *error);
+static bool		SMCryptoFileTreeResize(SMCryptoFile *obj, uint64_t blocks, SMCryptoFileError *error);
+static bool		SMCryptoFileTreeSetCapacity(SMCryptoFile *obj, uint64_t capacity, SMCryptoFileError *error);
+static void		SMCryptoFileTreeSetDirty(SMCryptoFile *obj, uint64_t firstPage, uint64_t endPage);
 
-// > Lazy CommonCrypto SPI.
-static CCCryptorStatus lazy_CCCryptorEncryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
-static CCCryptorStatus lazy_CCCryptorDecryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
+static uint64_t	SMCryptoFileTreeCapacityForPages(uint64_t pageCount);
+static off_t	SMCryptoFileTreePageOffset(uint64_t number, bool copy);
+static off_t	SMCryptoFileTreeAreaOffset(uint64_t capacity, unsigned area);
+static uint64_t	SMCryptoFileTreeAreaSize(uint64_t capacity);
+static uint64_t	SMCryptoFileTreeSegmentOffset(uint64_t capacity);
+
+static SMCryptoFileTreePage *	SMCryptoFileTreePageGet(SMCryptoFile *obj, uint64_t number, SMCryptoFileError *error);
+static bool						SMCryptoFileTreePageFlush(SMCryptoFile *obj, SMCryptoFileTreePage *page, SMCryptoFileError *error);
+
+static bool			SMCryptoFileTreeUpdateRange(SMCryptoFile *obj, uint64_t firstPage, uint64_t endPage);
+static bool			SMCryptoFileTreeHash(SMCryptoFile *obj, const uint8_t *input, size_t length, uint8_t *digest);
+static inline bool	SMCryptoIsZero(const uint8_t *bytes, size_t length);
+
+static int SMCryptoFileCacheSlotCompare(const void *a, const void *b);
+
+// > Cryptors.
+static bool SMCryptoFileDataCryptorsCreate(SMCryptoFile *obj, SMCryptoFileError *error);
 
 // > Crypt / decrypt.
 static bool SMCryptoFileBlockCrypt(SMCryptoFile *obj, const void *block, uint64_t blocknum, void *output);
 static bool SMCryptoFileBlockDecrypt(SMCryptoFile *obj, const void *block, uint64_t blocknum, void *output);
 
+static bool SMCryptoFileBlocksCrypt(SMCryptoFile *obj, const void *blocks, uint64_t blocknum, uint64_t count, void *output);
+static bool SMCryptoFileBlocksDecrypt(SMCryptoFile *obj, const void *blocks, uint64_t blocknum, uint64_t count, void *output);
+static bool SMCryptoFileBlocksDecryptWithContext(SMCryptoFile *obj, const SMCryptoBackendContext *crypto, const void *blocks, uint64_t blocknum, uint64_t count, void *output);
+static inline bool SMCryptoFileBlockIsHole(SMCryptoFile *obj, const uint8_t *block);
+
 // > Ranges.
 static inline SMCryptoRange SMCryptoMakeRange(uint64_t location, uint64_t length);
 static inline uint64_t		SMCryptoMaxRange(SMCryptoRange range);
 static SMCryptoRange		SMCryptoIntersectionRange(SMCryptoRange r1, SMCryptoRange r2);
 
-// > Random.
-static void SMCryptoRandomCopyBytes(void *bytes, size_t count);
+// > I/O batch.
+static void SMCryptoFileIOBatchAdd(SMCryptoFile *obj, SMCryptoFileIOBatch *batch, const uint8_t *buffer, uint64_t length, uint64_t offset);
+static bool SMCryptoFileIOBatchSubmit(SMCryptoFile *obj, SMCryptoFileIOBatch *batch, SMCryptoFileError *error);
+static void SMCryptoFileIORequestPrepare(SMCryptoFile *obj, struct aiocb *request, const uint8_t *buffer, uint64_t length, uint64_t offset);
+static bool SMCryptoFileIORequestComplete(SMCryptoFile *obj, struct aiocb *request, bool submitted, SMCryptoFileError *error);
+
+// > IOVec.
+static bool	SMCryptoIOVecSize(const struct iovec *iov, int iovcnt, uint64_t *size);
+static void	SMCryptoIOVecGather(SMCryptoIOVecCursor *cursor, uint8_t *buffer, uint64_t length);
+static void	SMCryptoIOVecScatter(SMCryptoIOVecCursor *cursor, const uint8_t *buffer, uint64_t length);
+static void *	SMCryptoIOVecContiguous(SMCryptoIOVecCursor *cursor, uint64_t *length);
+
+// > Bitmaps.
+static inline bool	SMCryptoBitmapGet(const uint64_t *bitmap, uint64_t index);
+static void			SMCryptoBitmapSetRange(uint64_t *bitmap, uint64_t start, uint64_t end, bool value);
+static uint64_t		SMCryptoBitmapFind(const uint64_t *bitmap, uint64_t start, uint64_t end, bool value);
 
 // > CRC32
 static uint32_t SMCryptoCRC32(uint32_t crc, const void *buf, size_t size);
@@ -287,10 +602,10 @@ bool SMCryptoFileCanOpen(const char *path)
 	if (prefix.magic != kCFMagicValue)
 		goto clean;
 	
-	// Try to read header.
+	// Try to read header (the smallest one: the file may hold no data).
 	SMCryptoFileHeader	header;
 	
-	if (sm_pread(fd, &header, sizeof(header), kCFFileHeaderOffset) != sizeof(header))
+	if (sm_pread(fd, &header, kCFFileLegacyHeaderSize, (off_t)SMCryptoFilePrefixSize(&prefix)) != kCFFileLegacyHeaderSize)
 		goto clean;
 
 	// File is openable.
@@ -311,6 +626,11 @@ clean:
 #pragma mark - Instance
 
 SMCryptoFile * SMCryptoFileCreate(const char *path, const char *password, SMCryptoFileKeySize keySizeValue, SMCryptoFileError *error)
+{
+	return SMCryptoFileCreateWithOptions(path, password, keySizeValue, NULL, error);
+}
+
+SMCryptoFile * SMCryptoFileCreateWithOptions(const char *path, const char *password, SMCryptoFileKeySize keySizeValue, const SMCryptoFileOptions *options, SMCryptoFileError *error)
 {
 	// Check arguments.
 	SMCryptoFileError terror;
@@ -347,14 +667,10 @@ SMCryptoFile * SMCryptoFileCreate(const char *path, const char *password, SMCryp
 	}
 	
 	// Create structure.
-	SMCryptoFile *result = SMCryptoFileAlloc();
-		
+	SMCryptoFile *result = SMCryptoFileAllocWithOptions(options, true, error);
+	
 	if (!result)
-	{
-		*error = SMCryptoFileErrorMemory;
 		return NULL;
-	}
-	
 	
 	// Create a new file.
 	int fd = open(path, O_RDWR | O_CREAT, (S_IRUSR | S_IWUSR) | (S_IRGRP | S_IWGRP) | (S_IROTH | S_IWOTH)); // mode masked by umask.
@@ -365,13 +681,16 @@ SMCryptoFile * SMCryptoFileCreate(const char *path, const char *password, SMCryp
 		goto fail;
 	}
 
-	result->fd = fd;
+	SMCryptoFileSetDescriptor(result, fd);
 	
 	// Hold key size.
 	result->prefix.keySize = (uint8_t)keySizeValue;
 	
+	// Prepare the layout (block size set from options).
+	if (SMCryptoFileLayoutPrepare(result, error) == false)
+		goto fail;
+	
 	// -- Generate crypto material --
-	int			status;
 	unsigned	keySize = SMCryptoFileRealKeySize(result);
 		
 	// Prefix
@@ -379,7 +698,7 @@ SMCryptoFile * SMCryptoFileCreate(const char *path, const char *password, SMCryp
 	SMCryptoRandomCopyBytes(result->prefix.passwordSalt, sizeof(result->prefix.passwordSalt));
 	
 	// > Calibrate password round count.
-	result->prefix.passwordRounds = CCCalibratePBKDF(kCCPBKDF2, passwordLen, sizeof(result->prefix.passwordSalt), kCCPRFHmacAlgSHA256, keySize, 100); // 1/10 sec
+	result->prefix.passwordRounds = result->backend->pbkdf2Calibrate(passwordLen, sizeof(result->prefix.passwordSalt), keySize, 100); // 1/10 sec
 	
 	if (result->prefix.passwordRounds == 0)
 	{
@@ -392,14 +711,12 @@ SMCryptoFile * SMCryptoFileCreate(const char *path, const char *password, SMCryp
 	SMCryptoRandomCopyBytes(result->prefix.headerIV, sizeof(result->prefix.headerIV));
 	
 	// > Derivate password to header key.
-	status = CCKeyDerivationPBKDF(kCCPBKDF2, password, passwordLen, result->prefix.passwordSalt, sizeof(result->prefix.passwordSalt), kCCPRFHmacAlgSHA256, result->prefix.passwordRounds, result->headerKey, keySize);
-	
-    if (status != kCCSuccess)
+	if (result->backend->pbkdf2(password, passwordLen, result->prefix.passwordSalt, sizeof(result->prefix.passwordSalt), result->prefix.passwordRounds, result->headerKey, keySize) == false)
 	{
-		SMCryptoDebugLog("Error: Can't derivate password (%d).\n", status);
+		SMCryptoDebugLog("Error: Can't derivate password.\n");
 		*error = SMCryptoFileErrorCrypto;
 		goto fail;
-    }
+	}
 	
 	// Header
 	// > Generate XTS keys.
@@ -414,26 +731,13 @@ SMCryptoFile * SMCryptoFileCreate(const char *path, const char *password, SMCryp
 
 	result->header.crc32 = (uint32_t)crc;
 	
-	// Create data cryptor.
-	// > Encryptor.
-    status = CCCryptorCreateWithMode(kCCEncrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataEncrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create encrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Create data cryptors.
+	if (SMCryptoFileDataCryptorsCreate(result, error) == false)
 		goto fail;
-	}
 	
-	// > Decryptor.
-	status = CCCryptorCreateWithMode(kCCDecrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataDecrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create decrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Create the authentication tree.
+	if (result->authenticated && SMCryptoFileTreeOpen(result, path, O_RDWR | O_CREAT | O_TRUNC, error) == false)
 		goto fail;
-	}
 	
 	// > Write prefix.
 	if (SMCryptoFilePrefixWrite(result, error) == false)
@@ -443,7 +747,7 @@ SMCryptoFile * SMCryptoFileCreate(const char *path, const char *password, SMCryp
 	}
 	
 	// >  Write header.
-	if (SMCryptoFileHeaderWrite(result, error) == false)
+	if (SMCryptoFileHeaderWriteSlots(result, error) == false)
 	{
 		SMCryptoDebugLog("Error: Can't write header.\n");
 		goto fail;
@@ -456,6 +760,9 @@ fail:
 	
 	SMCryptoFileClose(result, NULL);
 	unlink(path);
+	
+	if (options && options->authenticated)
+		SMCryptoFileTreeUnlink(path);
 
 	return NULL;
 }
@@ -484,6 +791,14 @@ SMCryptoFile *	SMCryptoFileCreateImpersonated(SMCryptoFile *original, const char
 		return NULL;
 	}
 	
+	result->backend = original->backend;
+	result->cacheSize = original->cacheSize;
+	result->cacheSlotCount = original->cacheSlotCount;
+	result->readAheadSlots = original->readAheadSlots ? original->readAheadSlots : SMCryptoFileReadAheadDisabled;
+	result->writeBehindSlots = original->writeBehindSlots;
+	result->preallocationSize = original->preallocationSize;
+	result->noCache = original->noCache;
+	
 	// Create a new file.
 	int fd = open(path, O_RDWR | O_CREAT, (S_IRUSR | S_IWUSR) | (S_IRGRP | S_IWGRP) | (S_IROTH | S_IWOTH)); // mode masked by umask.
 	
@@ -493,12 +808,15 @@ SMCryptoFile *	SMCryptoFileCreateImpersonated(SMCryptoFile *original, const char
 		goto fail;
 	}
 
-	result->fd = fd;
+	SMCryptoFileSetDescriptor(result, fd);
 		
 	// -- Generate crypto material --
 	// Prefix.
 	memcpy(&result->prefix, &original->prefix, sizeof(SMCryptoFilePrefix));
 	
+	if (SMCryptoFileLayoutPrepare(result, error) == false)
+		goto fail;
+	
 	memcpy(result->headerKey, original->headerKey, sizeof(result->headerKey));
 	
 	// Header
@@ -514,29 +832,13 @@ SMCryptoFile *	SMCryptoFileCreateImpersonated(SMCryptoFile *original, const char
 	
 	result->header.crc32 = (uint32_t)crc;
 	
-	// Create data cryptor.
-	int			status;
-	unsigned	keySize = SMCryptoFileRealKeySize(result);
-	
-	// > Encryptor.
-    status = CCCryptorCreateWithMode(kCCEncrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataEncrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create encrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Create data cryptors.
+	if (SMCryptoFileDataCryptorsCreate(result, error) == false)
 		goto fail;
-	}
 	
-	// > Decryptor.
-	status = CCCryptorCreateWithMode(kCCDecrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataDecrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create decrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Create the authentication tree.
+	if (result->authenticated && SMCryptoFileTreeOpen(result, path, O_RDWR | O_CREAT | O_TRUNC, error) == false)
 		goto fail;
-	}
 	
 	// > Write prefix.
 	if (SMCryptoFilePrefixWrite(result, error) == false)
@@ -546,7 +848,7 @@ SMCryptoFile *	SMCryptoFileCreateImpersonated(SMCryptoFile *original, const char
 	}
 	
 	// >  Write header.
-	if (SMCryptoFileHeaderWrite(result, error) == false)
+	if (SMCryptoFileHeaderWriteSlots(result, error) == false)
 	{
 		SMCryptoDebugLog("Error: Can't write header.\n");
 		goto fail;
@@ -560,10 +862,18 @@ fail:
 	SMCryptoFileClose(result, NULL);
 	unlink(path);
 	
+	if (original->authenticated)
+		SMCryptoFileTreeUnlink(path);
+	
 	return NULL;
 }
 
 SMCryptoFile * SMCryptoFileCreateVolatile(const char *path, SMCryptoFileKeySize keySizeValue, SMCryptoFileError *error)
+{
+	return SMCryptoFileCreateVolatileWithOptions(path, keySizeValue, NULL, error);
+}
+
+SMCryptoFile * SMCryptoFileCreateVolatileWithOptions(const char *path, SMCryptoFileKeySize keySizeValue, const SMCryptoFileOptions *options, SMCryptoFileError *error)
 {
 	// Check arguments.
 	SMCryptoFileError terror;
@@ -584,13 +894,10 @@ SMCryptoFile * SMCryptoFileCreateVolatile(const char *path, SMCryptoFileKeySize
 	}
 	
 	// Create structure.
-	SMCryptoFile *result = SMCryptoFileAlloc();
+	SMCryptoFile *result = SMCryptoFileAllocWithOptions(options, true, error);
 	
 	if (!result)
-	{
-		*error = SMCryptoFileErrorMemory;
 		return NULL;
-	}
 	
 	// Try to create a new file.
 	int fd;
@@ -620,11 +927,15 @@ SMCryptoFile * SMCryptoFileCreateVolatile(const char *path, SMCryptoFileKeySize
 		unlink(buffer); // unlinking an opened file give an delete-on-close behavior.
 	}
 	
-	result->fd = fd;
+	SMCryptoFileSetDescriptor(result, fd);
 
 	// Hold key size.
 	result->prefix.keySize = (uint8_t)keySizeValue;
 	
+	// Prepare the layout (block size set from options).
+	if (SMCryptoFileLayoutPrepare(result, error) == false)
+		goto fail;
+	
 	// -- Generate crypto material --
 	// Prefix.
 	memset(&result->prefix.passwordSalt, 0, sizeof(result->prefix.passwordSalt));
@@ -642,29 +953,13 @@ SMCryptoFile * SMCryptoFileCreateVolatile(const char *path, SMCryptoFileKeySize
 	SMCryptoRandomCopyBytes(result->header.xtsKey, sizeof(result->header.xtsKey));
 	SMCryptoRandomCopyBytes(result->header.xtsTweak, sizeof(result->header.xtsTweak));
 	
-	// Create data cryptor.
-	int			status;
-	unsigned	keySize = SMCryptoFileRealKeySize(result);
-
-	// > Encryptor.
-    status = CCCryptorCreateWithMode(kCCEncrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataEncrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create encrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Create data cryptors.
+	if (SMCryptoFileDataCryptorsCreate(result, error) == false)
 		goto fail;
-	}
 	
-	// > Decryptor.
-	status = CCCryptorCreateWithMode(kCCDecrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataDecrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create decrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Create the authentication tree.
+	if (result->authenticated && SMCryptoFileTreeOpen(result, path, O_RDWR | O_CREAT | O_TRUNC, error) == false)
 		goto fail;
-	}
 	
 	// > Write prefix.
 	if (SMCryptoFilePrefixWrite(result, error) == false)
@@ -674,7 +969,7 @@ SMCryptoFile * SMCryptoFileCreateVolatile(const char *path, SMCryptoFileKeySize
 	}
 	
 	// >  Write header.
-	if (SMCryptoFileHeaderWrite(result, error) == false)
+	if (SMCryptoFileHeaderWriteSlots(result, error) == false)
 	{
 		SMCryptoDebugLog("Error: Can't write header.\n");
 		goto fail;
@@ -690,10 +985,18 @@ fail:
 	if (path)
 		unlink(path);
 	
+	if (path && options && options->authenticated)
+		SMCryptoFileTreeUnlink(path);
+	
 	return NULL;
 }
 
 SMCryptoFile * SMCryptoFileOpen(const char *path, const char *password, bool readOnly, SMCryptoFileError *error)
+{
+	return SMCryptoFileOpenWithOptions(path, password, readOnly, NULL, error);
+}
+
+SMCryptoFile * SMCryptoFileOpenWithOptions(const char *path, const char *password, bool readOnly, const SMCryptoFileOptions *options, SMCryptoFileError *error)
 {
 	// Check arguments.
 	SMCryptoFileError terror;
@@ -718,15 +1021,13 @@ SMCryptoFile * SMCryptoFileOpen(const char *path, const char *password, bool rea
 	}
 	
 	// Create structure.
-	SMCryptoFile *result = SMCryptoFileAlloc();
+	SMCryptoFile *result = SMCryptoFileAllocWithOptions(options, false, error);
 	
 	if (!result)
-	{
-		*error = SMCryptoFileErrorMemory;
 		return NULL;
-	}
 	
 	result->readonly = readOnly;
+	result->mapData = readOnly && options && options->mapData;
 	
 	// Try to open the file.
 	int openFlag;
@@ -747,10 +1048,9 @@ SMCryptoFile * SMCryptoFileOpen(const char *path, const char *password, bool rea
 		return NULL;
 	}
 	
-	result->fd = fd;
+	SMCryptoFileSetDescriptor(result, fd);
 	
 	// -- Load crypto material --
-	int			status;
 	unsigned	keySize;
 	
 	// Prefix.
@@ -770,7 +1070,7 @@ SMCryptoFile * SMCryptoFileOpen(const char *path, const char *password, bool rea
 		goto fail;
 	}
 	
-	if (result->prefix.version != kCFCurrentVersion)
+	if (result->prefix.version < kCFLegacyVersion || result->prefix.version > kCFCurrentVersion)
 	{
 		SMCryptoDebugLog("Error: Incompatible version.\n");
 		*error = SMCryptoFileErrorVersion;
@@ -789,18 +1089,41 @@ SMCryptoFile * SMCryptoFileOpen(const char *path, const char *password, bool rea
 			goto fail;
 	}
 	
+	if (result->prefix.blockSizeShift >= 64 || SMCryptoFileBlockSizeIsValid(1ULL << result->prefix.blockSizeShift) == false)
+	{
+		SMCryptoDebugLog("Error: Invalid block size.\n");
+		*error = SMCryptoFileErrorFormat;
+		goto fail;
+	}
+	
+	if (result->prefix.dataAlignShift >= 64 || (result->prefix.dataAlignShift && SMCryptoFileDataAlignmentIsValid(1ULL << result->prefix.dataAlignShift) == false))
+	{
+		SMCryptoDebugLog("Error: Invalid data alignment.\n");
+		*error = SMCryptoFileErrorFormat;
+		goto fail;
+	}
+	
+	if (result->prefix.flags & ~kCFFlagsKnown)
+	{
+		SMCryptoDebugLog("Error: Unknown flags.\n");
+		*error = SMCryptoFileErrorVersion;
+		goto fail;
+	}
+	
+	// > Prepare layout.
+	if (SMCryptoFileLayoutPrepare(result, error) == false)
+		goto fail;
+	
 	// > Get values.
 	keySize = SMCryptoFileRealKeySize(result);
 	
 	// > Derivate password to header key.
-	status = CCKeyDerivationPBKDF(kCCPBKDF2, password, passwordLen, result->prefix.passwordSalt, sizeof(result->prefix.passwordSalt), kCCPRFHmacAlgSHA256, result->prefix.passwordRounds, result->headerKey, keySize);
-	
-    if (status != kCCSuccess)
+	if (result->backend->pbkdf2(password, passwordLen, result->prefix.passwordSalt, sizeof(result->prefix.passwordSalt), result->prefix.passwordRounds, result->headerKey, keySize) == false)
 	{
-		SMCryptoDebugLog("Error: Can't derivate password (%d).\n", status);
+		SMCryptoDebugLog("Error: Can't derivate password.\n");
 		*error = SMCryptoFileErrorCrypto;
 		goto fail;
-    }
+	}
 	
 	// Header.
 	// > Read header.
@@ -830,29 +1153,26 @@ SMCryptoFile * SMCryptoFileOpen(const char *path, const char *password, bool rea
 		goto fail;
 	}
 	
+	// > Recover the length of the data flushed since the last sync point.
+	if (result->lazyLength && SMCryptoFileHeaderRecoverDataLen(result, error) == false)
+		goto fail;
+	
 	// > Get values.
-	result->fileDataLen = SMRoundUp(result->header.dataLen, kCFFileBlockSize);
+	result->fileDataLen = SMRoundUp(result->header.dataLen, result->blockSize);
+	result->fileReservedEnd = result->fileDataLen;
+	result->preallocatedEnd = result->fileDataLen;
 	
-	// Create data cryptor.
-	// > Encryptor.
-    status = CCCryptorCreateWithMode(kCCEncrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataEncrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create encrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Load the authentication tree, and check it against the header.
+	if (result->authenticated && SMCryptoFileTreeOpen(result, path, readOnly ? O_RDONLY : O_RDWR, error) == false)
 		goto fail;
-	}
 	
-	// > Decryptor.
-	status = CCCryptorCreateWithMode(kCCDecrypt, kCCModeXTS, kCCAlgorithmAES, ccNoPadding, NULL, result->header.xtsKey, keySize, result->header.xtsTweak, keySize, 0, 0, &result->dataDecrypt);
-    
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't create decrypt engine (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
+	// Map the file (reads fall back on pread if it fails).
+	if (result->mapData)
+		SMCryptoFileMapGet(result, 0, result->fileDataLen);
+	
+	// Create data cryptors.
+	if (SMCryptoFileDataCryptorsCreate(result, error) == false)
 		goto fail;
-	}
 	
 	// Return.
 	return result;
@@ -882,14 +1202,22 @@ bool SMCryptoFileClose(SMCryptoFile *obj, SMCryptoFileError *error)
 		return false;
 
 	// Clean.
+	SMCryptoFileWorkerStop(obj);
+	
+	// > Release the space reserved past the data (advisory: the file is valid with it).
+	if (obj->preallocatedEnd > obj->fileDataLen)
+		ftruncate(obj->fd, (off_t)(obj->dataOffset + obj->fileDataLen));
+	
+	if (obj->map)
+		munmap((void *)obj->map, (size_t)obj->mapLength);
+	
 	if (obj->fd > 0)
 		close(obj->fd);
-
-	if (obj->dataEncrypt)
-		CCCryptorRelease(obj->dataEncrypt);
 	
-	if (obj->dataDecrypt)
-		CCCryptorRelease(obj->dataDecrypt);
+	if (obj->treeFd > 0)
+		close(obj->treeFd);
+
+	SMCryptoBackendContextClean(&obj->dataCrypto);
 	
 	SMCryptoFileFree(obj);
 	
@@ -926,19 +1254,22 @@ bool SMCryptoFileChangePassword(SMCryptoFile *obj, const char *newPassword, SMCr
 		return NULL;
 	}
 		
+	// Authenticated files: commit the tree with the old key, so the rewritten header holds a root matching its length.
+	if (obj->authenticated && obj->readonly == false && SMCryptoFileFlush(obj, SMCryptoFileSyncNo, error) == false)
+		return false;
+	
 	// Derivate new password to header key.
-	unsigned	keySize = SMCryptoFileRealKeySize(obj);
-	int			result = CCKeyDerivationPBKDF(kCCPBKDF2, newPassword, newPasswordLen, obj->prefix.passwordSalt, sizeof(obj->prefix.passwordSalt), kCCPRFHmacAlgSHA256, obj->prefix.passwordRounds, obj->headerKey, keySize);
+	unsigned keySize = SMCryptoFileRealKeySize(obj);
 	
-    if (result != kCCSuccess)
+	if (obj->backend->pbkdf2(newPassword, newPasswordLen, obj->prefix.passwordSalt, sizeof(obj->prefix.passwordSalt), obj->prefix.passwordRounds, obj->headerKey, keySize) == false)
 	{
-		SMCryptoDebugLog("Error: Can't derivate new password (%d).\n", result);
+		SMCryptoDebugLog("Error: Can't derivate new password.\n");
 		*error = SMCryptoFileErrorCrypto;
 		return false;
-    }
+	}
 
-	// Re-write header with new header key.
-	if (SMCryptoFileHeaderWrite(obj, error) == false)
+	// Re-write header with new header key (every slot, so the old password opens none).
+	if (SMCryptoFileHeaderWriteSlots(obj, error) == false)
 	{
 		SMCryptoDebugLog("Error: Can't write header.\n");
 		return false;
@@ -963,6 +1294,52 @@ uint64_t SMCryptoFileSize(SMCryptoFile *obj)
 	return obj->header.dataLen;
 }
 
+uint32_t SMCryptoFileBlockSize(SMCryptoFile *obj)
+{
+	if (!obj)
+		return 0;
+	
+	return (uint32_t)obj->blockSize;
+}
+
+uint32_t SMCryptoFileCacheSize(SMCryptoFile *obj)
+{
+	if (!obj)
+		return 0;
+	
+	return (uint32_t)obj->cacheSize;
+}
+
+SMCryptoFileBackend SMCryptoFileGetBackend(SMCryptoFile *obj)
+{
+	if (!obj)
+		return SMCryptoFileBackendDefault;
+	
+	return obj->backend->identifier;
+}
+
+
+
+/*
+** Backends
+*/
+#pragma mark - Backends
+
+bool SMCryptoFileBackendIsAvailable(SMCryptoFileBackend backend)
+{
+	return (SMCryptoBackendGet(backend) != NULL);
+}
+
+const char * SMCryptoFileBackendName(SMCryptoFileBackend backend)
+{
+	const SMCryptoBackend *result = SMCryptoBackendGet(backend);
+	
+	if (!result)
+		return NULL;
+	
+	return result->name;
+}
+
 
 
 /*
@@ -1094,22 +1471,26 @@ bool SMCryptoFileTruncate(SMCryptoFile *obj, uint64_t length, SMCryptoFileError
 	if (length == obj->header.dataLen)
 		return true;
 	
+	// Wait for the worker, which reads or writes the blocks we are going to change.
+	SMCryptoFileWorkerCollectAll(obj);
 	
 	// Resize the file.
-	uint64_t roundLength = SMRoundUp(length, kCFFileBlockSize);
+	uint64_t roundLength = SMRoundUp(length, obj->blockSize);
 
-	if (roundLength < obj->fileDataLen)
+	if (roundLength < obj->fileReservedEnd)
 	{
 		// > Truncate file.
 		
-		if (ftruncate(obj->fd, (off_t)(kCFFileDataOffset + roundLength)) != 0)
+		if (ftruncate(obj->fd, (off_t)(obj->dataOffset + roundLength)) != 0)
 		{
 			*error = SMCryptoFileErrorIO;
 			return false;
 		}
 		
-		// > Update file len.
-		obj->fileDataLen = roundLength;
+		// > Update file len (the space reserved past it is released too).
+		obj->fileDataLen = MIN(obj->fileDataLen, roundLength);
+		obj->fileReservedEnd = roundLength;
+		obj->preallocatedEnd = roundLength;
 	}
 	else
 	{
@@ -1120,25 +1501,29 @@ bool SMCryptoFileTruncate(SMCryptoFile *obj, uint64_t length, SMCryptoFileError
 	}
 	
 	// Truncate last file block if necessary, end pad it with zeroes.
-	if (length < obj->fileDataLen)
+	if (length < obj->fileReservedEnd)
 	{
-		uint64_t truncateOffset = SMRoundDown(length, kCFFileBlockSize);
+		uint64_t truncateOffset = SMRoundDown(length, obj->blockSize);
 		
 		if (truncateOffset != length)
 		{
-			uint64_t blockNumber = truncateOffset / kCFFileBlockSize;
+			uint64_t blockNumber = truncateOffset / obj->blockSize;
 
 			// > Read block.
-			uint8_t fileBlock[kCFFileBlockSize];
+			uint8_t *fileBlock = obj->cryptBuffer;
 
-			if (sm_pread(obj->fd, fileBlock, sizeof(fileBlock), (off_t)(kCFFileDataOffset + truncateOffset)) != sizeof(fileBlock))
+			if (sm_pread(obj->fd, fileBlock, (size_t)obj->blockSize, (off_t)(obj->dataOffset + truncateOffset)) != obj->blockSize)
 			{
 				*error = SMCryptoFileErrorIO;
 				return false;
 			}
 			
+			// > Authenticate block.
+			if (SMCryptoFileTreeVerify(obj, fileBlock, blockNumber, 1, error) == false)
+				return false;
+			
 			// > Decrypt block.
-			uint8_t clearBlock[kCFFileBlockSize];
+			uint8_t *clearBlock = obj->clearBlock;
 
 			if (SMCryptoFileBlockDecrypt(obj, fileBlock, blockNumber, clearBlock) == false)
 			{
@@ -1149,7 +1534,7 @@ bool SMCryptoFileTruncate(SMCryptoFile *obj, uint64_t length, SMCryptoFileError
 			// > Truncate the block.
 			uint64_t blockOffset = length - truncateOffset;
 			
-			memset(clearBlock + blockOffset, 0, (size_t)(sizeof(fileBlock) - blockOffset));
+			memset(clearBlock + blockOffset, 0, (size_t)(obj->blockSize - blockOffset));
 			
 			// > Re-crypt the block.
 			if (SMCryptoFileBlockCrypt(obj, clearBlock, blockNumber, fileBlock) == false)
@@ -1158,8 +1543,11 @@ bool SMCryptoFileTruncate(SMCryptoFile *obj, uint64_t length, SMCryptoFileError
 				return false;
 			}
 			
+			if (SMCryptoFileTreeUpdate(obj, fileBlock, blockNumber, 1, error) == false)
+				return false;
+			
 			// > Write block back.
-			if (sm_pwrite(obj->fd, fileBlock, sizeof(fileBlock), (off_t)(kCFFileDataOffset + truncateOffset)) != sizeof(fileBlock))
+			if (sm_pwrite(obj->fd, fileBlock, (size_t)obj->blockSize, (off_t)(obj->dataOffset + truncateOffset)) != obj->blockSize)
 			{
 				*error = SMCryptoFileErrorIO;
 				return false;
@@ -1167,18 +1555,11 @@ bool SMCryptoFileTruncate(SMCryptoFile *obj, uint64_t length, SMCryptoFileError
 		}
 	}
 
-	// Truncate cache if needed.
+	// Truncate cache if needed (and forget the region advised past the new end).
 	if (length < obj->header.dataLen)
 	{
-		if (obj->cachedDataOffset >= length)
-		{
-			obj->cachedDataDirty = false;
-			obj->cachedDataSize = 0;
-		}
-		else if (obj->cachedDataOffset + obj->cachedDataSize > length)
-		{
-			obj->cachedDataSize = (length - obj->cachedDataOffset);
-		}
+		SMCryptoFileCacheTruncate(obj, length);
+		obj->readAheadAdvised = MIN(obj->readAheadAdvised, length);
 	}
 	 
 	// Update header.
@@ -1188,7 +1569,7 @@ bool SMCryptoFileTruncate(SMCryptoFile *obj, uint64_t length, SMCryptoFileError
 	return true;
 }
 
-int64_t SMCryptoFileRead(SMCryptoFile *obj, void *ptr, uint64_t size, SMCryptoFileError *error)
+bool SMCryptoFilePreallocate(SMCryptoFile *obj, uint64_t length, SMCryptoFileError *error)
 {
 	// Check arguments.
 	SMCryptoFileError terror;
@@ -1197,63 +1578,30 @@ int64_t SMCryptoFileRead(SMCryptoFile *obj, void *ptr, uint64_t size, SMCryptoFi
 		error = &terror;
 	
 	// > Check pointers.
-	if (!obj || !ptr)
+	if (!obj)
 	{
 		*error = SMCryptoFileErrorArguments;
-		return -1;
+		return false;
 	}
-
-	// > Refine size.
-	if (obj->currentOffset >= obj->header.dataLen)
-		size = 0;
-	else if (obj->currentOffset + size > obj->header.dataLen)
-		size = obj->header.dataLen - obj->currentOffset;
 	
-	// > Fast path.
-	if (size == 0)
-		return 0;
-		
-	// Backup values
-	uint64_t	currentOffset = obj->currentOffset;
-	uint64_t	requestSize = size;
+	// Read-only.
+	if (obj->readonly)
+	{
+		*error = SMCryptoFileErrorReadOnly;
+		return false;
+	}
 	
-	// Read blocks.
-	while (size)
+	// Reserve the space of the blocks up to length.
+	if (SMCryptoFilePreallocateTo(obj, SMRoundUp(length, obj->blockSize)) == false)
 	{
-		// > Prepare cache to be read at currentOffset.
-		if (SMCryptoFileCachePrepareReadingAtCurrentOffset(obj, error) == false)
-		{
-			obj->currentOffset = currentOffset;
-			return -1;
-		}
-		
-		// > Compute amount of data usable in cache.
-		SMCryptoRange cacheRange = SMCryptoMakeRange(obj->cachedDataOffset, obj->cachedDataSize);
-		SMCryptoRange readRange = SMCryptoMakeRange(obj->currentOffset, size);
-		SMCryptoRange range = SMCryptoIntersectionRange(readRange, cacheRange);
-
-		// > Check the amount of data usable (not supposed to happen).
-		if (range.length == 0)
-		{
-			*error = SMCryptoFileErrorUnknown;
-			obj->currentOffset = currentOffset;
-
-			return -1;
-		}
-		
-		// > Copy cache to output buffer.
-		memcpy(ptr, obj->cachedData + (range.location - obj->cachedDataOffset), (size_t)(range.length));
-		
-		// > Update vars.
-		ptr += range.length;
-		size -= range.length;
-		obj->currentOffset += range.length;
+		*error = SMCryptoFileErrorIO;
+		return false;
 	}
 	
-	return (int64_t)requestSize;
+	return true;
 }
 
-bool SMCryptoFileWrite(SMCryptoFile *obj, const void *ptr, uint64_t size, SMCryptoFileError *error)
+int64_t SMCryptoFileRead(SMCryptoFile *obj, void *ptr, uint64_t size, SMCryptoFileError *error)
 {
 	// Check arguments.
 	SMCryptoFileError terror;
@@ -1262,780 +1610,3371 @@ bool SMCryptoFileWrite(SMCryptoFile *obj, const void *ptr, uint64_t size, SMCryp
 		error = &terror;
 	
 	// > Check pointers.
-	if (!obj || !ptr)
+	if (!obj)
 	{
 		*error = SMCryptoFileErrorArguments;
-		return false;
+		return -1;
 	}
 	
-	// Read-only.
-	if (obj->readonly)
-	{
-		*error = SMCryptoFileErrorReadOnly;
-		return false;
-	}
+	// Read at current offset.
+	int64_t result = SMCryptoFilePRead(obj, ptr, size, obj->currentOffset, error);
 	
-	// > Fast path.
-	if (size == 0)
-		return true;
+	if (result > 0)
+		obj->currentOffset += (uint64_t)result;
 	
-	// Backup for error.
-	uint64_t currentOffset = obj->currentOffset;
-		
-	// Write blocks.
-	while (size)
-	{
-		// > Prepare cache to be written at currentOffset.
-		if (SMCryptoFileCachePrepareWritingAtCurrentOffset(obj, error) == false)
-		{
-			obj->currentOffset = currentOffset;
-			return false;
-		}
+	return result;
+}
 
-		// > Compute positions and size.
-		uint64_t delta = obj->currentOffset - obj->cachedDataOffset;
-		uint64_t copySize = kCFFileCacheSize - delta;
-		
+int64_t SMCryptoFilePRead(SMCryptoFile *obj, void *ptr, uint64_t size, uint64_t offset, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// > Check pointers.
+	if (!ptr)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return -1;
+	}
+	
+	// Read as one segment.
+	struct iovec iov = { .iov_base = ptr, .iov_len = (size_t)size };
+	
+	return SMCryptoFilePReadV(obj, &iov, 1, offset, error);
+}
+
+int64_t SMCryptoFileReadV(SMCryptoFile *obj, const struct iovec *iov, int iovcnt, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// > Check pointers.
+	if (!obj)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return -1;
+	}
+	
+	// Read at current offset.
+	int64_t result = SMCryptoFilePReadV(obj, iov, iovcnt, obj->currentOffset, error);
+	
+	if (result > 0)
+		obj->currentOffset += (uint64_t)result;
+	
+	return result;
+}
+
+int64_t SMCryptoFilePReadV(SMCryptoFile *obj, const struct iovec *iov, int iovcnt, uint64_t offset, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// > Check pointers and segments.
+	uint64_t size = 0;
+	
+	if (!obj || SMCryptoIOVecSize(iov, iovcnt, &size) == false)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return -1;
+	}
+
+	// > Refine size.
+	if (offset >= obj->header.dataLen)
+		size = 0;
+	else if (size > obj->header.dataLen - offset)
+		size = obj->header.dataLen - offset;
+	
+	// > Fast path.
+	if (size == 0)
+		return 0;
+		
+	// Backup values
+	uint64_t requestSize = size;
+	
+	// Detect sequential access, and read ahead.
+	SMCryptoFileReadAheadUpdate(obj, offset, size);
+	
+	// Read blocks: walk the slots once for all the segments.
+	SMCryptoIOVecCursor cursor = { .iov = iov };
+	
+	while (size)
+	{
+		// > Whole slots not in cache: read and decrypt them straight into the output segment.
+		if (offset % obj->cacheSlotSize == 0 && size >= obj->cacheSlotSize)
+		{
+			uint64_t directLength = 0;
+			
+			if (SMCryptoFileCacheBypassRead(obj, &cursor, offset, size, &directLength, error) == false)
+				return -1;
+			
+			size -= directLength;
+			offset += directLength;
+			
+			if (directLength > 0)
+				continue;
+		}
+		
+		// > Prepare cache to be read at offset.
+		SMCryptoFileCacheSlot *slot = SMCryptoFileCachePrepareReading(obj, offset, error);
+		
+		if (!slot)
+			return -1;
+		
+		// > Compute amount of data usable in cache.
+		SMCryptoRange cacheRange = SMCryptoFileCacheSlotValidRange(obj, slot, offset);
+		SMCryptoRange readRange = SMCryptoMakeRange(offset, size);
+		SMCryptoRange range = SMCryptoIntersectionRange(readRange, cacheRange);
+
+		// > Check the amount of data usable (not supposed to happen).
+		if (range.length == 0)
+		{
+			*error = SMCryptoFileErrorUnknown;
+			return -1;
+		}
+		
+		// > Copy cache to output segments.
+		SMCryptoIOVecScatter(&cursor, slot->data + (range.location - slot->offset), range.length);
+		
+		// > Update vars.
+		size -= range.length;
+		offset += range.length;
+	}
+	
+	return (int64_t)requestSize;
+}
+
+bool SMCryptoFileWrite(SMCryptoFile *obj, const void *ptr, uint64_t size, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// > Check pointers.
+	if (!obj)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return false;
+	}
+	
+	// Write at current offset.
+	if (SMCryptoFilePWrite(obj, ptr, size, obj->currentOffset, error) == false)
+		return false;
+	
+	obj->currentOffset += size;
+	
+	return true;
+}
+
+bool SMCryptoFilePWrite(SMCryptoFile *obj, const void *ptr, uint64_t size, uint64_t offset, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// > Check pointers.
+	if (!ptr)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return false;
+	}
+	
+	// Write as one segment.
+	struct iovec iov = { .iov_base = (void *)ptr, .iov_len = (size_t)size };
+	
+	return SMCryptoFilePWriteV(obj, &iov, 1, offset, error);
+}
+
+bool SMCryptoFileWriteV(SMCryptoFile *obj, const struct iovec *iov, int iovcnt, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// > Check pointers and segments.
+	uint64_t size = 0;
+	
+	if (!obj || SMCryptoIOVecSize(iov, iovcnt, &size) == false)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return false;
+	}
+	
+	// Write at current offset.
+	if (SMCryptoFilePWriteV(obj, iov, iovcnt, obj->currentOffset, error) == false)
+		return false;
+	
+	obj->currentOffset += size;
+	
+	return true;
+}
+
+bool SMCryptoFilePWriteV(SMCryptoFile *obj, const struct iovec *iov, int iovcnt, uint64_t offset, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// > Check pointers and segments.
+	uint64_t size = 0;
+	
+	if (!obj || SMCryptoIOVecSize(iov, iovcnt, &size) == false)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return false;
+	}
+	
+	// > Check range (same limit as seek).
+	if (offset > (uint64_t)LLONG_MAX || size > (uint64_t)LLONG_MAX - offset)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return false;
+	}
+	
+	// Read-only.
+	if (obj->readonly)
+	{
+		*error = SMCryptoFileErrorReadOnly;
+		return false;
+	}
+	
+	// Report background write error.
+	if (SMCryptoFileWorkerCheckError(obj, error) == false)
+		return false;
+	
+	// > Fast path.
+	if (size == 0)
+		return true;
+	
+	// Write blocks: walk the slots once for all the segments, so only the blocks partially covered by the whole write are loaded.
+	SMCryptoIOVecCursor cursor = { .iov = iov };
+	
+	while (size)
+	{
+		// > Whole slots: crypt them straight from the input segment to disk.
+		if (offset % obj->cacheSlotSize == 0 && size >= obj->cacheSlotSize)
+		{
+			uint64_t directLength = 0;
+			
+			if (SMCryptoFileCacheBypassWrite(obj, &cursor, offset, size, &directLength, error) == false)
+				return false;
+			
+			size -= directLength;
+			offset += directLength;
+			
+			if (offset > obj->header.dataLen)
+				SMCryptoFileHeaderSetDataLen(obj, offset, false, NULL);
+			
+			if (directLength > 0)
+				continue;
+		}
+		
+		// > Prepare cache to be written at offset.
+		SMCryptoFileCacheSlot *slot = SMCryptoFileCachePrepareWriting(obj, offset, size, error);
+		
+		if (!slot)
+			return false;
+
+		// > Compute positions and size.
+		uint64_t delta = offset - slot->offset;
+		uint64_t copySize = obj->cacheSlotSize - delta;
+		
 		if (size < copySize)
 			copySize = size;
 				
 		// > Copy data.
-		memcpy(obj->cachedData + delta, ptr, (size_t)copySize);
+		uint64_t firstBlock = delta / obj->blockSize;
+		uint64_t endBlock = (delta + copySize + obj->blockSize - 1) / obj->blockSize;
+
+		SMCryptoIOVecGather(&cursor, slot->data + delta, copySize);
 		
-		obj->cachedDataDirty = true;
+		SMCryptoBitmapSetRange(slot->validBlocks, firstBlock, endBlock, true);
+		SMCryptoBitmapSetRange(slot->dirtyBlocks, firstBlock, endBlock, true);
+		
+		slot->dirty = true;
 		
 		// > Update values.
 		size -= copySize;
-		ptr += copySize;
-		obj->currentOffset += copySize;
-		obj->cachedDataSize = MAX(obj->cachedDataSize, delta + copySize);
+		offset += copySize;
+		
+		if (offset > obj->header.dataLen)
+			SMCryptoFileHeaderSetDataLen(obj, offset, false, NULL);
 		
-		if (obj->currentOffset > obj->header.dataLen)
-			SMCryptoFileHeaderSetDataLen(obj, obj->currentOffset, false, NULL);
+		// > Slot filled up: write it in background.
+		if (obj->writeBehindSlots > 0 && delta + copySize == obj->cacheSlotSize && SMCryptoFileWriteBehindSchedule(obj, slot, error) == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool SMCryptoFileFlush(SMCryptoFile *obj, SMCryptoFileSyncType sync, SMCryptoFileError *error)
+{
+	// Check arguments.
+	SMCryptoFileError terror;
+	
+	if (!error)
+		error = &terror;
+	
+	// Check pointers.
+	if (!obj)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return false;
+	}
+	
+	// Flush cache.
+	if (SMCryptoFileCacheFlush(obj, error) == false)
+		return false;
+	
+	// Report background write error.
+	if (SMCryptoFileWorkerCheckError(obj, error) == false)
+		return false;
+	
+	// Flush header (lazy length: only at sync points, the length is recovered from the data on disk on open).
+	if ((sync != SMCryptoFileSyncNo || obj->lazyLength == false) && SMCryptoFileHeaderFlush(obj, sync, error) == false)
+		return false;
+	
+	// Sync (authenticated files: the side file is synced by the tree commit, before the header is written).
+	if (SMCryptoFileSyncDescriptor(obj->fd, sync) == false)
+	{
+		*error = SMCryptoFileErrorIO;
+		return false;
+	}
+	
+	return true;
+}
+
+
+
+/*
+** Helpers
+*/
+#pragma mark - Helpers
+
+static unsigned SMCryptoFileRealKeySize(SMCryptoFile *obj)
+{
+	switch (obj->prefix.keySize)
+	{
+		case SMCryptoFileKeySize128:
+			return 16;
+			
+		case SMCryptoFileKeySize192:
+			return 24;
+			
+		case SMCryptoFileKeySize256:
+			return 32;
+	}
+	
+	return 0;
+}
+
+static bool SMCryptoFileBlockSizeIsValid(uint64_t blockSize)
+{
+	// Power of 2, multiple of the AES block size, in [kCFFileMinBlockSize; kCFFileMaxBlockSize].
+	if (blockSize < kCFFileMinBlockSize || blockSize > kCFFileMaxBlockSize)
+		return false;
+	
+	return ((blockSize & (blockSize - 1)) == 0);
+}
+
+static bool SMCryptoFileDataAlignmentIsValid(uint64_t dataAlignment)
+{
+	// 0 (no alignment), or power of 2 in [kCFFileMinDataAlignment; kCFFileMaxDataAlignment].
+	if (dataAlignment == 0)
+		return true;
+	
+	if (dataAlignment < kCFFileMinDataAlignment || dataAlignment > kCFFileMaxDataAlignment)
+		return false;
+	
+	return ((dataAlignment & (dataAlignment - 1)) == 0);
+}
+
+static bool SMCryptoFileCacheSizeIsValid(uint64_t cacheSize, uint64_t cacheSlots)
+{
+	// Any size in [kCFFileMinCacheSize; kCFFileMaxCacheSize]: rounded up to a multiple of the block size when the layout is prepared.
+	if (cacheSize < kCFFileMinCacheSize || cacheSize > kCFFileMaxCacheSize)
+		return false;
+	
+	// Slots count (0 for automatic): lowered when the layout is prepared so each slot holds at least one block.
+	return (cacheSlots <= kCFFileMaxCacheSlots);
+}
+
+static bool SMCryptoFilePreallocationSizeIsValid(uint64_t preallocationSize)
+{
+	// 0 (no preallocation), or any size in [kCFFileMinPreallocation; kCFFileMaxPreallocation].
+	if (preallocationSize == 0)
+		return true;
+	
+	return (preallocationSize >= kCFFileMinPreallocation && preallocationSize <= kCFFileMaxPreallocation);
+}
+
+static void SMCryptoFileDataWritten(SMCryptoFile *obj, uint64_t offset, uint64_t end)
+{
+	// Cover a region written on disk by the data length, if it follows it: else a region before it is still queued, or its write failed (the next complete cache flush covers them).
+	if (offset <= obj->fileDataLen)
+		obj->fileDataLen = MAX(obj->fileDataLen, end);
+	
+	obj->fileReservedEnd = MAX(obj->fileReservedEnd, end);
+}
+
+static bool SMCryptoFileFillGapToLength(SMCryptoFile *obj, uint64_t length, SMCryptoFileError *error)
+{
+	// Note: length should be a multiple of the block size. The gap starts after the regions queued for writing.
+	
+	if (obj->fileReservedEnd >= length)
+		return true;
+	
+	// Sparse file: leave the gap as a hole. Cut anything past the concrete length first (stale blocks of an interrupted write would not be holes).
+	if (obj->sparse)
+	{
+		if (ftruncate(obj->fd, (off_t)(obj->dataOffset + obj->fileReservedEnd)) != 0 || ftruncate(obj->fd, (off_t)(obj->dataOffset + length)) != 0)
+		{
+			*error = SMCryptoFileErrorIO;
+			return false;
+		}
+		
+		SMCryptoFileDataWritten(obj, obj->fileReservedEnd, length);
+		obj->preallocatedEnd = length; // The cut released any space reserved ahead.
+		
+		return true;
+	}
+	
+	// Reserve the space of the gap ahead.
+	SMCryptoFilePreallocateGrowth(obj, length);
+	
+	// Write crypted zeros by large runs, if possible.
+	if (SMCryptoFileStagingPrepare(obj))
+		return SMCryptoFileFillGapByRuns(obj, length, error);
+	
+	// Zero bytes buffer.
+	uint8_t *zeroCache = obj->clearBlock;
+	
+	memset(zeroCache, 0, (size_t)obj->blockSize);
+	
+	// Write crypted zeros.
+	uint8_t *fileCache = obj->cryptBuffer;
+
+	for (uint64_t offset = obj->fileReservedEnd; offset < length; offset += obj->blockSize)
+	{
+		uint64_t blockNumber = offset / obj->blockSize;
+
+		// > Crypt zero byte according to current block number.
+		if (SMCryptoFileBlockCrypt(obj, zeroCache, blockNumber, fileCache) == false)
+		{
+			*error = SMCryptoFileErrorCrypto;
+			return false;
+		}
+		
+		if (SMCryptoFileTreeUpdate(obj, fileCache, blockNumber, 1, error) == false)
+			return false;
+		
+		// > Write crypte zero bytes.
+		if (sm_pwrite(obj->fd, fileCache, (size_t)obj->blockSize, (off_t)(obj->dataOffset + offset)) != obj->blockSize)
+		{
+			*error = SMCryptoFileErrorIO;
+			return false;
+		}
+		
+		SMCryptoFileDataWritten(obj, offset, offset + obj->blockSize);
+	}
+	
+	// Return.
+	return true;
+}
+
+static bool SMCryptoFileFillGapByRuns(SMCryptoFile *obj, uint64_t length, SMCryptoFileError *error)
+{
+	// Note: the staging buffer is supposed to be allocated. Runs use each half of it in turn, so the crypt of a run overlaps the disk write of the previous one.
+	uint64_t		halfSize = kCFFileStagingSize / 2;
+	uint64_t		offset = obj->fileReservedEnd;
+	unsigned		half = 0;
+	struct aiocb	request;
+	bool			pending = false;
+	bool			submitted = false;
+	
+	while (offset < length)
+	{
+		uint64_t	runLength = MIN(length - offset, halfSize);
+		uint8_t		*run = obj->stagingBuffer + half * halfSize;
+		
+		// > Crypt zero bytes according to the blocks numbers, in one pass.
+		memset(run, 0, (size_t)runLength);
+		
+		if (obj->backend->xtsEncrypt(&obj->dataCrypto, offset / obj->blockSize, (size_t)obj->blockSize, run, (size_t)runLength, run) == false)
+		{
+			if (pending)
+				SMCryptoFileIORequestComplete(obj, &request, submitted, error);
+			
+			*error = SMCryptoFileErrorCrypto;
+			return false;
+		}
+		
+		if (SMCryptoFileTreeUpdate(obj, run, offset / obj->blockSize, runLength / obj->blockSize, error) == false)
+		{
+			SMCryptoFileError ignored;
+			
+			if (pending)
+				SMCryptoFileIORequestComplete(obj, &request, submitted, &ignored);
+			
+			return false;
+		}
+		
+		// > Wait for the write of the previous run.
+		if (pending && SMCryptoFileIORequestComplete(obj, &request, submitted, error) == false)
+			return false;
+		
+		// > Write this run.
+		SMCryptoFileIORequestPrepare(obj, &request, run, runLength, offset);
+		
+		submitted = (aio_write(&request) == 0);
+		pending = true;
+		
+		offset += runLength;
+		half ^= 1;
+	}
+	
+	// Wait for the write of the last run.
+	if (pending && SMCryptoFileIORequestComplete(obj, &request, submitted, error) == false)
+		return false;
+	
+	return true;
+}
+
+static bool SMCryptoFileStagingPrepare(SMCryptoFile *obj)
+{
+	// Allocate the staging buffer on first use.
+	if (obj->stagingBuffer)
+		return true;
+	
+	if (posix_memalign((void **)&obj->stagingBuffer, (size_t)obj->blockSize, kCFFileStagingSize) != 0)
+	{
+		obj->stagingBuffer = NULL;
+		return false;
+	}
+	
+	return true;
+}
+
+static int SMCryptoFileTemporaryFile(char *pathBuffer, size_t pathBufferSize)
+{
+	char tmp[PATH_MAX];
+	char *f;
+	
+	// Build template.
+	if (confstr(_CS_DARWIN_USER_TEMP_DIR, tmp, sizeof(tmp)) != 0)
+	{
+		snprintf(pathBuffer, pathBufferSize, "%s/cryptofile_XXXXXXXX", tmp);
+	}
+	else if (issetugid() == 0 && (f = getenv("TMPDIR")))
+	{
+		snprintf(pathBuffer, pathBufferSize, "%s/cryptofile_XXXXXXXX", f);
+	}
+	else
+	{
+		strlcpy(pathBuffer, "/tmp/cryptofile_XXXXXXXX", pathBufferSize);
+	}
+	
+	// Create unique file.
+	return mkstemp(pathBuffer);
+}
+
+static bool SMCryptoFileSyncDescriptor(int fd, SMCryptoFileSyncType sync)
+{
+	switch (sync)
+	{
+		case SMCryptoFileSyncFull:
+		{
+			if (fcntl(fd, F_FULLFSYNC) != -1)
+				return true;
+			
+			// In case of error, fallback to standard sync.
+		}
+		
+		case SMCryptoFileSyncNormal:
+			return (fsync(fd) == 0);
+			
+		case SMCryptoFileSyncNo:
+			return true;
+	}
+	
+	return true;
+}
+
+#pragma mark > Instance
+
+static SMCryptoFile * SMCryptoFileAlloc(void)
+{
+	// Get page-size.
+	vm_size_t hostPageSize = 0;
+	
+	if (host_page_size(mach_host_self(), &hostPageSize) != KERN_SUCCESS)
+		hostPageSize = 4096;
+	
+	// Alloc space.
+	size_t	allocSize = SMRoundUp(sizeof(SMCryptoFile), hostPageSize);
+	void	*memory = NULL;
+	
+	if (posix_memalign(&memory, hostPageSize, allocSize) != 0)
+		return NULL;
+		
+	// Lock space to prevent swap to disk (our structure contain key and cache which should not be written on disk).
+	if (mlock(memory, allocSize) != 0)
+	{
+		free(memory);
+		return NULL;
+	}
+	
+	// Initialize to 0.
+	memset(memory, 0, allocSize);
+	
+	// Initialize common fields.
+	SMCryptoFile *result = (SMCryptoFile *)memory;
+
+	result->prefix.magic = kCFMagicValue;
+	result->prefix.version = kCFCurrentVersion;
+	
+	result->header.check = kCFCheckValue;
+	result->header.dataLen = 0;
+	
+	result->readAheadLastEnd = kCFFileReadAheadNoRead;
+	
+	// Return object.
+	return (SMCryptoFile *)memory;
+}
+
+static SMCryptoFile * SMCryptoFileAllocWithOptions(const SMCryptoFileOptions *options, bool layout, SMCryptoFileError *error)
+{
+	// Note: layout is set when creating a file: block size and data alignment options are then checked and hold in the prefix (opening reads them from the file).
+	
+	// Check options.
+	// > Check block size and data alignment.
+	uint64_t blockSize = (options && options->blockSize) ? options->blockSize : kCFFileDefaultBlockSize;
+	uint64_t dataAlignment = options ? options->dataAlignment : 0;
+	
+	if (layout && (SMCryptoFileBlockSizeIsValid(blockSize) == false || SMCryptoFileDataAlignmentIsValid(dataAlignment) == false))
+	{
+		*error = SMCryptoFileErrorArguments;
+		return NULL;
+	}
+	
+	// > Check cache size.
+	uint64_t cacheSize = (options && options->cacheSize) ? options->cacheSize : kCFFileDefaultCacheSize;
+	uint64_t cacheSlots = options ? options->cacheSlots : 0;
+	
+	if (SMCryptoFileCacheSizeIsValid(cacheSize, cacheSlots) == false)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return NULL;
+	}
+	
+	// > Check preallocation size.
+	uint64_t preallocationSize = options ? options->preallocationSize : 0;
+	
+	if (SMCryptoFilePreallocationSizeIsValid(preallocationSize) == false)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return NULL;
+	}
+	
+	// > Check backend.
+	const SMCryptoBackend *backend = SMCryptoBackendGet(options ? options->backend : SMCryptoFileBackendDefault);
+	
+	if (!backend)
+	{
+		*error = SMCryptoFileErrorArguments;
+		return NULL;
+	}
+	
+	// Create structure.
+	SMCryptoFile *result = SMCryptoFileAlloc();
+	
+	if (!result)
+	{
+		*error = SMCryptoFileErrorMemory;
+		return NULL;
+	}
+	
+	result->backend = backend;
+	result->cacheSize = cacheSize;
+	result->cacheSlotCount = (uint32_t)cacheSlots;
+	result->readAheadSlots = options ? options->readAheadSlots : 0;
+	result->writeBehindSlots = options ? options->writeBehindSlots : 0;
+	result->preallocationSize = preallocationSize;
+	result->noCache = options && options->noCache;
+	
+	// Hold block size.
+	if (layout)
+		SMCryptoFilePrefixSetLayout(&result->prefix, blockSize, dataAlignment, SMCryptoFilePrefixFlags(options));
+	
+	return result;
+}
+
+static void SMCryptoFileSetDescriptor(SMCryptoFile *obj, int fd)
+{
+	obj->fd = fd;
+	
+	// Bypass the system cache (advisory: the file stays usable without it).
+	if (obj->noCache)
+		fcntl(fd, F_NOCACHE, 1);
+}
+
+static bool SMCryptoFileFree(SMCryptoFile *obj)
+{
+	// Get page-size.
+	vm_size_t hostPageSize = 0;
+	
+	if (host_page_size(mach_host_self(), &hostPageSize) != KERN_SUCCESS)
+		hostPageSize = 4096;
+	
+	size_t allocSize = SMRoundUp(sizeof(SMCryptoFile), hostPageSize);
+
+	// Free buffers.
+	if (obj->buffers)
+	{
+		memset_s(obj->buffers, obj->buffersSize, 0, obj->buffersSize);
+		munlock(obj->buffers, obj->buffersSize);
+		free(obj->buffers);
+	}
+	
+	free(obj->stagingBuffer);
+	
+	// Free tree nodes.
+	if (obj->treeNodes)
+	{
+		munlock(obj->treeNodes, obj->treeNodesSize);
+		free(obj->treeNodes);
+	}
+	
+	free(obj->treeCopies);
+	
+	// Set to 0 before unlocking.
+	memset_s(obj, allocSize, 0, allocSize);
+	
+	// Unlock.
+	munlock(obj, allocSize);
+	
+	// Free.
+	free(obj);
+	
+	return true;
+}
+
+
+static bool SMCryptoFileLayoutPrepare(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	// Compute layout from prefix.
+	obj->blockSize = 1ULL << obj->prefix.blockSizeShift;
+	obj->headerOffset = kCFFilePrefixOffset + SMCryptoFilePrefixSize(&obj->prefix);
+	obj->headerSlots = (obj->prefix.flags & kCFFlagDualHeader) ? kCFFileDualHeaderSlots : 1;
+	obj->headerSize = (obj->prefix.flags & kCFFlagAuthenticated) ? sizeof(SMCryptoFileHeader) : ((obj->prefix.flags & kCFFlagDualHeader) ? kCFFileDualHeaderSize : kCFFileLegacyHeaderSize);
+	obj->dataOffset = obj->headerOffset + obj->headerSlots * obj->headerSize;
+	
+	if (obj->prefix.dataAlignShift)
+		obj->dataOffset = SMRoundUp(obj->dataOffset, 1ULL << obj->prefix.dataAlignShift);
+	
+	obj->sparse = ((obj->prefix.flags & kCFFlagSparse) != 0);
+	obj->authenticated = ((obj->prefix.flags & kCFFlagAuthenticated) != 0);
+	obj->lazyLength = ((obj->prefix.flags & kCFFlagLazyLength) != 0) && (obj->authenticated == false); // The tree root is committed with the header.
+	
+	// Compute cache slots.
+	// > Cache size, rounded to the block size.
+	uint64_t cacheSize = SMRoundUp(MAX(obj->cacheSize, obj->blockSize), obj->blockSize);
+	
+	// > Slots count: requested count, or slots of kCFFileCacheSlotSize. At least one block per slot.
+	uint64_t slotCount = obj->cacheSlotCount ? obj->cacheSlotCount : cacheSize / MAX(kCFFileCacheSlotSize, obj->blockSize);
+	
+	slotCount = MIN(MAX(slotCount, 1), cacheSize / obj->blockSize);
+	
+	obj->cacheSlotSize = SMRoundUp(cacheSize / slotCount, obj->blockSize);
+	obj->cacheSlotBlocks = obj->cacheSlotSize / obj->blockSize;
+	obj->cacheSlotCount = (uint32_t)slotCount;
+	obj->cacheSize = obj->cacheSlotSize * slotCount;
+	
+	// > Blocks bitmaps size (valid + dirty), in 64 bits words.
+	uint64_t bitmapWords = (obj->cacheSlotBlocks + 63) / 64;
+	
+	// > Read-ahead slots: requested count, or a quarter of the slots. Keep most of the slots for the working set.
+	uint64_t readAheadSlots = obj->readAheadSlots;
+	
+	if (readAheadSlots == 0)
+		readAheadSlots = MIN(slotCount / 4, kCFFileReadAheadMaxSlots);
+	else if (readAheadSlots == SMCryptoFileReadAheadDisabled)
+		readAheadSlots = 0;
+	
+	obj->readAheadSlots = (uint32_t)MIN(readAheadSlots, slotCount / 2);
+	
+	// > Write-behind slots: requested count, up to half of the slots. Slots owned by the worker leave at least one slot to evict.
+	obj->writeBehindSlots = (uint32_t)MIN(obj->writeBehindSlots, slotCount / 2);
+	
+	if (obj->readAheadSlots + obj->writeBehindSlots >= slotCount)
+		obj->readAheadSlots = (uint32_t)(slotCount - 1 - obj->writeBehindSlots);
+	
+	// > No worker for authenticated files: the tree is only verified and updated by the calling thread.
+	if (obj->authenticated)
+	{
+		obj->readAheadSlots = 0;
+		obj->writeBehindSlots = 0;
+	}
+	
+	// > Lookup buckets count (power of 2).
+	uint64_t bucketsCount = 1;
+	
+	while (bucketsCount < slotCount)
+		bucketsCount <<= 1;
+	
+	// Get page-size.
+	vm_size_t hostPageSize = 0;
+	
+	if (host_page_size(mach_host_self(), &hostPageSize) != KERN_SUCCESS)
+		hostPageSize = 4096;
+	
+	// Alloc buffers: cache + crypt buffer + clear block + worker buffer + tree pages + slots and bitmaps (allocated apart from the object, as the cache can be large).
+	size_t	workerSize = (obj->readAheadSlots || obj->writeBehindSlots) ? (size_t)obj->cacheSlotSize : 0;
+	size_t	treeSize = obj->authenticated ? kCFTreeCachePages * (kCFTreePageSize + sizeof(SMCryptoFileTreePage)) : 0;
+	size_t	dataSize = (size_t)(obj->cacheSize + (obj->cacheSlotSize + obj->blockSize) + obj->blockSize) + workerSize + treeSize;
+	size_t	slotsSize = (size_t)slotCount * (sizeof(SMCryptoFileCacheSlot) + 2 * sizeof(SMCryptoFileCacheSlot *) + 2 * (size_t)bitmapWords * sizeof(uint64_t));
+	size_t	allocSize = SMRoundUp(dataSize + slotsSize + (size_t)bucketsCount * sizeof(int32_t), hostPageSize);
+	void	*memory = NULL;
+	
+	if (posix_memalign(&memory, hostPageSize, allocSize) != 0)
+	{
+		*error = SMCryptoFileErrorMemory;
+		return false;
+	}
+	
+	// Lock space to prevent swap to disk (clear data).
+	if (mlock(memory, allocSize) != 0)
+	{
+		free(memory);
+		*error = SMCryptoFileErrorMemory;
+		return false;
+	}
+	
+	memset(memory, 0, allocSize);
+	
+	// Set buffers.
+	uint8_t *cacheData = memory;
+	
+	obj->buffers = memory;
+	obj->buffersSize = allocSize;
+	
+	obj->cryptBuffer = cacheData + obj->cacheSize;
+	obj->clearBlock = obj->cryptBuffer + obj->cacheSlotSize + obj->blockSize;
+	obj->workerBuffer = workerSize ? obj->clearBlock + obj->blockSize : NULL;
+	
+	// Set tree pages.
+	if (treeSize)
+	{
+		uint8_t *leaves = obj->clearBlock + obj->blockSize + workerSize;
+		
+		obj->treeCache = (SMCryptoFileTreePage *)(leaves + kCFTreeCachePages * kCFTreePageSize);
+		
+		for (uint64_t i = 0; i < kCFTreeCachePages; i++)
+			obj->treeCache[i].leaves = leaves + i * kCFTreePageSize;
+	}
+	
+	// Set slots.
+	obj->cacheSlots = (SMCryptoFileCacheSlot *)((uint8_t *)memory + dataSize);
+	obj->cacheFlushList = (SMCryptoFileCacheSlot **)(obj->cacheSlots + slotCount);
+	
+	obj->workerQueue = obj->cacheFlushList + slotCount;
+	
+	uint64_t *bitmaps = (uint64_t *)(obj->workerQueue + slotCount);
+	
+	obj->cacheBuckets = (int32_t *)(bitmaps + 2 * bitmapWords * slotCount);
+	obj->cacheBucketsMask = (uint32_t)(bucketsCount - 1);
+	
+	for (uint64_t i = 0; i < slotCount; i++)
+	{
+		obj->cacheSlots[i].data = cacheData + i * obj->cacheSlotSize;
+		obj->cacheSlots[i].validBlocks = bitmaps + (2 * i) * bitmapWords;
+		obj->cacheSlots[i].dirtyBlocks = bitmaps + (2 * i + 1) * bitmapWords;
+		obj->cacheSlots[i].next = -1;
+	}
+	
+	memset(obj->cacheBuckets, 0xff, (size_t)bucketsCount * sizeof(int32_t));
+	
+	return true;
+}
+
+
+#pragma mark > Prefix
+
+static void SMCryptoFilePrefixSetLayout(SMCryptoFilePrefix *prefix, uint64_t blockSize, uint64_t dataAlignment, uint8_t flags)
+{
+	// Note: files use the oldest version able to describe their layout, so they stay readable by older implementations.
+	prefix->blockSizeShift = (uint8_t)__builtin_ctzll(blockSize);
+	prefix->dataAlignShift = dataAlignment ? (uint8_t)__builtin_ctzll(dataAlignment) : 0;
+	prefix->flags = flags;
+	
+	if (flags)
+		prefix->version = kCFCurrentVersion;
+	else if (dataAlignment)
+		prefix->version = kCFDataAlignVersion;
+	else if (blockSize != kCFFileDefaultBlockSize)
+		prefix->version = kCFBlockSizeVersion;
+	else
+		prefix->version = kCFLegacyVersion;
+}
+
+static uint8_t SMCryptoFilePrefixFlags(const SMCryptoFileOptions *options)
+{
+	uint8_t flags = 0;
+	
+	if (!options)
+		return 0;
+	
+	if (options->sparse)
+		flags |= kCFFlagSparse;
+	
+	if (options->lazyLength)
+		flags |= kCFFlagLazyLength;
+	
+	if (options->dualHeader)
+		flags |= kCFFlagDualHeader;
+	
+	if (options->authenticated)
+		flags |= kCFFlagAuthenticated;
+	
+	return flags;
+}
+
+static uint64_t SMCryptoFilePrefixSize(const SMCryptoFilePrefix *prefix)
+{
+	if (prefix->version == kCFLegacyVersion)
+		return kCFFileLegacyPrefixSize;
+	else if (prefix->version == kCFBlockSizeVersion)
+		return kCFFileV2PrefixSize;
+	else if (prefix->version == kCFDataAlignVersion)
+		return kCFFileV3PrefixSize;
+	
+	return sizeof(SMCryptoFilePrefix);
+}
+
+static bool SMCryptoFilePrefixRead(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	// Note: a file always contains a header after its prefix, so reading the largest prefix is safe.
+	if (sm_pread(obj->fd, &obj->prefix, sizeof(obj->prefix), kCFFilePrefixOffset) != sizeof(obj->prefix))
+	{
+		*error = SMCryptoFileErrorIO;
+		return false;
+	}
+	
+	// Legacy prefixes: fixed block size, data right after the header (the last bytes read belong to the header).
+	if (obj->prefix.version == kCFLegacyVersion)
+		obj->prefix.blockSizeShift = (uint8_t)__builtin_ctzll(kCFFileDefaultBlockSize);
+	
+	if (obj->prefix.version < kCFDataAlignVersion)
+		obj->prefix.dataAlignShift = 0;
+	
+	if (obj->prefix.version < kCFCurrentVersion)
+		obj->prefix.flags = 0;
+	
+	return true;
+}
+
+static bool SMCryptoFilePrefixWrite(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	uint64_t prefixSize = SMCryptoFilePrefixSize(&obj->prefix);
+	
+	if (sm_pwrite(obj->fd, &obj->prefix, (size_t)prefixSize, kCFFilePrefixOffset) != prefixSize)
+	{
+		*error = SMCryptoFileErrorIO;
+		return false;
+	}
+
+	return true;
+}
+
+
+#pragma mark > Header
+
+static bool SMCryptoFileHeaderSetDataLen(SMCryptoFile *obj, uint64_t len, bool flushNow, SMCryptoFileError *error)
+{
+	if (obj->header.dataLen == len)
+		return true;
+	
+	obj->header.dataLen = len;
+	obj->headerDirty = true;
+	
+	if (flushNow)
+		return SMCryptoFileHeaderFlush(obj, SMCryptoFileSyncNo, error);
+	
+	return true;
+}
+
+static bool SMCryptoFileHeaderFlush(SMCryptoFile *obj, SMCryptoFileSyncType sync, SMCryptoFileError *error)
+{
+	// Authenticated files: the header write commits the authentication tree (nothing to commit for read-only handles, or if the tree isn't loaded).
+	if (obj->authenticated && obj->readonly == false && obj->treeNodes)
+		return SMCryptoFileTreeCommit(obj, sync, error);
+	
+	if (obj->headerDirty == false)
+		return true;
+	
+	if (SMCryptoFileHeaderWrite(obj, error) == false)
+		return false;
+	
+	obj->headerDirty = false;
+		
+	return true;
+}
+
+static bool SMCryptoFileHeaderRecoverDataLen(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	// Note: the data blocks on disk are authoritative, the header length is only written at sync points: blocks flushed past it since, or cut by a truncate before it was written.
+	struct stat st;
+	
+	if (fstat(obj->fd, &st) != 0)
+	{
+		*error = SMCryptoFileErrorIO;
+		return false;
+	}
+	
+	// Whole blocks on disk (a torn last block is dropped).
+	uint64_t fileSize = (uint64_t)st.st_size;
+	uint64_t diskDataLen = (fileSize > obj->dataOffset) ? SMRoundDown(fileSize - obj->dataOffset, obj->blockSize) : 0;
+	
+	if (diskDataLen == SMRoundUp(obj->header.dataLen, obj->blockSize))
+		return true;
+	
+	// Take the length of the blocks on disk: the end of the last block reads as zeros. Written at the next sync point.
+	SMCryptoDebugLog("Warning: Data length recovered from the file size.\n");
+	
+	obj->header.dataLen = diskDataLen;
+	obj->headerDirty = (obj->readonly == false);
+	
+	return true;
+}
+
+static bool SMCryptoFileHeaderRead(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	unsigned			keySize = SMCryptoFileRealKeySize(obj);
+	SMCryptoFileHeader	header = { 0 };
+	bool				found = false;
+	bool				torn = false;
+	bool				result = false;
+	
+	// Read each slot, and keep the valid one with the highest generation.
+	for (uint64_t slot = 0; slot < obj->headerSlots; slot++)
+	{
+		char cryptedHeader[sizeof(SMCryptoFileHeader)];
+		
+		// > Read crypted header.
+		if (sm_pread(obj->fd, cryptedHeader, (size_t)obj->headerSize, (off_t)(obj->headerOffset + slot * obj->headerSize)) != obj->headerSize)
+		{
+			*error = SMCryptoFileErrorIO;
+			goto clean;
+		}
+		
+		// > Decrypt header.
+		if (obj->backend->cbcDecrypt(obj->headerKey, keySize, obj->prefix.headerIV, cryptedHeader, (size_t)obj->headerSize, &header) == false)
+		{
+			SMCryptoDebugLog("Error: Can't decrypt header.\n");
+			*error = SMCryptoFileErrorCrypto;
+			goto clean;
+		}
+		
+		// > Single slot: checked by the caller.
+		if (obj->headerSlots == 1)
+		{
+			obj->header = header;
+			found = true;
+			break;
+		}
+		
+		// > Check slot (a wrong password gives a bad check value, a torn write a bad CRC).
+		if (header.check != kCFCheckValue)
+			continue;
+		
+		if (header.headerCRC != SMCryptoFileHeaderCRC(obj, &header))
+		{
+			SMCryptoDebugLog("Warning: Torn header slot.\n");
+			torn = true;
+			continue;
+		}
+		
+		if (found && header.generation <= obj->header.generation)
+			continue;
+		
+		obj->header = header;
+		found = true;
+	}
+	
+	if (!found)
+	{
+		*error = torn ? SMCryptoFileErrorCorrupted : SMCryptoFileErrorPassword;
+		goto clean;
+	}
+	
+	result = true;
+	
+clean:
+	memset_s(&header, sizeof(header), 0, sizeof(header));
+	
+	return result;
+}
+
+static bool SMCryptoFileHeaderWrite(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	// Dual header: write the next slot, so the current one stays valid if this write is torn.
+	uint64_t slot = 0;
+	
+	if (obj->headerSlots > 1)
+	{
+		obj->header.generation++;
+		obj->header.headerCRC = SMCryptoFileHeaderCRC(obj, &obj->header);
+		
+		slot = obj->header.generation % obj->headerSlots;
+	}
+	
+	// Crypt header with header key.
+	unsigned	keySize = SMCryptoFileRealKeySize(obj);
+	char		cryptedHeader[sizeof(SMCryptoFileHeader)];
+
+	if (obj->backend->cbcEncrypt(obj->headerKey, keySize, obj->prefix.headerIV, &obj->header, (size_t)obj->headerSize, cryptedHeader) == false)
+	{
+		SMCryptoDebugLog("Error: Can't crypt header.\n");
+		*error = SMCryptoFileErrorCrypto;
+		goto fail;
+	}
+
+	// Write crypted header.
+	if (sm_pwrite(obj->fd, cryptedHeader, (size_t)obj->headerSize, (off_t)(obj->headerOffset + slot * obj->headerSize)) != obj->headerSize)
+	{
+		*error = SMCryptoFileErrorIO;
+		goto fail;
+	}
+
+	return true;
+	
+fail:
+	// Next write goes to the same slot again: the other one is the only valid.
+	if (obj->headerSlots > 1)
+		obj->header.generation--;
+	
+	return false;
+}
+
+static bool SMCryptoFileHeaderWriteSlots(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	// Write the header in every slot (new file, or new header key).
+	for (uint64_t slot = 0; slot < obj->headerSlots; slot++)
+	{
+		if (SMCryptoFileHeaderWrite(obj, error) == false)
+			return false;
+	}
+	
+	return true;
+}
+
+static uint32_t SMCryptoFileHeaderCRC(SMCryptoFile *obj, const SMCryptoFileHeader *header)
+{
+	// Cover the fields before the CRC, then the ones after the padding (authentication tree), so the dual header CRC stays unchanged.
+	uint32_t crc = SMCryptoCRC32(0, header, offsetof(SMCryptoFileHeader, headerCRC));
+	
+	if (obj->headerSize > kCFFileDualHeaderSize)
+		crc = SMCryptoCRC32(crc, (const uint8_t *)header + kCFFileDualHeaderSize, (size_t)(obj->headerSize - kCFFileDualHeaderSize));
+	
+	return crc;
+}
+
+
+#pragma mark > Cache
+
+static bool SMCryptoFileCacheFlush(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	// Take back the slots owned by the worker (slots not written in background stay dirty).
+	SMCryptoFileWorkerCollectAll(obj);
+	
+	// List dirty slots.
+	size_t count = 0;
+	
+	for (uint32_t i = 0; i < obj->cacheSlotCount; i++)
+	{
+		SMCryptoFileCacheSlot *slot = &obj->cacheSlots[i];
+		
+		if (slot->used && slot->dirty)
+			obj->cacheFlushList[count++] = slot;
+	}
+	
+	// Fast path.
+	if (count == 0)
+	{
+		obj->fileDataLen = obj->fileReservedEnd; // Nothing queued nor dirty: the regions reserved are written.
+		return true;
+	}
+	
+	// Sort them by offset, so the file is written (and its gaps filled) in ascending order, and runs contiguous in file are written as one.
+	qsort(obj->cacheFlushList, count, sizeof(SMCryptoFileCacheSlot *), SMCryptoFileCacheSlotCompare);
+	
+	// Flush slots one by one, if there is nothing to batch or no staging buffer.
+	if (count == 1 || SMCryptoFileStagingPrepare(obj) == false)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (SMCryptoFileCacheSlotFlush(obj, obj->cacheFlushList[i], error) == false)
+				return false;
+		}
+		
+		obj->fileDataLen = obj->fileReservedEnd;
+		
+		return true;
+	}
+	
+	// Flush slots in batches: crypt the dirty runs into the staging buffer, and submit their writes together.
+	SMCryptoFileIOBatch batch = { .count = 0, .stagingUsed = 0 };
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		SMCryptoFileCacheSlot *slot = obj->cacheFlushList[i];
+		
+		// > Submit the queued writes before filling a gap (gaps are filled through the staging buffer).
+		if (batch.count > 0 && slot->offset > obj->fileReservedEnd)
+		{
+			if (SMCryptoFileIOBatchSubmit(obj, &batch, error) == false)
+				return false;
+		}
+		
+		// > Prepare dirty blocks.
+		uint64_t endOffset = 0;
+		
+		if (SMCryptoFileCacheSlotPrepareFlush(obj, slot, &endOffset, error) == false)
+			return false;
+		
+		// > Crypt and queue each run of contiguous dirty blocks, in pieces fitting the staging buffer.
+		uint64_t firstBlock = 0;
+		
+		while ((firstBlock = SMCryptoBitmapFind(slot->dirtyBlocks, firstBlock, obj->cacheSlotBlocks, true)) < obj->cacheSlotBlocks)
+		{
+			uint64_t endBlock = SMCryptoBitmapFind(slot->dirtyBlocks, firstBlock + 1, obj->cacheSlotBlocks, false);
+			
+			for (uint64_t block = firstBlock; block < endBlock; )
+			{
+				if (batch.count == kCFFileIOBatchMax || batch.stagingUsed == kCFFileStagingSize)
+				{
+					if (SMCryptoFileIOBatchSubmit(obj, &batch, error) == false)
+						return false;
+				}
+				
+				uint64_t	blocks = MIN(endBlock - block, (kCFFileStagingSize - batch.stagingUsed) / obj->blockSize);
+				uint64_t	offset = slot->offset + block * obj->blockSize;
+				uint8_t		*fileCache = obj->stagingBuffer + batch.stagingUsed;
+				
+				if (obj->backend->xtsEncrypt(&obj->dataCrypto, offset / obj->blockSize, (size_t)obj->blockSize, slot->data + block * obj->blockSize, (size_t)(blocks * obj->blockSize), fileCache) == false)
+				{
+					*error = SMCryptoFileErrorCrypto;
+					return false;
+				}
+				
+				if (SMCryptoFileTreeUpdate(obj, fileCache, offset / obj->blockSize, blocks, error) == false)
+					return false;
+				
+				SMCryptoFileIOBatchAdd(obj, &batch, fileCache, blocks * obj->blockSize, offset);
+				
+				block += blocks;
+			}
+			
+			firstBlock = endBlock;
+		}
+		
+		// > Reserve the region of the slot on disk, so the gaps filled before the next slots don't overwrite it (the data length covers it once written).
+		obj->fileReservedEnd = MAX(obj->fileReservedEnd, endOffset);
+	}
+	
+	if (SMCryptoFileIOBatchSubmit(obj, &batch, error) == false)
+		return false;
+	
+	// Clean dirty flags.
+	for (size_t i = 0; i < count; i++)
+	{
+		SMCryptoFileCacheSlot *slot = obj->cacheFlushList[i];
+		
+		SMCryptoBitmapSetRange(slot->dirtyBlocks, 0, obj->cacheSlotBlocks, false);
+		slot->dirty = false;
+	}
+	
+	obj->fileDataLen = obj->fileReservedEnd;
+	
+	return true;
+}
+
+static void SMCryptoFileCacheTruncate(SMCryptoFile *obj, uint64_t length)
+{
+	for (uint32_t i = 0; i < obj->cacheSlotCount; i++)
+	{
+		SMCryptoFileCacheSlot *slot = &obj->cacheSlots[i];
+		
+		if (slot->used == false || slot->offset + obj->cacheSlotSize <= length)
+			continue;
+		
+		// > Slot after length: drop it.
+		if (slot->offset >= length)
+		{
+			SMCryptoFileCacheSlotRelease(obj, slot);
+			continue;
+		}
+		
+		// > Slot containing length: zero the end of the truncated block, drop the next blocks.
+		uint64_t delta = length - slot->offset;
+		uint64_t block = SMRoundUp(delta, obj->blockSize) / obj->blockSize;
+		
+		if (delta != SMRoundDown(delta, obj->blockSize) && SMCryptoBitmapGet(slot->validBlocks, block - 1))
+			memset(slot->data + delta, 0, (size_t)(block * obj->blockSize - delta));
+		
+		SMCryptoBitmapSetRange(slot->validBlocks, block, obj->cacheSlotBlocks, false);
+		SMCryptoBitmapSetRange(slot->dirtyBlocks, block, obj->cacheSlotBlocks, false);
+	}
+}
+
+static bool SMCryptoFileCacheBypassRead(SMCryptoFile *obj, SMCryptoIOVecCursor *cursor, uint64_t offset, uint64_t size, uint64_t *length, SMCryptoFileError *error)
+{
+	// Note: offset is supposed to be a slot boundary, and size to be in data.
+	
+	// Find the run of whole slots not in cache which fits the current output segment (slots in cache may hold data not written yet).
+	uint64_t	room = 0;
+	uint8_t		*output = SMCryptoIOVecContiguous(cursor, &room);
+	uint64_t	limit = MIN(size, room);
+	uint64_t	runLength = 0;
+	
+	while (runLength + obj->cacheSlotSize <= limit && SMCryptoFileCacheSlotLookup(obj, (offset + runLength) / obj->cacheSlotSize) == NULL)
+		runLength += obj->cacheSlotSize;
+	
+	*length = runLength;
+	
+	if (runLength == 0)
+		return true;
+	
+	// Part of the run on disk (blocks after the concrete length are zeros).
+	uint64_t fileLength = 0;
+	
+	if (offset < obj->fileReservedEnd)
+		fileLength = MIN(runLength, obj->fileReservedEnd - offset);
+	
+	if (fileLength > 0)
+	{
+		const uint8_t *fileCache = SMCryptoFileMapGet(obj, offset, fileLength);
+		
+		// > Read (if not mapped).
+		if (!fileCache)
+		{
+			if (sm_pread(obj->fd, output, (size_t)fileLength, (off_t)(obj->dataOffset + offset)) != fileLength)
+			{
+				*error = SMCryptoFileErrorIO;
+				return false;
+			}
+			
+			fileCache = output;
+		}
+		
+		// > Authenticate.
+		if (SMCryptoFileTreeVerify(obj, fileCache, offset / obj->blockSize, fileLength / obj->blockSize, error) == false)
+			return false;
+		
+		// > Decrypt (in place if read).
+		if (SMCryptoFileBlocksDecrypt(obj, fileCache, offset / obj->blockSize, fileLength / obj->blockSize, output) == false)
+		{
+			*error = SMCryptoFileErrorCrypto;
+			return false;
+		}
+	}
+	
+	memset(output + fileLength, 0, (size_t)(runLength - fileLength));
+	
+	// Move the cursor.
+	cursor->offset += runLength;
+	
+	return true;
+}
+
+static bool SMCryptoFileCacheBypassWrite(SMCryptoFile *obj, SMCryptoIOVecCursor *cursor, uint64_t offset, uint64_t size, uint64_t *length, SMCryptoFileError *error)
+{
+	// Note: offset is supposed to be a slot boundary.
+	
+	// Find the run of whole slots which fits the current input segment.
+	uint64_t		room = 0;
+	const uint8_t	*input = SMCryptoIOVecContiguous(cursor, &room);
+	uint64_t		runLength = MIN(size, room) / obj->cacheSlotSize * obj->cacheSlotSize;
+	
+	*length = 0;
+	
+	if (runLength == 0)
+		return true;
+	
+	// Get staging buffer. On failure, write through the cache.
+	if (SMCryptoFileStagingPrepare(obj) == false)
+		return true;
+	
+	// Drop the slots of the run from the cache: they are fully overwritten (busy ones are taken back from the worker first).
+	for (uint64_t slotOffset = offset; slotOffset < offset + runLength; slotOffset += obj->cacheSlotSize)
+	{
+		SMCryptoFileCacheSlot *slot = SMCryptoFileCacheSlotLookup(obj, slotOffset / obj->cacheSlotSize);
+		
+		if (slot)
+			SMCryptoFileCacheSlotRelease(obj, slot);
+	}
+	
+	// Reserve the space of the run ahead (covers the gap before it).
+	SMCryptoFilePreallocateGrowth(obj, offset + runLength);
+	
+	// Write padding zero (if necessary) betwen current concrete length and offset.
+	if (SMCryptoFileFillGapToLength(obj, offset, error) == false)
+		return false;
+	
+	// Crypt and write the run, by staging buffer.
+	for (uint64_t done = 0; done < runLength; )
+	{
+		uint64_t chunk = MIN(runLength - done, kCFFileStagingSize);
+		
+		// > Crypt blocks in one pass.
+		if (SMCryptoFileBlocksCrypt(obj, input + done, (offset + done) / obj->blockSize, chunk / obj->blockSize, obj->stagingBuffer) == false)
+		{
+			*error = SMCryptoFileErrorCrypto;
+			return false;
+		}
+		
+		if (SMCryptoFileTreeUpdate(obj, obj->stagingBuffer, (offset + done) / obj->blockSize, chunk / obj->blockSize, error) == false)
+			return false;
+		
+		// > Write crypted blocks on disk.
+		if (sm_pwrite(obj->fd, obj->stagingBuffer, (size_t)chunk, (off_t)(obj->dataOffset + offset + done)) != chunk)
+		{
+			*error = SMCryptoFileErrorIO;
+			return false;
+		}
+		
+		// > Update data file len.
+		SMCryptoFileDataWritten(obj, offset + done, offset + done + chunk);
+		
+		done += chunk;
+	}
+	
+	// Move the cursor.
+	cursor->offset += runLength;
+	*length = runLength;
+	
+	return true;
+}
+
+static SMCryptoFileCacheSlot * SMCryptoFileCachePrepareReading(SMCryptoFile *obj, uint64_t offset, SMCryptoFileError *error)
+{
+	// Note: offset is supposed to be less than dataLen.
+	
+	// Get the slot holding offset.
+	uint64_t				slotNumber = offset / obj->cacheSlotSize;
+	SMCryptoFileCacheSlot	*slot = SMCryptoFileCacheSlotLookup(obj, slotNumber);
+	
+	if (!slot)
+	{
+		slot = SMCryptoFileCacheSlotAcquire(obj, slotNumber, error);
+		
+		if (!slot)
+			return NULL;
+	}
+	
+	slot->referenced = true;
+	
+	// Load the block at offset if necessary, with the next missing blocks of the slot, up to the end of data.
+	uint64_t block = (offset - slot->offset) / obj->blockSize;
+	
+	if (SMCryptoBitmapGet(slot->validBlocks, block) == false)
+	{
+		uint64_t dataBlocks = (SMRoundUp(obj->header.dataLen, obj->blockSize) - slot->offset) / obj->blockSize;
+		uint64_t endBlock = SMCryptoBitmapFind(slot->validBlocks, block + 1, MIN(obj->cacheSlotBlocks, dataBlocks), true);
+		
+		if (SMCryptoFileCacheSlotLoad(obj, slot, block, endBlock, error) == false)
+			return NULL;
+	}
+	
+	// Done.
+	return slot;
+}
+
+static SMCryptoFileCacheSlot * SMCryptoFileCachePrepareWriting(SMCryptoFile *obj, uint64_t offset, uint64_t size, SMCryptoFileError *error)
+{
+	// Note: size is supposed to be greater than 0.
+	
+	// Get the slot holding offset.
+	uint64_t				slotNumber = offset / obj->cacheSlotSize;
+	SMCryptoFileCacheSlot	*slot = SMCryptoFileCacheSlotLookup(obj, slotNumber);
+	
+	if (!slot)
+	{
+		slot = SMCryptoFileCacheSlotAcquire(obj, slotNumber, error);
+		
+		if (!slot)
+			return NULL;
+	}
+	
+	slot->referenced = true;
+	
+	// Load the blocks partially overwritten, so they can be crypted as a whole later. Fully overwritten blocks are not read.
+	uint64_t delta = offset - slot->offset;
+	uint64_t end = MIN(delta + size, obj->cacheSlotSize);
+	uint64_t firstBlock = delta / obj->blockSize;
+	uint64_t lastBlock = (end - 1) / obj->blockSize;
+
+	if (delta != SMRoundDown(delta, obj->blockSize) && SMCryptoBitmapGet(slot->validBlocks, firstBlock) == false)
+	{
+		if (SMCryptoFileCacheSlotLoad(obj, slot, firstBlock, firstBlock + 1, error) == false)
+			return NULL;
+	}
+	
+	if (end != SMRoundDown(end, obj->blockSize) && SMCryptoBitmapGet(slot->validBlocks, lastBlock) == false)
+	{
+		if (SMCryptoFileCacheSlotLoad(obj, slot, lastBlock, lastBlock + 1, error) == false)
+			return NULL;
+	}
+	
+	return slot;
+}
+
+static SMCryptoFileCacheSlot * SMCryptoFileCacheSlotLookup(SMCryptoFile *obj, uint64_t slotNumber)
+{
+	uint64_t offset = slotNumber * obj->cacheSlotSize;
+	
+	// Fast path: sequential access.
+	SMCryptoFileCacheSlot *lastSlot = obj->cacheLastSlot;
+	
+	if (lastSlot && lastSlot->used && lastSlot->offset == offset && lastSlot->busy == false)
+		return lastSlot;
+	
+	// Search bucket.
+	uint32_t bucket = (uint32_t)((slotNumber * 0x9E3779B97F4A7C15ULL) >> 32) & obj->cacheBucketsMask;
+	
+	for (int32_t index = obj->cacheBuckets[bucket]; index != -1; index = obj->cacheSlots[index].next)
+	{
+		SMCryptoFileCacheSlot *slot = &obj->cacheSlots[index];
+		
+		if (slot->offset == offset)
+		{
+			if (slot->busy)
+				SMCryptoFileWorkerCollect(obj, slot, true);
+			
+			obj->cacheLastSlot = slot;
+			return slot;
+		}
+	}
+	
+	return NULL;
+}
+
+static SMCryptoFileCacheSlot * SMCryptoFileCacheSlotAcquire(SMCryptoFile *obj, uint64_t slotNumber, SMCryptoFileError *error)
+{
+	// Note: slotNumber is supposed to not be in the cache.
+	
+	// Find a free slot, or evict one (CLOCK: the first slot not referenced since the last pass).
+	SMCryptoFileCacheSlot *slot;
+	
+	while (1)
+	{
+		slot = &obj->cacheSlots[obj->cacheClockHand];
+		
+		obj->cacheClockHand = (obj->cacheClockHand + 1) % obj->cacheSlotCount;
+		
+		// > Slots owned by the worker: take back the finished ones, skip the others.
+		if (slot->busy && SMCryptoFileWorkerTryCollect(obj, slot) == false)
+			continue;
+		
+		if (slot->used == false || slot->referenced == false)
+			break;
+		
+		slot->referenced = false;
+	}
+	
+	// Write back the evicted slot.
+	if (slot->used)
+	{
+		if (SMCryptoFileCacheSlotFlush(obj, slot, error) == false)
+			return NULL;
+		
+		SMCryptoFileCacheSlotRelease(obj, slot);
+	}
+	
+	// Attach the slot to its new position.
+	uint32_t	bucket = (uint32_t)((slotNumber * 0x9E3779B97F4A7C15ULL) >> 32) & obj->cacheBucketsMask;
+	int32_t		index = (int32_t)(slot - obj->cacheSlots);
+	
+	slot->offset = slotNumber * obj->cacheSlotSize;
+	slot->used = true;
+	slot->dirty = false;
+	slot->referenced = false;
+	
+	slot->next = obj->cacheBuckets[bucket];
+	obj->cacheBuckets[bucket] = index;
+	
+	obj->cacheLastSlot = slot;
+	
+	return slot;
+}
+
+static void SMCryptoFileCacheSlotRelease(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot)
+{
+	// Wait for the worker.
+	if (slot->busy)
+		SMCryptoFileWorkerCollect(obj, slot, true);
+	
+	// Detach from bucket.
+	uint64_t	slotNumber = slot->offset / obj->cacheSlotSize;
+	uint32_t	bucket = (uint32_t)((slotNumber * 0x9E3779B97F4A7C15ULL) >> 32) & obj->cacheBucketsMask;
+	int32_t		index = (int32_t)(slot - obj->cacheSlots);
+	int32_t		*link = &obj->cacheBuckets[bucket];
+	
+	while (*link != -1 && *link != index)
+		link = &obj->cacheSlots[*link].next;
+	
+	if (*link == index)
+		*link = slot->next;
+	
+	// Reset.
+	SMCryptoBitmapSetRange(slot->validBlocks, 0, obj->cacheSlotBlocks, false);
+	SMCryptoBitmapSetRange(slot->dirtyBlocks, 0, obj->cacheSlotBlocks, false);
+	
+	slot->next = -1;
+	slot->offset = 0;
+	slot->used = false;
+	slot->dirty = false;
+	slot->referenced = false;
+	
+	if (obj->cacheLastSlot == slot)
+		obj->cacheLastSlot = NULL;
+}
+
+static bool SMCryptoFileCacheSlotLoad(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, uint64_t firstBlock, uint64_t endBlock, SMCryptoFileError *error)
+{
+	// Note: blocks in [firstBlock; endBlock[ are supposed to not be valid.
+	uint64_t offset = slot->offset + firstBlock * obj->blockSize;
+	uint64_t length = (endBlock - firstBlock) * obj->blockSize;
+	uint8_t	*data = slot->data + firstBlock * obj->blockSize;
+	
+	// > Part of the blocks on disk (blocks after the concrete length are zeros).
+	uint64_t fileLength = 0;
+	
+	if (offset < obj->fileReservedEnd)
+		fileLength = MIN(length, obj->fileReservedEnd - offset);
+	
+	// > Read blocks.
+	if (fileLength > 0)
+	{
+		const uint8_t *fileCache = SMCryptoFileMapGet(obj, offset, fileLength);
+		
+		// > Read (if not mapped).
+		if (!fileCache)
+		{
+			if (sm_pread(obj->fd, obj->cryptBuffer, (size_t)fileLength, (off_t)(obj->dataOffset + offset)) != fileLength)
+			{
+				*error = SMCryptoFileErrorIO;
+				return false;
+			}
+			
+			fileCache = obj->cryptBuffer;
+		}
+		
+		// > Authenticate blocks.
+		if (SMCryptoFileTreeVerify(obj, fileCache, offset / obj->blockSize, fileLength / obj->blockSize, error) == false)
+			return false;
+		
+		// > Decrypt blocks in one pass.
+		if (SMCryptoFileBlocksDecrypt(obj, fileCache, offset / obj->blockSize, fileLength / obj->blockSize, data) == false)
+		{
+			*error = SMCryptoFileErrorCrypto;
+			return false;
+		}
+	}
+	
+	// > End-Of-File: zero the remaining blocks.
+	memset(data + fileLength, 0, (size_t)(length - fileLength));
+	
+	// > Update slot info.
+	SMCryptoBitmapSetRange(slot->validBlocks, firstBlock, endBlock, true);
+	
+	return true;
+}
+
+static bool SMCryptoFileCacheSlotFlush(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, SMCryptoFileError *error)
+{
+	// Fast path.
+	if (slot->dirty == false)
+		return true;
+	
+	// Prepare dirty blocks.
+	uint64_t endOffset = 0;
+	
+	if (SMCryptoFileCacheSlotPrepareFlush(obj, slot, &endOffset, error) == false)
+		return false;
+	
+	// Write them.
+	if (SMCryptoFileCacheSlotWrite(obj, slot, &obj->dataCrypto, obj->cryptBuffer, error) == false)
+		return false;
+	
+	// Update data file len.
+	SMCryptoFileDataWritten(obj, slot->offset, endOffset);
+	
+	// Clean dirty flag.
+	slot->dirty = false;
+	
+	// Return.
+	return true;
+}
+
+static bool SMCryptoFileCacheSlotPrepareFlush(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, uint64_t *endOffset, SMCryptoFileError *error)
+{
+	// Find the end of the last dirty block.
+	uint64_t block = 0;
+	uint64_t endBlock = 0;
+	
+	while ((block = SMCryptoBitmapFind(slot->dirtyBlocks, block, obj->cacheSlotBlocks, true)) < obj->cacheSlotBlocks)
+	{
+		block = SMCryptoBitmapFind(slot->dirtyBlocks, block + 1, obj->cacheSlotBlocks, false);
+		endBlock = block;
+	}
+	
+	*endOffset = slot->offset + endBlock * obj->blockSize;
+	
+	// Reserve the space of the slot ahead (covers the gap before it).
+	SMCryptoFilePreallocateGrowth(obj, *endOffset);
+	
+	// Write padding zero (if necessary) betwen current concrete length and the slot.
+	if (SMCryptoFileFillGapToLength(obj, slot->offset, error) == false)
+		return false;
+	
+	// Write the blocks of the slot after the concrete length with the dirty ones, so the slot doesn't leave a hole: zero the ones not in cache.
+	uint64_t firstBlock = (obj->fileReservedEnd > slot->offset) ? (obj->fileReservedEnd - slot->offset) / obj->blockSize : 0;
+	
+	for (block = firstBlock; block < endBlock; block++)
+	{
+		if (SMCryptoBitmapGet(slot->validBlocks, block) == false)
+			memset(slot->data + block * obj->blockSize, 0, (size_t)obj->blockSize);
+	}
+	
+	if (firstBlock < endBlock)
+	{
+		SMCryptoBitmapSetRange(slot->validBlocks, firstBlock, endBlock, true);
+		SMCryptoBitmapSetRange(slot->dirtyBlocks, firstBlock, endBlock, true);
+	}
+	
+	return true;
+}
+
+static bool SMCryptoFileCacheSlotWrite(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, const SMCryptoBackendContext *crypto, uint8_t *buffer, SMCryptoFileError *error)
+{
+	// Note: called by the worker for write-behind, so only use the layout and the given crypto context and buffer (cacheSlotSize bytes). Authenticated files have no worker, so the tree is updated here.
+	
+	// Write each run of contiguous dirty blocks.
+	uint64_t firstBlock = 0;
+	
+	while ((firstBlock = SMCryptoBitmapFind(slot->dirtyBlocks, firstBlock, obj->cacheSlotBlocks, true)) < obj->cacheSlotBlocks)
+	{
+		uint64_t endBlock = SMCryptoBitmapFind(slot->dirtyBlocks, firstBlock + 1, obj->cacheSlotBlocks, false);
+		uint64_t offset = slot->offset + firstBlock * obj->blockSize;
+		uint64_t length = (endBlock - firstBlock) * obj->blockSize;
+		
+		// > Crypt blocks in one pass.
+		if (obj->backend->xtsEncrypt(crypto, offset / obj->blockSize, (size_t)obj->blockSize, slot->data + firstBlock * obj->blockSize, (size_t)length, buffer) == false)
+		{
+			*error = SMCryptoFileErrorCrypto;
+			return false;
+		}
+		
+		if (SMCryptoFileTreeUpdate(obj, buffer, offset / obj->blockSize, endBlock - firstBlock, error) == false)
+			return false;
+		
+		// > Write crypted blocks on disk.
+		if (sm_pwrite(obj->fd, buffer, (size_t)length, (off_t)(obj->dataOffset + offset)) != length)
+		{
+			*error = SMCryptoFileErrorIO;
+			return false;
+		}
+		
+		// > Clean dirty flags.
+		SMCryptoBitmapSetRange(slot->dirtyBlocks, firstBlock, endBlock, false);
+		
+		firstBlock = endBlock;
+	}
+	
+	return true;
+}
+
+static SMCryptoRange SMCryptoFileCacheSlotValidRange(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, uint64_t offset)
+{
+	// Range of the contiguous valid blocks holding offset (empty range if its block is not valid).
+	uint64_t block = (offset - slot->offset) / obj->blockSize;
+	
+	if (SMCryptoBitmapGet(slot->validBlocks, block) == false)
+		return SMCryptoMakeRange(offset, 0);
+	
+	uint64_t endBlock = SMCryptoBitmapFind(slot->validBlocks, block + 1, obj->cacheSlotBlocks, false);
+	
+	return SMCryptoMakeRange(slot->offset + block * obj->blockSize, (endBlock - block) * obj->blockSize);
+}
+
+
+static int SMCryptoFileCacheSlotCompare(const void *a, const void *b)
+{
+	const SMCryptoFileCacheSlot *slotA = *(SMCryptoFileCacheSlot * const *)a;
+	const SMCryptoFileCacheSlot *slotB = *(SMCryptoFileCacheSlot * const *)b;
+	
+	return (slotA->offset > slotB->offset) - (slotA->offset < slotB->offset);
+}
+
+
+#pragma mark > Read-ahead
+
+static void SMCryptoFileReadAheadUpdate(SMCryptoFile *obj, uint64_t offset, uint64_t size)
+{
+	if (obj->readAheadSlots == 0 && obj->map == NULL)
+		return;
+	
+	// Detect pattern: sequential (read starts where the last one ended) or strided (same distance as last time). The first read is neither.
+	bool	first = (obj->readAheadLastEnd == kCFFileReadAheadNoRead);
+	int64_t	stride = first ? 0 : (int64_t)(offset - obj->readAheadLastOffset);
+	bool	sequential = (first == false && offset == obj->readAheadLastEnd);
+	bool	strided = (stride > 0 && stride == obj->readAheadLastStride);
+	
+	obj->readAheadStreak = (sequential || strided) ? obj->readAheadStreak + 1 : 0;
+	obj->readAheadLastOffset = offset;
+	obj->readAheadLastEnd = offset + size;
+	obj->readAheadLastStride = stride;
+	
+	// Advise the system about the mapping use.
+	if (obj->map)
+		SMCryptoFileMapAdvise(obj, (obj->readAheadStreak >= kCFFileReadAheadTrigger) ? MADV_SEQUENTIAL : MADV_RANDOM);
+	
+	if (obj->readAheadSlots == 0 || obj->readAheadStreak < kCFFileReadAheadTrigger)
+		return;
+	
+	// Load the next slots of the pattern.
+	uint64_t next = sequential ? offset + size : offset + (uint64_t)stride;
+	uint64_t step = sequential ? obj->cacheSlotSize : (uint64_t)stride;
+	uint64_t lastSlotNumber = (offset + size - 1) / obj->cacheSlotSize;
+	
+	for (uint32_t i = 0; i < obj->readAheadSlots; i++)
+	{
+		uint64_t position = next + i * step;
+		uint64_t slotNumber = position / obj->cacheSlotSize;
+		
+		if (position >= obj->header.dataLen)
+			break;
+		
+		if (slotNumber == lastSlotNumber)
+			continue;
+		
+		SMCryptoFileReadAheadSchedule(obj, slotNumber);
+		
+		lastSlotNumber = slotNumber;
+	}
+	
+	// Advise the system about the region after the slots we load (pointless without the system cache).
+	if (sequential && obj->noCache == false)
+	{
+		uint64_t adviseEnd = MIN((lastSlotNumber + 1 + obj->readAheadSlots) * obj->cacheSlotSize, obj->fileReservedEnd);
+		
+		// > The region advised is past this one: the reads jumped back (new scan), advise again from here.
+		if (obj->readAheadAdvised > adviseEnd)
+			obj->readAheadAdvised = 0;
+		
+		uint64_t adviseStart = MAX((lastSlotNumber + 1) * obj->cacheSlotSize, obj->readAheadAdvised);
+		
+		if (adviseStart < adviseEnd)
+		{
+			struct radvisory advisory = { .ra_offset = (off_t)(obj->dataOffset + adviseStart), .ra_count = (int)MIN(adviseEnd - adviseStart, (uint64_t)INT_MAX) };
+			
+			fcntl(obj->fd, F_RDADVISE, &advisory);
+			
+			obj->readAheadAdvised = adviseStart + (uint64_t)advisory.ra_count;
+		}
+	}
+}
+
+static void SMCryptoFileReadAheadSchedule(SMCryptoFile *obj, uint64_t slotNumber)
+{
+	// Already in cache.
+	if (SMCryptoFileCacheSlotLookup(obj, slotNumber))
+		return;
+	
+	// Compute blocks to load: whole slot, up to the end of data.
+	uint64_t offset = slotNumber * obj->cacheSlotSize;
+	uint64_t dataBlocks = (SMRoundUp(obj->header.dataLen, obj->blockSize) - offset) / obj->blockSize;
+	uint64_t blocks = MIN(obj->cacheSlotBlocks, dataBlocks);
+	uint64_t fileLength = (offset < obj->fileReservedEnd) ? MIN(blocks * obj->blockSize, obj->fileReservedEnd - offset) : 0;
+	
+	// Nothing on disk: the slot would be zeros, loaded quickly when needed.
+	if (fileLength == 0)
+		return;
+	
+	// Start worker.
+	if (obj->workerRunning == false && SMCryptoFileWorkerStart(obj) == false)
+		return;
+	
+	// Get a slot.
+	SMCryptoFileError		error;
+	SMCryptoFileCacheSlot	*slot = SMCryptoFileCacheSlotAcquire(obj, slotNumber, &error);
+	
+	if (!slot)
+		return;
+	
+	slot->referenced = true;
+	slot->workWrite = false;
+	slot->readAheadBlocks = blocks;
+	slot->readAheadFileLength = fileLength;
+	
+	// Queue it.
+	SMCryptoFileWorkerQueue(obj, slot);
+}
+
+
+#pragma mark > Write-behind
+
+static bool SMCryptoFileWriteBehindSchedule(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, SMCryptoFileError *error)
+{
+	// Limit the slots in flight: take back the finished ones, else wait for the first one.
+	if (obj->writeBehindCount >= obj->writeBehindSlots)
+	{
+		SMCryptoFileCacheSlot *firstSlot = NULL;
+		
+		for (uint32_t i = 0; i < obj->cacheSlotCount; i++)
+		{
+			SMCryptoFileCacheSlot *wslot = &obj->cacheSlots[i];
+			
+			if (wslot->busy == false || wslot->workWrite == false || SMCryptoFileWorkerTryCollect(obj, wslot))
+				continue;
+			
+			if (!firstSlot || wslot->offset < firstSlot->offset)
+				firstSlot = wslot;
+		}
+		
+		if (obj->writeBehindCount >= obj->writeBehindSlots && firstSlot)
+			SMCryptoFileWorkerCollect(obj, firstSlot, false);
+	}
+	
+	// Start worker. On failure, the slot stays dirty in cache, and is written when evicted or flushed.
+	if (obj->workerRunning == false && SMCryptoFileWorkerStart(obj) == false)
+		return true;
+	
+	// Prepare dirty blocks (fills the gap before the slot).
+	uint64_t endOffset = 0;
+	
+	if (SMCryptoFileCacheSlotPrepareFlush(obj, slot, &endOffset, error) == false)
+		return false;
+	
+	// Reserve the region of the slot on disk, so the gaps filled before the next slots don't overwrite it (the data length covers it once written).
+	obj->fileReservedEnd = MAX(obj->fileReservedEnd, endOffset);
+	
+	// Queue it.
+	slot->workWrite = true;
+	slot->writeEnd = endOffset;
+	obj->writeBehindCount++;
+	
+	SMCryptoFileWorkerQueue(obj, slot);
+	
+	return true;
+}
+
+
+#pragma mark > Worker
+
+static void SMCryptoFileWorkerQueue(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot)
+{
+	slot->busy = true;
+	
+	pthread_mutex_lock(&obj->workerMutex);
+	
+	slot->workDone = false;
+	slot->workFailed = false;
+	
+	obj->workerQueue[(obj->workerQueueHead + obj->workerQueueCount) % obj->cacheSlotCount] = slot;
+	obj->workerQueueCount++;
+	
+	pthread_cond_signal(&obj->workerWork);
+	pthread_mutex_unlock(&obj->workerMutex);
+}
+
+static void SMCryptoFileWorkerCollect(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot, bool cancel)
+{
+	bool failed = true;
+	
+	pthread_mutex_lock(&obj->workerMutex);
+	
+	// Remove the slot from the queue if the worker didn't start it (if asked): the caller loads or writes it itself, while the worker goes on with the next slots.
+	for (uint32_t i = 0; cancel && i < obj->workerQueueCount && slot->workDone == false; i++)
+	{
+		if (obj->workerQueue[(obj->workerQueueHead + i) % obj->cacheSlotCount] != slot)
+			continue;
+		
+		for (uint32_t j = i + 1; j < obj->workerQueueCount; j++)
+			obj->workerQueue[(obj->workerQueueHead + j - 1) % obj->cacheSlotCount] = obj->workerQueue[(obj->workerQueueHead + j) % obj->cacheSlotCount];
+		
+		obj->workerQueueCount--;
+		
+		slot->workDone = true;
+		slot->workFailed = true;
+	}
+	
+	// Wait for the worker.
+	while (slot->workDone == false)
+		pthread_cond_wait(&obj->workerDone, &obj->workerMutex);
+	
+	failed = slot->workFailed;
+	
+	pthread_mutex_unlock(&obj->workerMutex);
+	
+	// Take the slot back.
+	slot->busy = false;
+	
+	if (slot->workWrite)
+	{
+		// > Write-behind: write the blocks not written by the worker (failure, or not started) now, as their region is already reserved on disk. On failure, they stay dirty, and the error is reported by the next write or flush.
+		SMCryptoFileError writeError;
+		
+		if (SMCryptoFileCacheSlotWrite(obj, slot, &obj->dataCrypto, obj->cryptBuffer, &writeError) == false)
+		{
+			pthread_mutex_lock(&obj->workerMutex);
+			
+			if (obj->workerFailed == false)
+			{
+				obj->workerError = writeError;
+				obj->workerFailed = true;
+			}
+			
+			pthread_mutex_unlock(&obj->workerMutex);
+		}
+		
+		slot->workWrite = false;
+		slot->dirty = (SMCryptoBitmapFind(slot->dirtyBlocks, 0, obj->cacheSlotBlocks, true) < obj->cacheSlotBlocks);
+		
+		if (slot->dirty == false)
+			SMCryptoFileDataWritten(obj, slot->offset, slot->writeEnd);
+		
+		obj->writeBehindCount--;
+	}
+	else if (failed == false)
+	{
+		// > Read-ahead: on failure (or if not started), the blocks stay invalid, so they are loaded again if they are really read.
+		SMCryptoBitmapSetRange(slot->validBlocks, 0, slot->readAheadBlocks, true);
+	}
+}
+
+static bool SMCryptoFileWorkerTryCollect(SMCryptoFile *obj, SMCryptoFileCacheSlot *slot)
+{
+	// Take the slot back only if the worker is done with it.
+	pthread_mutex_lock(&obj->workerMutex);
+	
+	bool done = slot->workDone;
+	
+	pthread_mutex_unlock(&obj->workerMutex);
+	
+	if (done)
+		SMCryptoFileWorkerCollect(obj, slot, false);
+	
+	return done;
+}
+
+static void SMCryptoFileWorkerCollectAll(SMCryptoFile *obj)
+{
+	if (obj->workerRunning == false)
+		return;
+	
+	for (uint32_t i = 0; i < obj->cacheSlotCount; i++)
+	{
+		if (obj->cacheSlots[i].busy)
+			SMCryptoFileWorkerCollect(obj, &obj->cacheSlots[i], true);
+	}
+}
+
+static bool SMCryptoFileWorkerCheckError(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	if (obj->workerRunning == false)
+		return true;
+	
+	// Report a write-behind error once.
+	pthread_mutex_lock(&obj->workerMutex);
+	
+	bool failed = obj->workerFailed;
+	
+	if (failed)
+	{
+		*error = obj->workerError;
+		obj->workerFailed = false;
+	}
+	
+	pthread_mutex_unlock(&obj->workerMutex);
+	
+	return !failed;
+}
+
+static bool SMCryptoFileWorkerStart(SMCryptoFile *obj)
+{
+	// Worker crypto context.
+	unsigned keySize = SMCryptoFileRealKeySize(obj);
+	
+	if (SMCryptoBackendContextInit(&obj->workerCrypto, obj->backend, obj->header.xtsKey, obj->header.xtsTweak, keySize) == false)
+		goto fail;
+	
+	// Synchronization.
+	pthread_mutex_init(&obj->workerMutex, NULL);
+	pthread_cond_init(&obj->workerWork, NULL);
+	pthread_cond_init(&obj->workerDone, NULL);
+	
+	// Thread.
+	if (pthread_create(&obj->workerThread, NULL, SMCryptoFileWorkerMain, obj) != 0)
+	{
+		pthread_cond_destroy(&obj->workerDone);
+		pthread_cond_destroy(&obj->workerWork);
+		pthread_mutex_destroy(&obj->workerMutex);
+		SMCryptoBackendContextClean(&obj->workerCrypto);
+		goto fail;
+	}
+	
+	obj->workerRunning = true;
+	
+	return true;
+	
+fail:
+	// Don't try again.
+	obj->readAheadSlots = 0;
+	obj->writeBehindSlots = 0;
+	
+	return false;
+}
+
+static void SMCryptoFileWorkerStop(SMCryptoFile *obj)
+{
+	if (obj->workerRunning == false)
+		return;
+	
+	// Stop worker.
+	pthread_mutex_lock(&obj->workerMutex);
+	
+	obj->workerStop = true;
+	
+	pthread_cond_signal(&obj->workerWork);
+	pthread_mutex_unlock(&obj->workerMutex);
+	
+	pthread_join(obj->workerThread, NULL);
+	
+	// Clean.
+	pthread_cond_destroy(&obj->workerDone);
+	pthread_cond_destroy(&obj->workerWork);
+	pthread_mutex_destroy(&obj->workerMutex);
+	
+	SMCryptoBackendContextClean(&obj->workerCrypto);
+	
+	obj->workerRunning = false;
+}
+
+static void * SMCryptoFileWorkerMain(void *context)
+{
+	// Note: the worker only uses the slots queued (owned by the worker until collected), its own buffer and crypto context, and the layout, which doesn't change.
+	SMCryptoFile *obj = context;
+	
+	pthread_mutex_lock(&obj->workerMutex);
+	
+	while (obj->workerStop == false)
+	{
+		// > Wait for a slot.
+		if (obj->workerQueueCount == 0)
+		{
+			pthread_cond_wait(&obj->workerWork, &obj->workerMutex);
+			continue;
+		}
+		
+		SMCryptoFileCacheSlot *slot = obj->workerQueue[obj->workerQueueHead];
+		
+		obj->workerQueueHead = (obj->workerQueueHead + 1) % obj->cacheSlotCount;
+		obj->workerQueueCount--;
+		
+		pthread_mutex_unlock(&obj->workerMutex);
+		
+		SMCryptoFileError	error = SMCryptoFileErrorUnknown;
+		bool				result = false;
+		
+		if (slot->workWrite)
+		{
+			// > Crypt and write dirty blocks.
+			result = SMCryptoFileCacheSlotWrite(obj, slot, &obj->workerCrypto, obj->workerBuffer, &error);
+		}
+		else
+		{
+			// > Read and decrypt blocks.
+			uint64_t fileLength = slot->readAheadFileLength;
+			uint64_t length = slot->readAheadBlocks * obj->blockSize;
+			
+			if (sm_pread(obj->fd, obj->workerBuffer, (size_t)fileLength, (off_t)(obj->dataOffset + slot->offset)) == fileLength)
+				result = SMCryptoFileBlocksDecryptWithContext(obj, &obj->workerCrypto, obj->workerBuffer, slot->offset / obj->blockSize, fileLength / obj->blockSize, slot->data);
+			
+			memset(slot->data + fileLength, 0, (size_t)(length - fileLength));
+		}
+		
+		// > Give the slot back.
+		pthread_mutex_lock(&obj->workerMutex);
+		
+		slot->workDone = true;
+		slot->workFailed = !result;
+		
+		if (slot->workWrite && result == false && obj->workerFailed == false)
+		{
+			obj->workerError = error;
+			obj->workerFailed = true;
+		}
+		
+		pthread_cond_broadcast(&obj->workerDone);
+	}
+	
+	// Give back the slots not handled.
+	while (obj->workerQueueCount > 0)
+	{
+		SMCryptoFileCacheSlot *slot = obj->workerQueue[obj->workerQueueHead];
+		
+		obj->workerQueueHead = (obj->workerQueueHead + 1) % obj->cacheSlotCount;
+		obj->workerQueueCount--;
+		
+		slot->workDone = true;
+		slot->workFailed = true;
+	}
+	
+	pthread_cond_broadcast(&obj->workerDone);
+	pthread_mutex_unlock(&obj->workerMutex);
+	
+	return NULL;
+}
+
+
+#pragma mark > Cryptors
+
+static bool SMCryptoFileDataCryptorsCreate(SMCryptoFile *obj, SMCryptoFileError *error)
+{
+	unsigned keySize = SMCryptoFileRealKeySize(obj);
+	
+	if (SMCryptoBackendContextInit(&obj->dataCrypto, obj->backend, obj->header.xtsKey, obj->header.xtsTweak, keySize) == false)
+	{
+		SMCryptoDebugLog("Error: Can't create data cryptors (%s).\n", obj->backend->name);
+		*error = SMCryptoFileErrorCrypto;
+		return false;
+	}
+	
+	return true;
+}
+
+
+#pragma mark > Block crypt / decrypt
+
+static bool SMCryptoFileBlockCrypt(SMCryptoFile *obj, const void *block, uint64_t blocknum, void *output)
+{
+	return SMCryptoFileBlocksCrypt(obj, block, blocknum, 1, output);
+}
+
+static bool SMCryptoFileBlockDecrypt(SMCryptoFile *obj, const void *block, uint64_t blocknum, void *output)
+{
+	return SMCryptoFileBlocksDecrypt(obj, block, blocknum, 1, output);
+}
+
+static bool SMCryptoFileBlocksCrypt(SMCryptoFile *obj, const void *blocks, uint64_t blocknum, uint64_t count, void *output)
+{
+	return obj->backend->xtsEncrypt(&obj->dataCrypto, blocknum, (size_t)obj->blockSize, blocks, (size_t)(count * obj->blockSize), output);
+}
+
+static bool SMCryptoFileBlocksDecrypt(SMCryptoFile *obj, const void *blocks, uint64_t blocknum, uint64_t count, void *output)
+{
+	return SMCryptoFileBlocksDecryptWithContext(obj, &obj->dataCrypto, blocks, blocknum, count, output);
+}
+
+static bool SMCryptoFileBlocksDecryptWithContext(SMCryptoFile *obj, const SMCryptoBackendContext *crypto, const void *blocks, uint64_t blocknum, uint64_t count, void *output)
+{
+	// Note: called by the worker for read-ahead, with its own crypto context.
+	
+	// Decrypt in one pass.
+	if (obj->sparse == false)
+		return obj->backend->xtsDecrypt(crypto, blocknum, (size_t)obj->blockSize, blocks, (size_t)(count * obj->blockSize), output);
+	
+	// Sparse file: decrypt each run of data blocks, and zero each run of holes.
+	const uint8_t	*input = blocks;
+	uint8_t			*clear = output;
+	uint64_t		block = 0;
+	
+	while (block < count)
+	{
+		bool		hole = SMCryptoFileBlockIsHole(obj, input + block * obj->blockSize);
+		uint64_t	endBlock = block + 1;
+		
+		while (endBlock < count && SMCryptoFileBlockIsHole(obj, input + endBlock * obj->blockSize) == hole)
+			endBlock++;
+		
+		uint64_t offset = block * obj->blockSize;
+		uint64_t length = (endBlock - block) * obj->blockSize;
+		
+		if (hole)
+			memset(clear + offset, 0, (size_t)length);
+		else if (obj->backend->xtsDecrypt(crypto, blocknum + block, (size_t)obj->blockSize, input + offset, (size_t)length, clear + offset) == false)
+			return false;
+		
+		block = endBlock;
+	}
+	
+	return true;
+}
+
+static inline bool SMCryptoFileBlockIsHole(SMCryptoFile *obj, const uint8_t *block)
+{
+	// Note: a crypted block starts with a zero AES block with a negligible probability, so the rest of the block is only checked in this case.
+	uint64_t words[2];
+	
+	memcpy(words, block, sizeof(words));
+	
+	if (words[0] | words[1])
+		return false;
+	
+	for (uint64_t i = sizeof(words); i < obj->blockSize; i++)
+	{
+		if (block[i])
+			return false;
+	}
+	
+	return true;
+}
+
+
+#pragma mark > Ranges
+
+static SMCryptoRange SMCryptoMakeRange(uint64_t location, uint64_t length)
+{
+	SMCryptoRange result = { .location = location, .length = length} ;
+	
+	return result;
+}
+
+static uint64_t SMCryptoMaxRange(SMCryptoRange range)
+{
+	return range.location + range.length;
+}
+
+static SMCryptoRange SMCryptoIntersectionRange(SMCryptoRange r1, SMCryptoRange r2)
+{
+	uint64_t min, loc;
+	uint64_t max1 = SMCryptoMaxRange(r1);
+	uint64_t max2 = SMCryptoMaxRange(r2);
+	SMCryptoRange result;
+	
+	min = (max1 < max2) ? max1 : max2;
+	loc = (r1.location > r2.location) ? r1.location:r2.location;
+	
+	if (min < loc)
+	{
+		result.location = 0;
+		result.length = 0;
+	}
+	else
+	{
+		result.location = loc;
+		result.length = min - loc;
+	}
+	
+	return result;
+}
+
+
+#pragma mark > Mapping
+
+static const uint8_t * SMCryptoFileMapGet(SMCryptoFile *obj, uint64_t offset, uint64_t length)
+{
+	// Note: only used by the caller thread (the worker keeps reading with pread, so the mapping can be replaced here).
+	if (obj->mapData == false)
+		return NULL;
+	
+	uint64_t end = obj->dataOffset + offset + length;
+	
+	// Map the file again if it grew past the mapping.
+	if (end > obj->mapLength)
+	{
+		struct stat	st;
+		void		*map;
+		
+		if (fstat(obj->fd, &st) != 0 || (uint64_t)st.st_size < end)
+			return NULL;
+		
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, obj->fd, 0);
+		
+		if (map == MAP_FAILED)
+		{
+			SMCryptoDebugLog("Error: Can't map file.\n");
+			obj->mapData = false;
+			return NULL;
+		}
+		
+		if (obj->map)
+			munmap((void *)obj->map, (size_t)obj->mapLength);
+		
+		obj->map = map;
+		obj->mapLength = (uint64_t)st.st_size;
+		
+		if (obj->mapAdvice != MADV_NORMAL)
+			madvise(map, (size_t)obj->mapLength, obj->mapAdvice);
+	}
+	
+	return obj->map + obj->dataOffset + offset;
+}
+
+static void SMCryptoFileMapAdvise(SMCryptoFile *obj, int advice)
+{
+	if (advice == obj->mapAdvice)
+		return;
+	
+	madvise((void *)obj->map, (size_t)obj->mapLength, advice);
+	
+	obj->mapAdvice = advice;
+}
+
+
+#pragma mark > Preallocation
+
+static bool SMCryptoFilePreallocateTo(SMCryptoFile *obj, uint64_t end)
+{
+	// Note: only reserves disk space past the end of the file, its size is unchanged (the reserved space is released by the next truncate).
+	uint64_t start = MAX(obj->preallocatedEnd, obj->fileReservedEnd);
+	
+	if (end <= start)
+		return true;
+	
+	// Reserve from the physical end of the file, in one extent if possible.
+	fstore_t store = {
+		.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL,
+		.fst_posmode = F_PEOFPOSMODE,
+		.fst_offset = 0,
+		.fst_length = (off_t)(end - start),
+	};
+	
+	if (fcntl(obj->fd, F_PREALLOCATE, &store) == -1)
+	{
+		store.fst_flags = F_ALLOCATEALL;
+		
+		if (fcntl(obj->fd, F_PREALLOCATE, &store) == -1)
+			return false;
+	}
+	
+	obj->preallocatedEnd = end;
+	
+	return true;
+}
+
+static void SMCryptoFilePreallocateGrowth(SMCryptoFile *obj, uint64_t end)
+{
+	// Note: holes of sparse files would be allocated by the space reserved ahead.
+	if (obj->preallocationSize == 0 || obj->sparse || end <= obj->preallocatedEnd)
+		return;
+	
+	// Reserve up to the next chunk boundary past end (advisory: stop reserving on file systems which can't).
+	uint64_t chunkEnd = (end / obj->preallocationSize + 1) * obj->preallocationSize;
+	
+	if (SMCryptoFilePreallocateTo(obj, chunkEnd) == false)
+	{
+		SMCryptoDebugLog("Error: Can't preallocate file space.\n");
+		obj->preallocationSize = 0;
+	}
+}
+
+
+#pragma mark > Authentication tree
+
+static bool SMCryptoFileTreeOpen(SMCryptoFile *obj, const char *path, int openFlags, SMCryptoFileError *error)
+{
+	// Note: the data length is supposed to be known (fileDataLen), and the header read or initialized.
+	
+	// Open the side file (a temporary one, deleted on close, if there is no path).
+	char	treePath[PATH_MAX];
+	int		fd;
+	
+	if (path)
+	{
+		if (snprintf(treePath, sizeof(treePath), "%s%s", path, kCFTreeFileSuffix) >= (int)sizeof(treePath))
+		{
+			*error = SMCryptoFileErrorArguments;
+			return false;
+		}
+		
+		fd = open(treePath, openFlags, (S_IRUSR | S_IWUSR) | (S_IRGRP | S_IWGRP) | (S_IROTH | S_IWOTH)); // mode masked by umask.
+	}
+	else
+	{
+		fd = SMCryptoFileTemporaryFile(treePath, sizeof(treePath));
+		
+		if (fd != -1)
+			unlink(treePath);
+	}
+	
+	if (fd == -1)
+	{
+		*error = SMCryptoFileErrorIO;
+		return false;
+	}
+	
+	obj->treeFd = fd;
+	
+	// Size the tree for the blocks on disk.
+	obj->treeBlocks = obj->fileDataLen / obj->blockSize;
+	obj->treePageCount = (obj->treeBlocks + kCFTreePageLeaves - 1) / kCFTreePageLeaves;
+	
+	uint64_t capacity = SMCryptoFileTreeCapacityForPages(obj->treePageCount);
+	
+	if (SMCryptoFileTreeSetCapacity(obj, capacity, error) == false)
+		return false;
+	
+	// Read the page hashes and the page copies of the committed area, each in one pass (missing ones are zeros).
+	if (obj->header.treeArea >= kCFTreeAreas)
+	{
+		*error = SMCryptoFileErrorCorrupted;
+		return false;
+	}
+	
+	off_t	areaOffset = SMCryptoFileTreeAreaOffset(capacity, obj->header.treeArea);
+	size_t	length = (size_t)(obj->treePageCount * kCFTreeHashSize);
+	size_t	copiesLength = (size_t)((obj->treePageCount + 63) / 64 * sizeof(uint64_t));
+	
+	if (length && sm_pread(fd, obj->treeNodes + capacity * kCFTreeHashSize, length, areaOffset) < 0)
+	{
+		*error = SMCryptoFileErrorIO;
+		return false;
+	}
+	
+	if (copiesLength && sm_pread(fd, obj->treeCopies, copiesLength, areaOffset + (off_t)(capacity * kCFTreeHashSize)) < 0)
+	{
+		*error = SMCryptoFileErrorIO;
+		return false;
+	}
+	
+	memcpy(obj->treeCommittedCopies, obj->treeCopies, copiesLength);
+	
+	// > The content of the spare area is unknown: the next commit writes it whole.
+	obj->treeCommittedCapacity = capacity;
+	obj->treeSpareStart = 0;
+	obj->treeSpareEnd = obj->treePageCount;
+	
+	// Build the upper nodes.
+	if (SMCryptoFileTreeUpdateRange(obj, 0, obj->treePageCount) == false)
+	{
+		*error = SMCryptoFileErrorCrypto;
+		return false;
+	}
+	
+	// Check the root against the one committed with the header.
+	if (memcmp(obj->treeNodes + kCFTreeHashSize, obj->header.treeRoot, kCFTreeHashSize) != 0)
+	{
+		SMCryptoDebugLog("Error: Authentication tree doesn't match the header.\n");
+		*error = SMCryptoFileErrorIntegrity;
+		return false;
+	}
+	
+	return true;
+}
+
+static void SMCryptoFileTreeUnlink(const char *path)
+{
+	char treePath[PATH_MAX];
+	
+	if (snprintf(treePath, sizeof(treePath), "%s%s", path, kCFTreeFileSuffix) < (int)sizeof(treePath))
+		unlink(treePath);
+}
+
+static bool SMCryptoFileTreeCommit(SMCryptoFile *obj, SMCryptoFileSyncType sync, SMCryptoFileError *error)
+{
+	// Note: the leaf copies and the page hashes area the committed root depends on are never overwritten, the new ones are written aside: the header write switches to them, so it's the commit point. When a sync is asked, the data and the side file are synced before it, so a durable header never points to an area that isn't.
+	
+	// Cover the blocks written on disk (the gaps left as holes are not hashed yet, the blocks queued by a failed write are past the data length).
+	if (SMCryptoFileTreeResize(obj, obj->fileDataLen / obj->blockSize, error) == false)
+		return false;
+	
+	// Write the dirty leaf pages, and update their paths to the root.
+	for (uint32_t i = 0; i < kCFTreeCachePages; i++)
+	{
+		SMCryptoFileTreePage *page = &obj->treeCache[i];
+		
+		if (page->used && page->dirty && SMCryptoFileTreePageFlush(obj, page, error) == false)
+			return false;
+	}
+	
+	// Write the page hashes and copies to the spare area: the changed ones, and the ones changed by the last commit (all of them in the areas of a new capacity).
+	unsigned	oldArea = obj->header.treeArea;
+	unsigned	area = oldArea;
+	bool		moved = (obj->treeCapacity != obj->treeCommittedCapacity);
+	uint64_t	start = 0;
+	uint64_t	end = obj->treePageCount;
+	
+	if (moved || obj->treeDirtyStart < obj->treeDirtyEnd)
+	{
+		if (!moved)
+		{
+			start = obj->treeDirtyStart;
+			end = obj->treeDirtyEnd;
+			
+			if (obj->treeSpareStart < obj->treeSpareEnd)
+			{
+				start = MIN(start, obj->treeSpareStart);
+				end = MIN(MAX(end, obj->treeSpareEnd), obj->treeCapacity);
+			}
+		}
+		
+		area = oldArea ^ 1;
+		
+		if (start < end)
+		{
+			off_t	areaOffset = SMCryptoFileTreeAreaOffset(obj->treeCapacity, area);
+			size_t	length = (size_t)((end - start) * kCFTreeHashSize);
+			uint64_t firstWord = start / 64;
+			size_t	copiesLength = (size_t)(((end + 63) / 64 - firstWord) * sizeof(uint64_t));
+			
+			if (sm_pwrite(obj->treeFd, obj->treeNodes + (obj->treeCapacity + start) * kCFTreeHashSize, length, areaOffset + (off_t)(start * kCFTreeHashSize)) != length)
+			{
+				*error = SMCryptoFileErrorIO;
+				return false;
+			}
+			
+			if (sm_pwrite(obj->treeFd, obj->treeCopies + firstWord, copiesLength, areaOffset + (off_t)(obj->treeCapacity * kCFTreeHashSize + firstWord * sizeof(uint64_t))) != copiesLength)
+			{
+				*error = SMCryptoFileErrorIO;
+				return false;
+			}
+		}
+	}
+	
+	// Write the header with the new root and area.
+	uint8_t oldRoot[kCFTreeHashSize];
+	
+	memcpy(oldRoot, obj->header.treeRoot, kCFTreeHashSize);
+	
+	if (area != oldArea || memcmp(obj->header.treeRoot, obj->treeNodes + kCFTreeHashSize, kCFTreeHashSize) != 0)
+	{
+		memcpy(obj->header.treeRoot, obj->treeNodes + kCFTreeHashSize, kCFTreeHashSize);
+		obj->header.treeArea = (uint8_t)area;
+		obj->headerDirty = true;
 	}
-
-	return true;
-}
-
-bool SMCryptoFileFlush(SMCryptoFile *obj, SMCryptoFileSyncType sync, SMCryptoFileError *error)
-{
-	// Check arguments.
-	SMCryptoFileError terror;
 	
-	if (!error)
-		error = &terror;
+	if (obj->headerDirty == false)
+		return true;
 	
-	// Check pointers.
-	if (!obj)
+	if (SMCryptoFileSyncDescriptor(obj->fd, sync) == false || SMCryptoFileSyncDescriptor(obj->treeFd, sync) == false)
 	{
-		*error = SMCryptoFileErrorArguments;
+		memcpy(obj->header.treeRoot, oldRoot, kCFTreeHashSize);
+		obj->header.treeArea = (uint8_t)oldArea;
+		
+		*error = SMCryptoFileErrorIO;
 		return false;
 	}
 	
-	// Flush cache.
-	if (SMCryptoFileCacheFlush(obj, error) == false)
+	if (SMCryptoFileHeaderWrite(obj, error) == false)
+	{
+		// > The previous tree stays the committed one: the next commit writes the same area again.
+		memcpy(obj->header.treeRoot, oldRoot, kCFTreeHashSize);
+		obj->header.treeArea = (uint8_t)oldArea;
+		
 		return false;
+	}
 	
-	// Flush header.
-	if (SMCryptoFileHeaderFlush(obj, error) == false)
-		return false;
+	obj->headerDirty = false;
 	
-	// Sync.
-	switch (sync)
+	// Committed: the previous area is the spare one, and misses the page hashes changed by this commit (all of them if the capacity changed).
+	if (area != oldArea)
 	{
-		case SMCryptoFileSyncFull:
+		obj->treeSpareStart = moved ? 0 : obj->treeDirtyStart;
+		obj->treeSpareEnd = moved ? obj->treePageCount : obj->treeDirtyEnd;
+		obj->treeDirtyStart = 0;
+		obj->treeDirtyEnd = 0;
+		obj->treeCommittedCapacity = obj->treeCapacity;
+		
+		memcpy(obj->treeCommittedCopies, obj->treeCopies, (size_t)((obj->treeCopiesCapacity + 63) / 64 * sizeof(uint64_t)));
+	}
+	
+	return true;
+}
+
+static bool SMCryptoFileTreeVerify(SMCryptoFile *obj, const uint8_t *blocks, uint64_t blocknum, uint64_t count, SMCryptoFileError *error)
+{
+	// Note: blocks are the crypted blocks read from disk. Only the leaf pages not in cache cost a read (and a hash), the upper levels are in memory.
+	if (obj->authenticated == false)
+		return true;
+	
+	SMCryptoFileTreePage *page = NULL;
+	
+	for (uint64_t i = 0; i < count; i++)
+	{
+		uint64_t	block = blocknum + i;
+		uint8_t		digest[kCFTreeHashSize];
+		bool		match;
+		
+		if (SMCryptoFileTreeHash(obj, blocks + i * obj->blockSize, (size_t)obj->blockSize, digest) == false)
 		{
-			if (fcntl(obj->fd, F_FULLFSYNC) != -1)
-				break;
-			
-			// In case of error, fallback to standard sync.
+			*error = SMCryptoFileErrorCrypto;
+			return false;
 		}
 		
-		case SMCryptoFileSyncNormal:
+		// > Blocks past the tree have zero leaves (holes).
+		if (block < obj->treeBlocks)
 		{
-			if (fsync(obj->fd) != 0)
+			if (!page || page->number != block / kCFTreePageLeaves)
 			{
-				*error = SMCryptoFileErrorIO;
-				return false;
+				page = SMCryptoFileTreePageGet(obj, block / kCFTreePageLeaves, error);
+				
+				if (!page)
+					return false;
 			}
 			
-			break;
+			match = (memcmp(digest, page->leaves + (block % kCFTreePageLeaves) * kCFTreeHashSize, kCFTreeHashSize) == 0);
+		}
+		else
+			match = SMCryptoIsZero(digest, sizeof(digest));
+		
+		if (!match)
+		{
+			SMCryptoDebugLog("Error: Block %llu doesn't match its hash.\n", block);
+			*error = SMCryptoFileErrorIntegrity;
+			return false;
 		}
-			
-		case SMCryptoFileSyncNo:
-			
-			break;
 	}
 	
 	return true;
 }
 
-
-
-/*
-** Helpers
-*/
-#pragma mark - Helpers
-
-static unsigned SMCryptoFileRealKeySize(SMCryptoFile *obj)
+static bool SMCryptoFileTreeUpdate(SMCryptoFile *obj, const uint8_t *blocks, uint64_t blocknum, uint64_t count, SMCryptoFileError *error)
 {
-	switch (obj->prefix.keySize)
+	// Note: blocks are the crypted blocks about to be written on disk. Page hashes and their paths are updated when the pages are written.
+	if (obj->authenticated == false)
+		return true;
+	
+	if (blocknum + count > obj->treeBlocks && SMCryptoFileTreeResize(obj, blocknum + count, error) == false)
+		return false;
+	
+	SMCryptoFileTreePage *page = NULL;
+	
+	for (uint64_t i = 0; i < count; i++)
 	{
-		case SMCryptoFileKeySize128:
-			return 16;
-			
-		case SMCryptoFileKeySize192:
-			return 24;
+		uint64_t block = blocknum + i;
+		
+		if (!page || page->number != block / kCFTreePageLeaves)
+		{
+			page = SMCryptoFileTreePageGet(obj, block / kCFTreePageLeaves, error);
 			
-		case SMCryptoFileKeySize256:
-			return 32;
+			if (!page)
+				return false;
+		}
+		
+		if (SMCryptoFileTreeHash(obj, blocks + i * obj->blockSize, (size_t)obj->blockSize, page->leaves + (block % kCFTreePageLeaves) * kCFTreeHashSize) == false)
+		{
+			*error = SMCryptoFileErrorCrypto;
+			return false;
+		}
+		
+		page->dirty = true;
 	}
 	
-	return 0;
+	return true;
 }
 
-static bool SMCryptoFileFillGapToLength(SMCryptoFile *obj, uint64_t length, SMCryptoFileError *error)
+static bool SMCryptoFileTreeResize(SMCryptoFile *obj, uint64_t blocks, SMCryptoFileError *error)
 {
-	// Note: length should be a multiple of kCFFileBlockSize.
-	
-	if (obj->fileDataLen >= length)
+	if (blocks == obj->treeBlocks)
 		return true;
-			
-	// Zero bytes buffer.
-	uint8_t zeroCache[kCFFileBlockSize];
 	
-	memset(zeroCache, 0, sizeof(zeroCache));
+	uint64_t pageCount = (blocks + kCFTreePageLeaves - 1) / kCFTreePageLeaves;
+	uint64_t oldPageCount = obj->treePageCount;
+	uint64_t capacity = SMCryptoFileTreeCapacityForPages(pageCount);
 	
-	// Write crypted zeros.
-	uint8_t fileCache[kCFFileBlockSize];
-
-	for (uint64_t offset = obj->fileDataLen; offset < length; offset += kCFFileBlockSize)
+	// Shrink: zero the leaves past the last block, and drop the pages past it.
+	if (blocks < obj->treeBlocks)
 	{
-		uint64_t blockNumber = offset / kCFFileBlockSize;
-
-		// > Crypt zero byte according to current block number.
-		if (SMCryptoFileBlockCrypt(obj, zeroCache, blockNumber, fileCache) == false)
+		if (blocks % kCFTreePageLeaves)
 		{
-			*error = SMCryptoFileErrorCrypto;
-			return false;
+			SMCryptoFileTreePage *page = SMCryptoFileTreePageGet(obj, blocks / kCFTreePageLeaves, error);
+			
+			if (!page)
+				return false;
+			
+			memset(page->leaves + (blocks % kCFTreePageLeaves) * kCFTreeHashSize, 0, (size_t)((kCFTreePageLeaves - blocks % kCFTreePageLeaves) * kCFTreeHashSize));
+			page->dirty = true;
 		}
 		
-		// > Write crypte zero bytes.
-		if (sm_pwrite(obj->fd, fileCache, sizeof(fileCache), (off_t)(kCFFileDataOffset + offset)) != sizeof(fileCache))
+		for (uint32_t i = 0; i < kCFTreeCachePages; i++)
 		{
-			*error = SMCryptoFileErrorIO;
+			SMCryptoFileTreePage *page = &obj->treeCache[i];
+			
+			if (page->used && page->number >= pageCount)
+			{
+				page->used = false;
+				page->dirty = false;
+			}
+		}
+		
+		memset(obj->treeNodes + (obj->treeCapacity + pageCount) * kCFTreeHashSize, 0, (size_t)((oldPageCount - pageCount) * kCFTreeHashSize));
+		
+		obj->treeBlocks = blocks;
+		obj->treePageCount = pageCount;
+		obj->treeDirtyEnd = MIN(obj->treeDirtyEnd, pageCount);
+		
+		if (capacity != obj->treeCapacity)
+			return SMCryptoFileTreeSetCapacity(obj, capacity, error);
+		
+		if (SMCryptoFileTreeUpdateRange(obj, pageCount, oldPageCount) == false)
+		{
+			*error = SMCryptoFileErrorCrypto;
 			return false;
 		}
 		
-		obj->fileDataLen += sizeof(fileCache);
+		return true;
 	}
 	
-	// Return.
+	// Grow: the new leaves are zeros, so are the hashes of the new pages. Their stale hashes in the spare area are replaced at commit (a new capacity has new areas, written whole).
+	obj->treeBlocks = blocks;
+	obj->treePageCount = pageCount;
+	
+	if (capacity != obj->treeCapacity)
+		return SMCryptoFileTreeSetCapacity(obj, capacity, error);
+	
+	SMCryptoFileTreeSetDirty(obj, oldPageCount, pageCount);
+	
 	return true;
 }
 
-static int SMCryptoFileTemporaryFile(char *pathBuffer, size_t pathBufferSize)
+static bool SMCryptoFileTreeSetCapacity(SMCryptoFile *obj, uint64_t capacity, SMCryptoFileError *error)
 {
-	char tmp[PATH_MAX];
-	char *f;
+	// Note: the page count is supposed to fit the capacity.
 	
-	// Build template.
-	if (confstr(_CS_DARWIN_USER_TEMP_DIR, tmp, sizeof(tmp)) != 0)
-	{
-		snprintf(pathBuffer, pathBufferSize, "%s/cryptofile_XXXXXXXX", tmp);
-	}
-	else if (issetugid() == 0 && (f = getenv("TMPDIR")))
-	{
-		snprintf(pathBuffer, pathBufferSize, "%s/cryptofile_XXXXXXXX", f);
-	}
-	else
+	// Grow the page copies bitmaps (never shrunk: the committed copies of the pages cut since the last commit are kept).
+	if (capacity > obj->treeCopiesCapacity)
 	{
-		strlcpy(pathBuffer, "/tmp/cryptofile_XXXXXXXX", pathBufferSize);
+		size_t		words = (size_t)((capacity + 63) / 64);
+		size_t		oldWords = (size_t)((obj->treeCopiesCapacity + 63) / 64);
+		uint64_t	*copies = calloc(2 * words, sizeof(uint64_t));
+		
+		if (!copies)
+		{
+			*error = SMCryptoFileErrorMemory;
+			return false;
+		}
+		
+		if (obj->treeCopies)
+		{
+			memcpy(copies, obj->treeCopies, oldWords * sizeof(uint64_t));
+			memcpy(copies + words, obj->treeCommittedCopies, oldWords * sizeof(uint64_t));
+			
+			free(obj->treeCopies);
+		}
+		
+		obj->treeCopies = copies;
+		obj->treeCommittedCopies = copies + words;
+		obj->treeCopiesCapacity = capacity;
 	}
 	
-	// Create unique file.
-	return mkstemp(pathBuffer);
-}
-
-#pragma mark > Instance
-
-static SMCryptoFile * SMCryptoFileAlloc(void)
-{
 	// Get page-size.
 	vm_size_t hostPageSize = 0;
 	
 	if (host_page_size(mach_host_self(), &hostPageSize) != KERN_SUCCESS)
 		hostPageSize = 4096;
 	
-	// Alloc space.
-	size_t	allocSize = SMRoundUp(sizeof(SMCryptoFile), hostPageSize);
+	// Alloc nodes.
+	size_t	allocSize = SMRoundUp((size_t)(2 * capacity * kCFTreeHashSize), hostPageSize);
 	void	*memory = NULL;
 	
 	if (posix_memalign(&memory, hostPageSize, allocSize) != 0)
-		return NULL;
-		
-	// Lock space to prevent swap to disk (our structure contain key and cache which should not be written on disk).
+	{
+		*error = SMCryptoFileErrorMemory;
+		return false;
+	}
+	
+	// Lock space, as the rest of the tree state.
 	if (mlock(memory, allocSize) != 0)
 	{
 		free(memory);
-		return NULL;
+		*error = SMCryptoFileErrorMemory;
+		return false;
 	}
 	
-	// Initialize to 0.
 	memset(memory, 0, allocSize);
 	
-	// Initialize common fields.
-	SMCryptoFile *result = (SMCryptoFile *)memory;
-
-	result->prefix.magic = kCFMagicValue;
-	result->prefix.version = kCFCurrentVersion;
-	
-	result->header.check = kCFCheckValue;
-	result->header.dataLen = 0;
-	
-	// Return object.
-	return (SMCryptoFile *)memory;
-}
-
-static bool SMCryptoFileFree(SMCryptoFile *obj)
-{
-	// Get page-size.
-	vm_size_t hostPageSize = 0;
-	
-	if (host_page_size(mach_host_self(), &hostPageSize) != KERN_SUCCESS)
-		hostPageSize = 4096;
-	
-	size_t allocSize = SMRoundUp(sizeof(SMCryptoFile), hostPageSize);
-
-	// Set to 0 before unlocking.
-	memset_s(obj, allocSize, 0, allocSize);
-	
-	// Unlock.
-	munlock(obj, allocSize);
-	
-	// Free.
-	free(obj);
+	// Move the page hashes (nodes past the pages are zeros).
+	uint8_t *nodes = memory;
 	
-	return true;
-}
-
-
-#pragma mark > Prefix read / write
-
-static bool SMCryptoFilePrefixRead(SMCryptoFile *obj, SMCryptoFileError *error)
-{
-	if (sm_pread(obj->fd, &obj->prefix, sizeof(obj->prefix), kCFFilePrefixOffset) != sizeof(obj->prefix))
+	if (obj->treeNodes)
 	{
-		*error = SMCryptoFileErrorIO;
-		return false;
+		memcpy(nodes + capacity * kCFTreeHashSize, obj->treeNodes + obj->treeCapacity * kCFTreeHashSize, (size_t)(MIN(obj->treePageCount, obj->treeCapacity) * kCFTreeHashSize));
+		
+		munlock(obj->treeNodes, obj->treeNodesSize);
+		free(obj->treeNodes);
 	}
 	
-	return true;
-}
-
-static bool SMCryptoFilePrefixWrite(SMCryptoFile *obj, SMCryptoFileError *error)
-{
-	if (sm_pwrite(obj->fd, &obj->prefix, sizeof(obj->prefix), kCFFilePrefixOffset) != sizeof(obj->prefix))
+	obj->treeNodes = nodes;
+	obj->treeNodesSize = allocSize;
+	obj->treeCapacity = capacity;
+	
+	// Build the upper nodes.
+	if (SMCryptoFileTreeUpdateRange(obj, 0, obj->treePageCount) == false)
 	{
-		*error = SMCryptoFileErrorIO;
+		*error = SMCryptoFileErrorCrypto;
 		return false;
 	}
-
-	return true;
-}
-
-
-#pragma mark > Header
-
-static bool SMCryptoFileHeaderSetDataLen(SMCryptoFile *obj, uint64_t len, bool flushNow, SMCryptoFileError *error)
-{
-	if (obj->header.dataLen == len)
-		return true;
-	
-	obj->header.dataLen = len;
-	obj->headerDirty = true;
-	
-	if (flushNow)
-		return SMCryptoFileHeaderFlush(obj, error);
 	
 	return true;
 }
 
-static bool SMCryptoFileHeaderFlush(SMCryptoFile *obj, SMCryptoFileError *error)
+static void SMCryptoFileTreeSetDirty(SMCryptoFile *obj, uint64_t firstPage, uint64_t endPage)
 {
-	if (obj->headerDirty == false)
-		return true;
-	
-	if (SMCryptoFileHeaderWrite(obj, error) == false)
-		return false;
+	if (firstPage >= endPage)
+		return;
 	
-	obj->headerDirty = false;
-		
-	return true;
+	if (obj->treeDirtyStart >= obj->treeDirtyEnd)
+	{
+		obj->treeDirtyStart = firstPage;
+		obj->treeDirtyEnd = endPage;
+	}
+	else
+	{
+		obj->treeDirtyStart = MIN(obj->treeDirtyStart, firstPage);
+		obj->treeDirtyEnd = MAX(obj->treeDirtyEnd, endPage);
+	}
 }
 
-static bool SMCryptoFileHeaderRead(SMCryptoFile *obj, SMCryptoFileError *error)
+static uint64_t SMCryptoFileTreeCapacityForPages(uint64_t pageCount)
 {
-	// Read crypted header.
-	char cryptedHeader[sizeof(obj->header)];
-
-	if (sm_pread(obj->fd, cryptedHeader, sizeof(cryptedHeader), kCFFileHeaderOffset) != sizeof(cryptedHeader))
-	{
-		*error = SMCryptoFileErrorIO;
-		return false;
-	}
+	uint64_t capacity = kCFTreeMinCapacity;
 	
-	// Decrypt header.
-	CCCryptorStatus	status;
-	unsigned		keySize = SMCryptoFileRealKeySize(obj);
+	while (capacity < pageCount)
+		capacity <<= 1;
+	
+	return capacity;
+}
 
-	status = CCCrypt(kCCDecrypt, kCCAlgorithmAES, 0, obj->headerKey, keySize, obj->prefix.headerIV, cryptedHeader, sizeof(cryptedHeader), &obj->header, sizeof(obj->header), NULL);
+static off_t SMCryptoFileTreePageOffset(uint64_t number, bool copy)
+{
+	// Note: the side file is a sequence of segments, one per capacity. The segment of a capacity holds the leaf pages added by it (two copies of each, side by side), then its two page hashes areas.
+	// So growing the tree only appends segments: nothing the committed tree depends on moves.
+	uint64_t capacity = SMCryptoFileTreeCapacityForPages(number + 1);
+	uint64_t firstPage = (capacity == kCFTreeMinCapacity) ? 0 : capacity / 2;
 	
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't decrypt header (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
-		return false;
-	}
+	return (off_t)(SMCryptoFileTreeSegmentOffset(capacity) + (2 * (number - firstPage) + copy) * kCFTreePageSize);
+}
+
+static off_t SMCryptoFileTreeAreaOffset(uint64_t capacity, unsigned area)
+{
+	uint64_t firstPage = (capacity == kCFTreeMinCapacity) ? 0 : capacity / 2;
 	
-	return true;
+	return (off_t)(SMCryptoFileTreeSegmentOffset(capacity) + 2 * (capacity - firstPage) * kCFTreePageSize + area * SMCryptoFileTreeAreaSize(capacity));
 }
 
-static bool SMCryptoFileHeaderWrite(SMCryptoFile *obj, SMCryptoFileError *error)
+static uint64_t SMCryptoFileTreeAreaSize(uint64_t capacity)
 {
-	// Crypt header with header key.
-	CCCryptorStatus	status;
-	unsigned		keySize = SMCryptoFileRealKeySize(obj);
-	char			cryptedHeader[sizeof(obj->header)];
+	// Page hashes, then the page copies bitmap, rounded up to a page.
+	return SMRoundUp(capacity * kCFTreeHashSize + (capacity + 63) / 64 * sizeof(uint64_t), (uint64_t)kCFTreePageSize);
+}
 
-	status = CCCrypt(kCCEncrypt, kCCAlgorithmAES, 0, obj->headerKey, keySize, obj->prefix.headerIV, &obj->header, sizeof(obj->header), cryptedHeader, sizeof(cryptedHeader), NULL);
+static uint64_t SMCryptoFileTreeSegmentOffset(uint64_t capacity)
+{
+	uint64_t offset = 0;
 	
-	if (status != kCCSuccess)
-	{
-		SMCryptoDebugLog("Error: Can't crypt header (%d).\n", status);
-		*error = SMCryptoFileErrorCrypto;
-		return false;
-	}
-
-	// Write crypted header.
-	if (sm_pwrite(obj->fd, cryptedHeader, sizeof(cryptedHeader), kCFFileHeaderOffset) != sizeof(cryptedHeader))
+	for (uint64_t segment = kCFTreeMinCapacity; segment < capacity; segment <<= 1)
 	{
-		*error = SMCryptoFileErrorIO;
-		return false;
+		uint64_t firstPage = (segment == kCFTreeMinCapacity) ? 0 : segment / 2;
+		
+		offset += 2 * (segment - firstPage) * kCFTreePageSize + kCFTreeAreas * SMCryptoFileTreeAreaSize(segment);
 	}
-
-	return true;
+	
+	return offset;
 }
 
-
-#pragma mark > Cache
-
-static bool SMCryptoFileCacheFlush(SMCryptoFile *obj, SMCryptoFileError *error)
+static SMCryptoFileTreePage * SMCryptoFileTreePageGet(SMCryptoFile *obj, uint64_t number, SMCryptoFileError *error)
 {
-	// Fast path.
-	if (obj->cachedDataDirty == false || obj->cachedDataSize == 0)
-		return true;
-	
-	uint8_t		tempCache[kCFFileCacheSize + kCFFileBlockSize];
-	uint64_t	offset = 0;
-	uint64_t	fullSize = 0;
+	// Note: number is supposed to be less than the page count.
 	
-	// Encrypt inner cache.
-	uint64_t innerSize = SMRoundDown(obj->cachedDataSize, kCFFileBlockSize);
+	// Look up the cache (last page first).
+	SMCryptoFileTreePage *page = obj->treeLastPage;
 	
-	for (offset = 0; offset < innerSize; offset += kCFFileBlockSize)
+	if (!page || page->used == false || page->number != number)
 	{
-		uint64_t blockNumber = (obj->cachedDataOffset + offset) / kCFFileBlockSize;
-
-		// > Crypt block.
-		if (SMCryptoFileBlockCrypt(obj, obj->cachedData + offset, blockNumber, tempCache + offset) == false)
+		page = NULL;
+		
+		for (uint32_t i = 0; i < kCFTreeCachePages; i++)
 		{
-			*error = SMCryptoFileErrorCrypto;
-			return false;
+			if (obj->treeCache[i].used && obj->treeCache[i].number == number)
+			{
+				page = &obj->treeCache[i];
+				break;
+			}
 		}
 	}
 	
-	fullSize += innerSize;
+	if (page)
+	{
+		page->referenced = true;
+		obj->treeLastPage = page;
+		
+		return page;
+	}
 	
-	// Encrypt suffix cache.
-	uint64_t suffixSize = obj->cachedDataSize - innerSize;
-
-	if (suffixSize > 0)
+	// Find a page to evict (CLOCK: give a second chance to the pages accessed since the last pass).
+	for (;;)
 	{
-		uint64_t blockNumber = (obj->cachedDataOffset + offset) / kCFFileBlockSize;
+		page = &obj->treeCache[obj->treeClockHand];
+		obj->treeClockHand = (obj->treeClockHand + 1) % kCFTreeCachePages;
 		
-		// > Read block at suffix.
-		uint8_t clearBlock[kCFFileBlockSize];
-
-		if (obj->cachedDataOffset + offset + sizeof(clearBlock) > obj->fileDataLen)
-		{
-			// > End-Of-File: use 0 allocated buffer.
-
-			memset(clearBlock, 0, sizeof(clearBlock));
-		}
-		else
+		if (page->used == false || page->referenced == false)
+			break;
+		
+		page->referenced = false;
+	}
+	
+	if (page->used && page->dirty && SMCryptoFileTreePageFlush(obj, page, error) == false)
+		return NULL;
+	
+	page->used = false;
+	
+	// Load the page, and check it against its hash (a zero hash is a zero page, not read).
+	const uint8_t *hash = obj->treeNodes + (obj->treeCapacity + number) * kCFTreeHashSize;
+	
+	if (number >= obj->treePageCount || SMCryptoIsZero(hash, kCFTreeHashSize))
+		memset(page->leaves, 0, kCFTreePageSize);
+	else
+	{
+		uint8_t	digest[kCFTreeHashSize];
+		ssize_t	result = sm_pread(obj->treeFd, page->leaves, kCFTreePageSize, SMCryptoFileTreePageOffset(number, SMCryptoBitmapGet(obj->treeCopies, number)));
+		
+		if (result < 0)
 		{
-			uint8_t fileBlock[kCFFileBlockSize];
-
-			// > Read.
-			if (sm_pread(obj->fd, fileBlock, sizeof(fileBlock), (off_t)(kCFFileDataOffset + obj->cachedDataOffset + offset)) != sizeof(fileBlock))
-			{
-				*error = SMCryptoFileErrorIO;
-				return false;
-			}
-			
-			// > Decrypt.
-			if (SMCryptoFileBlockDecrypt(obj, fileBlock, blockNumber, clearBlock) == false)
-			{
-				*error = SMCryptoFileErrorCrypto;
-				return false;
-			}
+			*error = SMCryptoFileErrorIO;
+			return NULL;
 		}
 		
-		// > Overwrite block with cache.
-		memcpy(clearBlock, obj->cachedData + offset, (size_t)suffixSize);
+		memset(page->leaves + result, 0, (size_t)(kCFTreePageSize - result));
 		
-		// > Crypt block.
-		if (SMCryptoFileBlockCrypt(obj, clearBlock, blockNumber, tempCache + offset) == false)
+		if (SMCryptoFileTreeHash(obj, page->leaves, kCFTreePageSize, digest) == false)
 		{
 			*error = SMCryptoFileErrorCrypto;
-			return false;
+			return NULL;
 		}
 		
-		fullSize += sizeof(clearBlock);
-	}
-
-	// Write padding zero (if necessary) betwen current concrete length and offset.
-	if (SMCryptoFileFillGapToLength(obj, obj->cachedDataOffset, error) == false)
-		return false;
-	
-	// Write tempCache on disk.
-	if (sm_pwrite(obj->fd, tempCache, (size_t)fullSize, (off_t)(kCFFileDataOffset +  obj->cachedDataOffset)) != fullSize)
-	{
-		*error = SMCryptoFileErrorIO;
-		return false;
+		if (memcmp(digest, hash, kCFTreeHashSize) != 0)
+		{
+			SMCryptoDebugLog("Error: Tree page %llu doesn't match its hash.\n", number);
+			*error = SMCryptoFileErrorIntegrity;
+			return NULL;
+		}
 	}
 	
-	// Update  data file len.
-	obj->fileDataLen = MAX(obj->fileDataLen, obj->cachedDataOffset + fullSize);
+	page->number = number;
+	page->used = true;
+	page->dirty = false;
+	page->referenced = true;
 	
-	// Clean dirty flag.
-	obj->cachedDataDirty = false;
+	obj->treeLastPage = page;
 	
-	// Return.
-	return true;
+	return page;
 }
 
-static bool SMCryptoFileCachePrepareReadingAtCurrentOffset(SMCryptoFile *obj, SMCryptoFileError *error)
+static bool SMCryptoFileTreePageFlush(SMCryptoFile *obj, SMCryptoFileTreePage *page, SMCryptoFileError *error)
 {
-	// Do nothing if cache is already on the right place.
-	if ((obj->currentOffset >= obj->cachedDataOffset) && (obj->currentOffset < obj->cachedDataOffset + obj->cachedDataSize))
-		return true;
+	// Update the page hash and its path to the root.
+	uint8_t *hash = obj->treeNodes + (obj->treeCapacity + page->number) * kCFTreeHashSize;
 	
-	// Flush current data in cache (+ possible header changes) before read a new chunk
-	if (SMCryptoFileFlush(obj, SMCryptoFileSyncNo, error) == false)
+	if (SMCryptoFileTreeHash(obj, page->leaves, kCFTreePageSize, hash) == false || SMCryptoFileTreeUpdateRange(obj, page->number, page->number + 1) == false)
+	{
+		*error = SMCryptoFileErrorCrypto;
 		return false;
+	}
 	
-	// Round the current offset to speed-up possible futur writes.
-	uint64_t currentOffset = SMRoundDown(obj->currentOffset, kCFFileBlockSize);
-	
-	// Read wanted offset.
-	// > Compute cache size.
-	uint64_t dataSize = SMRoundUp(obj->header.dataLen, kCFFileBlockSize);
-	uint64_t cacheSize;
-	
-	if (currentOffset + kCFFileCacheSize > dataSize)
-		cacheSize = dataSize - currentOffset;
-	else
-		cacheSize = kCFFileCacheSize;
+	SMCryptoFileTreeSetDirty(obj, page->number, page->number + 1);
 	
-	if (cacheSize == 0)
+	// Write the leaves to the copy the committed tree doesn't use (zero pages are not read, so not written either).
+	if (SMCryptoIsZero(hash, kCFTreeHashSize) == false)
 	{
-		obj->cachedDataOffset = currentOffset;
-		obj->cachedDataSize = 0;
+		bool copy = SMCryptoBitmapGet(obj->treeCopies, page->number);
 		
-		return true;
-	}
-	
-	// > Read blocks.
-	if (currentOffset + cacheSize > obj->fileDataLen)
-	{
-		// > End-Of-File: use 0 allocated buffer.
-
-		memset(obj->cachedData, 0, (size_t)cacheSize);
-	}
-	else
-	{
-		uint8_t fileCache[kCFFileCacheSize];
-
-		// > Read.
-		if (sm_pread(obj->fd, fileCache, (size_t)cacheSize, (off_t)(kCFFileDataOffset + currentOffset)) != cacheSize)
+		if (copy == SMCryptoBitmapGet(obj->treeCommittedCopies, page->number))
 		{
-			*error = SMCryptoFileErrorIO;
-			return false;
+			copy = !copy;
+			SMCryptoBitmapSetRange(obj->treeCopies, page->number, page->number + 1, copy);
 		}
 		
-		// > Decrypt.
-		for (uint64_t cacheOffset = 0; cacheOffset < cacheSize; cacheOffset += kCFFileBlockSize)
+		if (sm_pwrite(obj->treeFd, page->leaves, kCFTreePageSize, SMCryptoFileTreePageOffset(page->number, copy)) != kCFTreePageSize)
 		{
-			uint64_t blockNumber = (currentOffset + cacheOffset) / kCFFileBlockSize;
-			
-			if (SMCryptoFileBlockDecrypt(obj, fileCache + cacheOffset, blockNumber, obj->cachedData + cacheOffset) == false)
-			{
-				*error = SMCryptoFileErrorCrypto;
-				obj->cachedDataSize = 0;
-				
-				return false;
-			}
+			*error = SMCryptoFileErrorIO;
+			return false;
 		}
 	}
 	
-	// > Update cache info.
-	obj->cachedDataOffset = currentOffset;
-	obj->cachedDataSize = cacheSize;
+	page->dirty = false;
 	
-	// Done.
 	return true;
 }
 
-static bool SMCryptoFileCachePrepareWritingAtCurrentOffset(SMCryptoFile *obj, SMCryptoFileError *error)
+static bool SMCryptoFileTreeUpdateRange(SMCryptoFile *obj, uint64_t firstPage, uint64_t endPage)
 {
-	// Do nothing if it's already possible to write in the cache.
-	if ((obj->currentOffset >= obj->cachedDataOffset) && (obj->currentOffset <= obj->cachedDataOffset + obj->cachedDataSize) && (obj->cachedDataSize < kCFFileCacheSize))
+	// Hash the parents of the nodes in range, level by level up to the root (node 1): O(range + log(capacity)) hashes.
+	uint64_t first = obj->treeCapacity + firstPage;
+	uint64_t end = obj->treeCapacity + endPage;
+	
+	if (firstPage >= endPage)
 		return true;
 	
-	// Flush current data in cache (+ flush possible header changes) before prepare cache for currentOffset.
-	if (SMCryptoFileFlush(obj, SMCryptoFileSyncNo, error) == false)
-		return false;
-
-	// Prepare the cache for currentOffset.
-	uint64_t	currentOffset = SMRoundDown(obj->currentOffset, kCFFileBlockSize);
-	size_t		prefixSize = (size_t)(obj->currentOffset - currentOffset);
-
-	if (prefixSize > 0)
+	while (first > 1)
 	{
-		// currentOffset is misaligned : align it by reading the block where the offset is.
-		
-		// Note - we read a block to realign currentOffset there instead of in SMCryptoFileCacheFlush because:
-		// 1 - We can gain pread / pwrite calls in case of a little rewind after a write because in this case, the cache will probably be already there saving a cache flush.
-		// 2 - At worst, there is no loss : we will have to realign the buffer there or in cache flush, so in any case we will have to read at least one block.
-		
-		uint64_t blockNumber = currentOffset / kCFFileBlockSize;
+		first /= 2;
+		end = (end - 1) / 2 + 1;
 		
-		// > Read crypted blocks.
-		if (currentOffset + kCFFileBlockSize > obj->fileDataLen)
+		for (uint64_t node = first; node < end; node++)
 		{
-			// > End-Of-File: use 0 allocated buffer.
-			memset(obj->cachedData, 0, kCFFileBlockSize);
-		}
-		else
-		{
-			uint8_t fileBlock[kCFFileBlockSize];
-
-			// > Read.
-			if (sm_pread(obj->fd, fileBlock, sizeof(fileBlock), (off_t)(kCFFileDataOffset + currentOffset)) != sizeof(fileBlock))
-			{
-				*error = SMCryptoFileErrorIO;
-				return false;
-			}
-			
-			// > Decrypt.
-			if (SMCryptoFileBlockDecrypt(obj, fileBlock, blockNumber, obj->cachedData) == false)
-			{
-				obj->cachedDataOffset = 0;
-				obj->cachedDataSize = 0;
-				
-				*error = SMCryptoFileErrorCrypto;
-				
+			if (SMCryptoFileTreeHash(obj, obj->treeNodes + 2 * node * kCFTreeHashSize, 2 * kCFTreeHashSize, obj->treeNodes + node * kCFTreeHashSize) == false)
 				return false;
-			}
 		}
-
-		// > Set values.
-		obj->cachedDataOffset = currentOffset;
-		obj->cachedDataSize = kCFFileBlockSize;
 	}
-	else
+	
+	return true;
+}
+
+static bool SMCryptoFileTreeHash(SMCryptoFile *obj, const uint8_t *input, size_t length, uint8_t *digest)
+{
+	// Note: the hash of zeros is zeros, so holes, pages never written and empty subtrees cost neither a hash nor a read.
+	if (SMCryptoIsZero(input, length))
 	{
-		// currentOffset is aligned: just reset the cache.
-		
-		// > Set values.
-		obj->cachedDataOffset = currentOffset;
-		obj->cachedDataSize = 0;
+		memset(digest, 0, kCFTreeHashSize);
+		return true;
 	}
 	
-	return true;
+	return obj->backend->sha256(input, length, digest);
 }
 
+static inline bool SMCryptoIsZero(const uint8_t *bytes, size_t length)
+{
+	return (bytes[0] == 0 && memcmp(bytes, bytes + 1, length - 1) == 0);
+}
 
-#pragma mark > Lazy CommonCrypto SPI
 
-/*
- SPI Header, needed for XTS.
- 
- Note :		Even if Apple offers to use XTS mode with kCCModeXTS (defined in public header), the functions necessary to use this mode are in a SPI header (work-in-progress).
- 
-			The following lazy_ functions are bridges to this SPI functions. They didn't evolved since 10.7, and are used in libCoreStorage, so this should not be a problem to use them.
-			They are essential to do XTS, there is no alternative.
- 
-			I use dlopen / dlsym to prevent Apple to forbid MAS applications which try to use SMCryptoFile and its SPI CC functions.
- 
- Ticket :	rdar://16576209
-*/
+#pragma mark > I/O batch
 
-// Obfuscate dlsym symbol names by cutting them in three parts.
-static void * obfuscated_dlsym(void *handle, const char *nm1, const char *nm2, const char *nm3)
+static void SMCryptoFileIOBatchAdd(SMCryptoFile *obj, SMCryptoFileIOBatch *batch, const uint8_t *buffer, uint64_t length, uint64_t offset)
 {
-	if (!nm1 || !nm2 || !nm3)
-		return NULL;
+	// Note: the batch is supposed to have room for a request, and buffer to follow the staging buffer bytes already used.
+	off_t fileOffset = (off_t)(obj->dataOffset + offset);
 	
-	char buffer[1024] = { 0 };
+	batch->stagingUsed += length;
 	
-	strlcat(buffer, nm1, sizeof(buffer));
-	strlcat(buffer, nm2, sizeof(buffer));
-	strlcat(buffer, nm3, sizeof(buffer));
-
-	return dlsym(handle, buffer);
+	// Extend the last request if the write follows it in file.
+	if (batch->count > 0)
+	{
+		struct aiocb *last = &batch->requests[batch->count - 1];
+		
+		if ((const uint8_t *)last->aio_buf + last->aio_nbytes == buffer && last->aio_offset + (off_t)last->aio_nbytes == fileOffset)
+		{
+			last->aio_nbytes += (size_t)length;
+			return;
+		}
+	}
+	
+	// Add a request.
+	SMCryptoFileIORequestPrepare(obj, &batch->requests[batch->count++], buffer, length, offset);
 }
 
-static CCCryptorStatus lazy_CCCryptorEncryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut)
+static bool SMCryptoFileIOBatchSubmit(SMCryptoFile *obj, SMCryptoFileIOBatch *batch, SMCryptoFileError *error)
 {
-	static dispatch_once_t	onceToken;
-	static CCCryptorStatus	(*ptr_CCCryptorEncryptDataBlock)(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
+	struct aiocb *list[kCFFileIOBatchMax];
 	
-	dispatch_once(&onceToken, ^{
-		void *handle = dlopen("/usr/lib/system/libcommonCrypto.dylib", RTLD_LAZY);
-		
-		if (handle)
-			ptr_CCCryptorEncryptDataBlock = obfuscated_dlsym(handle, "CCCry", "ptorEncryptDa", "taBlock");
-	});
+	for (unsigned i = 0; i < batch->count; i++)
+		list[i] = &batch->requests[i];
 	
-	if (!ptr_CCCryptorEncryptDataBlock)
-		return kCCUnimplemented;
+	// Submit all the requests in one call, and wait for them (a single request is written directly).
+	if (batch->count > 1)
+		sm_lio_listio(LIO_WAIT, list, (int)batch->count);
 	
-	return ptr_CCCryptorEncryptDataBlock(cryptorRef, iv, dataIn, dataInLength, dataOut);
-}
-
-static CCCryptorStatus lazy_CCCryptorDecryptDataBlock(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut)
-{
-	static dispatch_once_t	onceToken;
-	static CCCryptorStatus	(*ptr_CCCryptorDecryptDataBlock)(CCCryptorRef cryptorRef, const void *iv, const void *dataIn, size_t dataInLength, void *dataOut);
+	// Check each request.
+	bool result = true;
 	
-	dispatch_once(&onceToken, ^{
-		void *handle = dlopen("/usr/lib/system/libcommonCrypto.dylib", RTLD_LAZY);
-		
-		if (handle)
-			ptr_CCCryptorDecryptDataBlock = obfuscated_dlsym(handle, "CCCry", "ptorDecryptDa", "taBlock");
-	});
+	for (unsigned i = 0; i < batch->count; i++)
+	{
+		if (SMCryptoFileIORequestComplete(obj, list[i], (batch->count > 1), error) == false)
+			result = false;
+	}
 	
-	if (!ptr_CCCryptorDecryptDataBlock)
-		return kCCUnimplemented;
+	// Reset.
+	batch->count = 0;
+	batch->stagingUsed = 0;
 	
-	return ptr_CCCryptorDecryptDataBlock(cryptorRef, iv, dataIn, dataInLength, dataOut);
+	return result;
 }
 
-#pragma mark > Block crypt / decrypt
-
-static bool SMCryptoFileBlockCrypt(SMCryptoFile *obj, const void *block, uint64_t blocknum, void *output)
+static void SMCryptoFileIORequestPrepare(SMCryptoFile *obj, struct aiocb *request, const uint8_t *buffer, uint64_t length, uint64_t offset)
 {
-	// Generate block tweak.
-	uint8_t		iv_tweak[kCCBlockSizeAES128];
-	uint64_t	*tw_int = (uint64_t *)iv_tweak;
-	
-	// Generate the block number tweak.
-	tw_int[0] = OSSwapHostToLittleInt64(blocknum);
-	tw_int[1] = 0;
+	memset(request, 0, sizeof(*request));
 	
-	// Crypt.
-	CCCryptorStatus status = lazy_CCCryptorEncryptDataBlock(obj->dataEncrypt, iv_tweak, block, kCFFileBlockSize, output);
-	
-	return (status == kCCSuccess);
+	request->aio_fildes = obj->fd;
+	request->aio_buf = (volatile void *)buffer;
+	request->aio_nbytes = (size_t)length;
+	request->aio_offset = (off_t)(obj->dataOffset + offset);
+	request->aio_lio_opcode = LIO_WRITE;
 }
 
-static bool SMCryptoFileBlockDecrypt(SMCryptoFile *obj, const void *block, uint64_t blocknum, void *output)
+static bool SMCryptoFileIORequestComplete(SMCryptoFile *obj, struct aiocb *request, bool submitted, SMCryptoFileError *error)
 {
-	// Generate block tweak.
-	uint8_t		iv_tweak[kCCBlockSizeAES128];
-	uint64_t	*tw_int = (uint64_t *)iv_tweak;
+	// Wait for the request. Requests not submitted (AIO unavailable or out of resources) or failed are written directly.
+	int status = submitted ? aio_error(request) : -1;
+	
+	while (status == EINPROGRESS)
+	{
+		const struct aiocb *wait[1] = { request };
+		
+		aio_suspend(wait, 1, NULL);
+		status = aio_error(request);
+	}
+	
+	if (status != 0 || aio_return(request) != (ssize_t)request->aio_nbytes)
+	{
+		if (sm_pwrite(obj->fd, (const void *)request->aio_buf, request->aio_nbytes, request->aio_offset) != (ssize_t)request->aio_nbytes)
+		{
+			*error = SMCryptoFileErrorIO;
+			return false;
+		}
+	}
 	
-	// Generate the block number tweak.
-	tw_int[0] = OSSwapHostToLittleInt64(blocknum);
-	tw_int[1] = 0;
+	// Written: cover it by the data length.
+	uint64_t offset = (uint64_t)request->aio_offset - obj->dataOffset;
 	
-	// Decrypt.
-	CCCryptorStatus status = lazy_CCCryptorDecryptDataBlock(obj->dataDecrypt, iv_tweak, block, kCFFileBlockSize, output);
+	SMCryptoFileDataWritten(obj, offset, offset + request->aio_nbytes);
 	
-	return (status == kCCSuccess);
+	return true;
 }
 
 
-#pragma mark > Ranges
+#pragma mark > IOVec
 
-static SMCryptoRange SMCryptoMakeRange(uint64_t location, uint64_t length)
+static bool SMCryptoIOVecSize(const struct iovec *iov, int iovcnt, uint64_t *size)
 {
-	SMCryptoRange result = { .location = location, .length = length} ;
+	// Total size of the segments. False if the segments are invalid.
+	if (iovcnt < 0 || (iovcnt > 0 && !iov))
+		return false;
 	
-	return result;
+	uint64_t total = 0;
+	
+	for (int i = 0; i < iovcnt; i++)
+	{
+		if (iov[i].iov_len > 0 && !iov[i].iov_base)
+			return false;
+		
+		if (iov[i].iov_len > UINT64_MAX - total)
+			return false;
+		
+		total += iov[i].iov_len;
+	}
+	
+	*size = total;
+	
+	return true;
 }
 
-static uint64_t SMCryptoMaxRange(SMCryptoRange range)
+static void SMCryptoIOVecGather(SMCryptoIOVecCursor *cursor, uint8_t *buffer, uint64_t length)
 {
-	return range.location + range.length;
+	// Note: the segments are supposed to hold length bytes after the cursor.
+	while (length > 0)
+	{
+		const struct iovec *segment = &cursor->iov[cursor->index];
+		
+		if (cursor->offset == segment->iov_len)
+		{
+			cursor->index++;
+			cursor->offset = 0;
+			continue;
+		}
+		
+		size_t count = (size_t)MIN(length, segment->iov_len - cursor->offset);
+		
+		memcpy(buffer, (const uint8_t *)segment->iov_base + cursor->offset, count);
+		
+		buffer += count;
+		length -= count;
+		cursor->offset += count;
+	}
 }
 
-static SMCryptoRange SMCryptoIntersectionRange(SMCryptoRange r1, SMCryptoRange r2)
+static void SMCryptoIOVecScatter(SMCryptoIOVecCursor *cursor, const uint8_t *buffer, uint64_t length)
 {
-	uint64_t min, loc;
-	uint64_t max1 = SMCryptoMaxRange(r1);
-	uint64_t max2 = SMCryptoMaxRange(r2);
-	SMCryptoRange result;
-	
-	min = (max1 < max2) ? max1 : max2;
-	loc = (r1.location > r2.location) ? r1.location:r2.location;
-	
-	if (min < loc)
+	// Note: the segments are supposed to hold length bytes after the cursor.
+	while (length > 0)
 	{
-		result.location = 0;
-		result.length = 0;
+		const struct iovec *segment = &cursor->iov[cursor->index];
+		
+		if (cursor->offset == segment->iov_len)
+		{
+			cursor->index++;
+			cursor->offset = 0;
+			continue;
+		}
+		
+		size_t count = (size_t)MIN(length, segment->iov_len - cursor->offset);
+		
+		memcpy((uint8_t *)segment->iov_base + cursor->offset, buffer, count);
+		
+		buffer += count;
+		length -= count;
+		cursor->offset += count;
 	}
-	else
+}
+
+static void * SMCryptoIOVecContiguous(SMCryptoIOVecCursor *cursor, uint64_t *length)
+{
+	// Note: the segments are supposed to hold at least one byte after the cursor.
+	while (cursor->offset == cursor->iov[cursor->index].iov_len)
 	{
-		result.location = loc;
-		result.length = min - loc;
+		cursor->index++;
+		cursor->offset = 0;
 	}
 	
-	return result;
+	*length = cursor->iov[cursor->index].iov_len - cursor->offset;
+	
+	return (uint8_t *)cursor->iov[cursor->index].iov_base + cursor->offset;
 }
 
 
-#pragma mark > Random
+#pragma mark > Bitmaps
 
-static void SMCryptoRandomCopyBytes(void *bytes, size_t count)
+static bool SMCryptoBitmapGet(const uint64_t *bitmap, uint64_t index)
 {
-	// I don't want to link on Security framework just to use SecRandomCopyBytes, so…
-	static dispatch_once_t	onceToken;
-	static int				(*ptr_SecRandomCopyBytes)(const void * rnd, size_t count, uint8_t *bytes);
-	static void				**pptr_kSecRandomDefault;
-	static void				*ptr_kSecRandomDefault = NULL;
-	
-	dispatch_once(&onceToken, ^{
-		void *handle = dlopen("/System/Library/Frameworks/Security.framework/Security", RTLD_LAZY);
+	return (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+static void SMCryptoBitmapSetRange(uint64_t *bitmap, uint64_t start, uint64_t end, bool value)
+{
+	for (uint64_t index = start; index < end; index++)
+	{
+		if (value)
+			bitmap[index / 64] |= (1ULL << (index % 64));
+		else
+			bitmap[index / 64] &= ~(1ULL << (index % 64));
+	}
+}
+
+static uint64_t SMCryptoBitmapFind(const uint64_t *bitmap, uint64_t start, uint64_t end, bool value)
+{
+	// First index in [start; end[ where the bit is value, end if none.
+	while (start < end)
+	{
+		uint64_t word = value ? bitmap[start / 64] : ~bitmap[start / 64];
 		
-		if (handle)
-		{
-			ptr_SecRandomCopyBytes = obfuscated_dlsym(handle, "SecRandom", "Copy", "Bytes");
-			pptr_kSecRandomDefault = (void **)obfuscated_dlsym(handle, "kSec", "Random", "Default");
-			
-			if (pptr_kSecRandomDefault)
-				ptr_kSecRandomDefault = *pptr_kSecRandomDefault;
-		}
-	});
-	
-	if (ptr_SecRandomCopyBytes && ptr_SecRandomCopyBytes(ptr_kSecRandomDefault, count, bytes) == 0)
-		return;
+		word &= (~0ULL << (start % 64));
+		
+		if (word)
+			return MIN(SMRoundDown(start, 64) + (uint64_t)__builtin_ctzll(word), end);
+		
+		start = SMRoundDown(start, 64) + 64;
+	}
 	
-	// Fall back to less secure arc4random.
-	arc4random_buf(bytes, count);
+	return end;
 }
 
 
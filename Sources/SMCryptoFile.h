@@ -31,6 +31,8 @@
 # include <stdint.h>
 # include <stdbool.h>
 
+# include <sys/uio.h>
+
 
 /*
 ** Types
@@ -39,6 +41,8 @@
 
 typedef struct SMCryptoFile SMCryptoFile;
 
+#define SMCryptoFileReadAheadDisabled	UINT32_MAX
+
 typedef enum
 {
 	SMCryptoFileErrorNo = 0,
@@ -52,7 +56,8 @@ typedef enum
 	SMCryptoFileErrorReadOnly,	// Tried to do a write operation on a read-only file.
 	SMCryptoFileErrorIO,		// Problem with Input / Output subsytem.
 	SMCryptoFileErrorMemory,	// Problem with memory allocation.
-	SMCryptoFileErrorUnknown	// Unknown error.
+	SMCryptoFileErrorUnknown,	// Unknown error.
+	SMCryptoFileErrorIntegrity	// Data (or its authentication tree) modified outside of this code (authenticated files).
 } SMCryptoFileError;
 
 typedef enum
@@ -62,6 +67,33 @@ typedef enum
 	SMCryptoFileKeySize256 = 2,	// AES 256
 } SMCryptoFileKeySize;
 
+typedef enum
+{
+	SMCryptoFileBackendDefault = 0,		// SMCRYPTOFILE_BACKEND environment variable ("commoncrypto", "builtin", "reference", "openssl") if set, else the fastest backend for this CPU.
+	SMCryptoFileBackendCommonCrypto,	// CommonCrypto (XTS SPI, with built-in engine fallback).
+	SMCryptoFileBackendBuiltin,			// Built-in XTS engine (SMCryptoXTS), CommonCrypto for header and password derivation.
+	SMCryptoFileBackendReference,		// Built-in scalar reference XTS engine. Slow: for tests and comparisons.
+	SMCryptoFileBackendOpenSSL,			// OpenSSL EVP. Only available when built with SM_CRYPTO_OPENSSL=1.
+} SMCryptoFileBackend;
+
+typedef struct
+{
+	SMCryptoFileBackend	backend;	// Crypto backend used for this handle. Files are compatible between backends.
+	uint32_t			blockSize;	// Data block size of new files (XTS data-unit): power of 2 from 256 to 65536 bytes (0 -> 256). Stored in the file, ignored when opening.
+	uint32_t			dataAlignment;	// Data area alignment in new files: power of 2 from 512 bytes to 64 KiB, or 0 for no alignment (data right after the header, readable by older versions). Aligned blocks map to whole pages and sectors. Stored in the file, ignored when opening.
+	bool				sparse;			// New files: regions never written (gaps left by truncates or writes past the end) are holes in the file, read as zeros, instead of crypted zeros. Needs this version to be opened. Stored in the file, ignored when opening.
+	bool				lazyLength;		// New files: the data length in the header is only written at sync points (flush with a sync, close, truncate), so flushes growing the file cost one write instead of two. On open, the length of data flushed since the last sync point is recovered from the file size, rounded up to a block (the end of the last block reads as zeros). Needs this version to be opened. Stored in the file, ignored when opening.
+	bool				dualHeader;		// New files: the header is written alternately in two slots, with a generation and a checksum, and the newest valid slot is used on open. A crash while writing the header keeps the previous one, so a single sync commits data and length. Needs this version to be opened. Stored in the file, ignored when opening.
+	bool				authenticated;	// New files: each data block is authenticated by a hash tree kept in a side file (path + "-tree"), its root in the header. Reads of blocks modified outside of this code fail with SMCryptoFileErrorIntegrity. The header write commits the tree (flush, truncate, close), its new pages being written beside the committed ones, and synced before the header on synced flushes: after a crash the previous tree stays valid, only the blocks rewritten since may not authenticate. Disables read-ahead, write-behind and lazyLength. Needs this version to be opened. Stored in the file, ignored when opening.
+	uint32_t			cacheSize;	// Clear data cache size of this handle, from 4 KiB to 64 MiB (0 -> 4 KiB), rounded up to a multiple of the block size. Larger caches give larger (and fewer) disk I/O. The cache is locked in memory.
+	uint32_t			cacheSlots;	// Number of independent cache slots, up to 4096 (0 -> one slot per 64 KiB of cache). The cache keeps the most recently used regions of the file; more slots hold more regions, larger slots give larger disk I/O.
+	uint32_t			readAheadSlots;	// Cache slots loaded in background ahead of sequential or strided reads, up to half of the slots (0 -> a quarter of the slots, up to 8; SMCryptoFileReadAheadDisabled -> no read-ahead).
+	uint32_t			writeBehindSlots;	// Full cache slots crypted and written in background while the next ones are filled, up to half of the slots (0 -> no write-behind). A background write error is returned by the next write or flush.
+	uint32_t			preallocationSize;	// Disk space reserved ahead of the data as the file grows (F_PREALLOCATE), by chunks of this size from 1 MiB to 1 GiB (0 -> no preallocation), so large files are extended less often and less fragmented. The space past the data is released on close and truncate. Ignored for sparse files and read-only handles.
+	bool				noCache;	// Bypass the system cache for data reads and writes (F_NOCACHE), so the file data are only cached (clear) by this handle. Reads and writes are fully uncached when the block size and the data alignment are multiples of the device sector size.
+	bool				mapData;	// Read-only opens: decrypt data straight from a memory mapping of the file, instead of reading it (ignored for writable handles). The file must not be truncated by someone else while mapped.
+} SMCryptoFileOptions;
+
 typedef enum
 {
 	SMCryptoFileSyncNo,		// Simply write data in cache to file.
@@ -93,6 +125,10 @@ SMCryptoFile *	SMCryptoFileCreateVolatile(const char *path, SMCryptoFileKeySize
 
 SMCryptoFile *	SMCryptoFileOpen(const char *path, const char *password, bool readOnly, SMCryptoFileError *error);
 
+SMCryptoFile *	SMCryptoFileCreateWithOptions(const char *path, const char *password, SMCryptoFileKeySize keySize, const SMCryptoFileOptions *options, SMCryptoFileError *error); // options can be NULL (default options).
+SMCryptoFile *	SMCryptoFileCreateVolatileWithOptions(const char *path, SMCryptoFileKeySize keySize, const SMCryptoFileOptions *options, SMCryptoFileError *error);
+SMCryptoFile *	SMCryptoFileOpenWithOptions(const char *path, const char *password, bool readOnly, const SMCryptoFileOptions *options, SMCryptoFileError *error);
+
 bool			SMCryptoFileClose(SMCryptoFile *file, SMCryptoFileError *error);
 
 // -- Tools --
@@ -100,9 +136,17 @@ bool			SMCryptoFileChangePassword(SMCryptoFile *file, const char *newPassword, S
 
 // -- Properties --
 uint64_t		SMCryptoFileSize(SMCryptoFile *file);
+uint32_t		SMCryptoFileBlockSize(SMCryptoFile *file);
+uint32_t		SMCryptoFileCacheSize(SMCryptoFile *file);
+SMCryptoFileBackend	SMCryptoFileGetBackend(SMCryptoFile *file); // Resolved backend (never SMCryptoFileBackendDefault).
+
+// -- Backends --
+bool			SMCryptoFileBackendIsAvailable(SMCryptoFileBackend backend);
+const char *	SMCryptoFileBackendName(SMCryptoFileBackend backend); // NULL if the backend is unknown or not available.
 
 // -- I/O --
 bool			SMCryptoFileTruncate(SMCryptoFile *file, uint64_t length, SMCryptoFileError *error);
+bool			SMCryptoFilePreallocate(SMCryptoFile *file, uint64_t length, SMCryptoFileError *error); // Reserve the disk space of the data up to length, without changing the data length. The space past the data is released on close and truncate.
 
 bool			SMCryptoFileSeek(SMCryptoFile *obj, int64_t offset, SMCryptoFileSeekWhence whence, SMCryptoFileError *error);
 uint64_t		SMCryptoFileTell(SMCryptoFile *file);
@@ -110,6 +154,15 @@ uint64_t		SMCryptoFileTell(SMCryptoFile *file);
 int64_t			SMCryptoFileRead(SMCryptoFile *file, void *ptr, uint64_t size, SMCryptoFileError *error); // -1 -> error; 0 -> eof
 bool			SMCryptoFileWrite(SMCryptoFile *file, const void *ptr, uint64_t size, SMCryptoFileError *error);
 
+int64_t			SMCryptoFilePRead(SMCryptoFile *file, void *ptr, uint64_t size, uint64_t offset, SMCryptoFileError *error); // Read at offset, without using or moving the current position. -1 -> error; 0 -> eof
+bool			SMCryptoFilePWrite(SMCryptoFile *file, const void *ptr, uint64_t size, uint64_t offset, SMCryptoFileError *error); // Write at offset, without using or moving the current position.
+
+int64_t			SMCryptoFileReadV(SMCryptoFile *file, const struct iovec *iov, int iovcnt, SMCryptoFileError *error); // Read contiguous data into segments, in order. -1 -> error; 0 -> eof
+bool			SMCryptoFileWriteV(SMCryptoFile *file, const struct iovec *iov, int iovcnt, SMCryptoFileError *error); // Write segments as contiguous data, in order.
+
+int64_t			SMCryptoFilePReadV(SMCryptoFile *file, const struct iovec *iov, int iovcnt, uint64_t offset, SMCryptoFileError *error);
+bool			SMCryptoFilePWriteV(SMCryptoFile *file, const struct iovec *iov, int iovcnt, uint64_t offset, SMCryptoFileError *error);
+
 bool			SMCryptoFileFlush(SMCryptoFile *file, SMCryptoFileSyncType sync, SMCryptoFileError *error);
 
 #endif
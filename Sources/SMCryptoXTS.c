@@ -0,0 +1,1605 @@
+/*
+ * SMCryptoXTS.c
+ *
+ * Copyright 2021 Avérous Julien-Pierre
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+#include <pthread.h>
+
+#include "SMCryptoXTS.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#	define SM_XTS_X86 1
+#	include <cpuid.h>
+#	include <immintrin.h>
+#	if defined(__APPLE__)
+#		include <sys/sysctl.h>
+#	endif
+#else
+#	define SM_XTS_X86 0
+#endif
+
+
+
+/*
+** Types
+*/
+#pragma mark - Types
+
+#define kSMCryptoXTSEngineCount	(SMCryptoXTSEngineAVX512 + 1)
+
+typedef void (*SMCryptoXTSKernel)(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length); // tweak is the encrypted initial tweak.
+typedef void (*SMCryptoXTSTweakKernel)(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks); // Encrypt count ivs with the tweak key.
+
+typedef struct SMCryptoXTSDispatch
+{
+	bool					available;
+
+	SMCryptoXTSTweakKernel	tweak;
+	SMCryptoXTSKernel		encrypt;
+	SMCryptoXTSKernel		decrypt;
+} SMCryptoXTSDispatch;
+
+
+
+/*
+** Globals
+*/
+#pragma mark - Globals
+
+static pthread_once_t		gDispatchOnce = PTHREAD_ONCE_INIT;
+static SMCryptoXTSDispatch	gEngines[kSMCryptoXTSEngineCount];
+static SMCryptoXTSEngine	gEngine;
+
+// Use a volatile pointer so the compiler can't optimize out the wipe of a context.
+static void * (* const volatile gSecureMemset)(void *, int, size_t) = memset;
+
+
+
+/*
+** Prototypes
+*/
+#pragma mark - Prototypes
+
+// -- Dispatch --
+static void SMCryptoXTSDispatchInit(void);
+
+// -- Units --
+static void SMCryptoXTSCryptUnits(const SMCryptoXTSDispatch *dispatch, const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const uint8_t *input, size_t length, uint8_t *output, bool encrypt);
+
+// -- Reference --
+static void SMCryptoXTSReferenceTweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks);
+static void SMCryptoXTSReferenceEncrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+static void SMCryptoXTSReferenceDecrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+
+// -- Bitsliced --
+static void SMCryptoAESBitsliceSubWord(uint8_t word[4]);
+static void SMCryptoAESBitsliceExpandKeys(const uint8_t keys[][kSMCryptoXTSBlockSize], unsigned rounds, uint64_t bitsliceKeys[][16]);
+
+static void SMCryptoXTSBitsliceTweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks);
+static void SMCryptoXTSBitsliceEncrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+static void SMCryptoXTSBitsliceDecrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+
+// -- x86 --
+#if SM_XTS_X86
+static void SMCryptoXTSAESNITweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks);
+static void SMCryptoXTSAESNIEncrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+static void SMCryptoXTSAESNIDecrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+
+static void SMCryptoXTSVAESEncrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+static void SMCryptoXTSVAESDecrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+
+static void SMCryptoXTSAVX512Tweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks);
+static void SMCryptoXTSAVX512Encrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+static void SMCryptoXTSAVX512Decrypt(const SMCryptoXTSContext *ctx, const uint8_t *tweak, const uint8_t *input, uint8_t *output, size_t length);
+#endif
+
+// -- AES --
+static void SMCryptoAESExpandKey(const uint8_t *key, size_t keySize, uint8_t roundKeys[][kSMCryptoXTSBlockSize], unsigned *rounds);
+static void SMCryptoAESInvMixColumns(uint8_t state[kSMCryptoXTSBlockSize]);
+
+
+
+/*
+** Engine
+*/
+#pragma mark - Engine
+
+SMCryptoXTSEngine SMCryptoXTSCurrentEngine(void)
+{
+	pthread_once(&gDispatchOnce, SMCryptoXTSDispatchInit);
+
+	return gEngine;
+}
+
+const char * SMCryptoXTSEngineName(SMCryptoXTSEngine engine)
+{
+	switch (engine)
+	{
+		case SMCryptoXTSEngineReference:	return "reference";
+		case SMCryptoXTSEngineBitsliced:	return "bitsliced";
+		case SMCryptoXTSEngineAESNI:		return "aes-ni";
+		case SMCryptoXTSEngineVAES:			return "vaes-avx2";
+		case SMCryptoXTSEngineAVX512:		return "vaes-avx512";
+	}
+
+	return "-";
+}
+
+bool SMCryptoXTSEngineIsAvailable(SMCryptoXTSEngine engine)
+{
+	pthread_once(&gDispatchOnce, SMCryptoXTSDispatchInit);
+
+	if ((unsigned)engine >= kSMCryptoXTSEngineCount)
+		return false;
+
+	return gEngines[engine].available;
+}
+
+bool SMCryptoXTSEngineIsAccelerated(SMCryptoXTSEngine engine)
+{
+	return (engine != SMCryptoXTSEngineReference && engine != SMCryptoXTSEngineBitsliced);
+}
+
+
+
+/*
+** Context
+*/
+#pragma mark - Context
+
+bool SMCryptoXTSContextInit(SMCryptoXTSContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize)
+{
+	if (!ctx || !dataKey || !tweakKey)
+		return false;
+
+	if (keySize != 16 && keySize != 24 && keySize != 32)
+		return false;
+
+	// Expand keys.
+	unsigned rounds = 0;
+
+	SMCryptoAESExpandKey(dataKey, keySize, ctx->encryptKeys, &rounds);
+	SMCryptoAESExpandKey(tweakKey, keySize, ctx->tweakKeys, &ctx->rounds);
+
+	// Build decryption keys for the equivalent inverse cipher (reversed order, InvMixColumns on inner keys).
+	memcpy(ctx->decryptKeys[0], ctx->encryptKeys[rounds], kSMCryptoXTSBlockSize);
+
+	for (unsigned i = 1; i < rounds; i++)
+	{
+		memcpy(ctx->decryptKeys[i], ctx->encryptKeys[rounds - i], kSMCryptoXTSBlockSize);
+		SMCryptoAESInvMixColumns(ctx->decryptKeys[i]);
+	}
+
+	memcpy(ctx->decryptKeys[rounds], ctx->encryptKeys[0], kSMCryptoXTSBlockSize);
+
+	// Bitslice keys for the constant-time engine.
+	SMCryptoAESBitsliceExpandKeys(ctx->encryptKeys, rounds, ctx->bitsliceEncryptKeys);
+	SMCryptoAESBitsliceExpandKeys(ctx->decryptKeys, rounds, ctx->bitsliceDecryptKeys);
+	SMCryptoAESBitsliceExpandKeys(ctx->tweakKeys, rounds, ctx->bitsliceTweakKeys);
+
+	return true;
+}
+
+void SMCryptoXTSContextClean(SMCryptoXTSContext *ctx)
+{
+	if (!ctx)
+		return;
+
+	gSecureMemset(ctx, 0, sizeof(*ctx));
+}
+
+
+
+/*
+** Crypt / Decrypt
+*/
+#pragma mark - Crypt / Decrypt
+
+void SMCryptoXTSEncrypt(const SMCryptoXTSContext *ctx, const void *iv, const void *input, size_t length, void *output)
+{
+	uint8_t tweak[kSMCryptoXTSBlockSize];
+
+	pthread_once(&gDispatchOnce, SMCryptoXTSDispatchInit);
+
+	gEngines[gEngine].tweak(ctx, iv, 1, tweak);
+	gEngines[gEngine].encrypt(ctx, tweak, input, output, length);
+}
+
+void SMCryptoXTSDecrypt(const SMCryptoXTSContext *ctx, const void *iv, const void *input, size_t length, void *output)
+{
+	uint8_t tweak[kSMCryptoXTSBlockSize];
+
+	pthread_once(&gDispatchOnce, SMCryptoXTSDispatchInit);
+
+	gEngines[gEngine].tweak(ctx, iv, 1, tweak);
+	gEngines[gEngine].decrypt(ctx, tweak, input, output, length);
+}
+
+void SMCryptoXTSEncryptUnits(const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	pthread_once(&gDispatchOnce, SMCryptoXTSDispatchInit);
+
+	SMCryptoXTSCryptUnits(&gEngines[gEngine], ctx, firstUnit, unitSize, input, length, output, true);
+}
+
+void SMCryptoXTSDecryptUnits(const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	pthread_once(&gDispatchOnce, SMCryptoXTSDispatchInit);
+
+	SMCryptoXTSCryptUnits(&gEngines[gEngine], ctx, firstUnit, unitSize, input, length, output, false);
+}
+
+bool SMCryptoXTSEncryptUnitsWithEngine(SMCryptoXTSEngine engine, const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	if (SMCryptoXTSEngineIsAvailable(engine) == false)
+		return false;
+
+	SMCryptoXTSCryptUnits(&gEngines[engine], ctx, firstUnit, unitSize, input, length, output, true);
+
+	return true;
+}
+
+bool SMCryptoXTSDecryptUnitsWithEngine(SMCryptoXTSEngine engine, const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output)
+{
+	if (SMCryptoXTSEngineIsAvailable(engine) == false)
+		return false;
+
+	SMCryptoXTSCryptUnits(&gEngines[engine], ctx, firstUnit, unitSize, input, length, output, false);
+
+	return true;
+}
+
+
+
+/*
+** Units
+*/
+#pragma mark - Units
+
+#define kSMCryptoXTSUnitsBatch	16
+
+static void SMCryptoXTSCryptUnits(const SMCryptoXTSDispatch *dispatch, const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const uint8_t *input, size_t length, uint8_t *output, bool encrypt)
+{
+	SMCryptoXTSKernel kernel = (encrypt ? dispatch->encrypt : dispatch->decrypt);
+	uint8_t ivs[kSMCryptoXTSUnitsBatch][kSMCryptoXTSBlockSize];
+	uint8_t tweaks[kSMCryptoXTSUnitsBatch][kSMCryptoXTSBlockSize];
+	size_t	units = length / unitSize;
+
+	memset(ivs, 0, sizeof(ivs));
+
+	for (size_t unit = 0; unit < units; unit += kSMCryptoXTSUnitsBatch)
+	{
+		size_t count = units - unit;
+
+		if (count > kSMCryptoXTSUnitsBatch)
+			count = kSMCryptoXTSUnitsBatch;
+
+		// > Derive the consecutive unit numbers, and encrypt them together to keep the pipeline full.
+		for (size_t i = 0; i < count; i++)
+		{
+			uint64_t unitNumber = firstUnit + unit + i;
+
+			for (unsigned j = 0; j < 8; j++)
+				ivs[i][j] = (uint8_t)(unitNumber >> (8 * j));
+		}
+
+		dispatch->tweak(ctx, ivs[0], count, tweaks[0]);
+
+		// > Crypt the units.
+		for (size_t i = 0; i < count; i++)
+			kernel(ctx, tweaks[i], input + (unit + i) * unitSize, output + (unit + i) * unitSize, unitSize);
+	}
+
+	gSecureMemset(tweaks, 0, sizeof(tweaks));
+}
+
+
+
+/*
+** Dispatch
+*/
+#pragma mark - Dispatch
+
+#if SM_XTS_X86
+
+static uint64_t SMCryptoXTSGetXCR0(void)
+{
+	uint32_t eax, edx;
+
+	__asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+
+	return ((uint64_t)edx << 32) | eax;
+}
+
+#endif
+
+static void SMCryptoXTSDispatchInit(void)
+{
+	// Reference and bitsliced (always available). The reference engine uses tables, so it's only kept for cross-checks.
+	gEngines[SMCryptoXTSEngineReference] = (SMCryptoXTSDispatch){ true, SMCryptoXTSReferenceTweaks, SMCryptoXTSReferenceEncrypt, SMCryptoXTSReferenceDecrypt };
+	gEngines[SMCryptoXTSEngineBitsliced] = (SMCryptoXTSDispatch){ true, SMCryptoXTSBitsliceTweaks, SMCryptoXTSBitsliceEncrypt, SMCryptoXTSBitsliceDecrypt };
+
+	gEngine = SMCryptoXTSEngineBitsliced;
+
+#if SM_XTS_X86
+	unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return;
+
+	bool hasAESNI = (ecx & (1u << 25)) != 0;
+	bool hasOSXSAVE = (ecx & (1u << 27)) != 0;
+	bool hasAVX = (ecx & (1u << 28)) != 0;
+
+	// > AES-NI.
+	if (!hasAESNI)
+		return;
+
+	gEngines[SMCryptoXTSEngineAESNI] = (SMCryptoXTSDispatch){ true, SMCryptoXTSAESNITweaks, SMCryptoXTSAESNIEncrypt, SMCryptoXTSAESNIDecrypt };
+	gEngine = SMCryptoXTSEngineAESNI;
+
+	// > VAES (needs the OS to save YMM state).
+	uint64_t xcr0 = (hasOSXSAVE ? SMCryptoXTSGetXCR0() : 0);
+
+	if (!hasAVX || (xcr0 & 0x6) != 0x6)
+		return;
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+		return;
+
+	bool hasAVX2 = (ebx & (1u << 5)) != 0;
+	bool hasAVX512F = (ebx & (1u << 16)) != 0;
+	bool hasAVX512BW = (ebx & (1u << 30)) != 0;
+	bool hasVAES = (ecx & (1u << 9)) != 0;
+	bool hasVPCLMULQDQ = (ecx & (1u << 10)) != 0;
+
+	if (!hasAVX2 || !hasVAES)
+		return;
+
+	gEngines[SMCryptoXTSEngineVAES] = (SMCryptoXTSDispatch){ true, SMCryptoXTSAESNITweaks, SMCryptoXTSVAESEncrypt, SMCryptoXTSVAESDecrypt };
+	gEngine = SMCryptoXTSEngineVAES;
+
+	// > AVX-512 (needs the OS to save opmask and ZMM states).
+#if defined(__APPLE__)
+	// macOS enables AVX-512 states on demand, so XCR0 doesn't reflect them: ask the kernel.
+	int		avx512 = 0;
+	size_t	avx512Size = sizeof(avx512);
+
+	if (sysctlbyname("hw.optional.avx512f", &avx512, &avx512Size, NULL, 0) != 0 || avx512 == 0)
+		return;
+#else
+	if ((xcr0 & 0xe0) != 0xe0)
+		return;
+#endif
+
+	if (!hasAVX512F || !hasAVX512BW || !hasVPCLMULQDQ)
+		return;
+
+	gEngines[SMCryptoXTSEngineAVX512] = (SMCryptoXTSDispatch){ true, SMCryptoXTSAVX512Tweaks, SMCryptoXTSAVX512Encrypt, SMCryptoXTSAVX512Decrypt };
+	gEngine = SMCryptoXTSEngineAVX512;
+#endif
+}
+
+
+
+/*
+** Reference
+*/
+#pragma mark - Reference
+
+// Scalar byte-oriented implementation, following FIPS-197 and IEEE 1619 step by step. It uses lookup tables, so it is never selected by default: it only serves as the reference that tests cross-check the bitsliced fallback and the wide kernels against.
+
+#pragma mark > Tables
+
+static const uint8_t gSBox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static const uint8_t gInvSBox[256] = {
+	0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d
+};
+
+#pragma mark > Helpers
+
+#define SMCryptoAESXTime(Value) ((uint8_t)(((Value) << 1) ^ (((Value) >> 7) * 0x1b)))
+
+static inline uint64_t SMCryptoXTSLoad64(const uint8_t *ptr)
+{
+	return ((uint64_t)ptr[0]) | ((uint64_t)ptr[1] << 8) | ((uint64_t)ptr[2] << 16) | ((uint64_t)ptr[3] << 24) | ((uint64_t)ptr[4] << 32) | ((uint64_t)ptr[5] << 40) | ((uint64_t)ptr[6] << 48) | ((uint64_t)ptr[7] << 56);
+}
+
+static inline void SMCryptoXTSStore64(uint8_t *ptr, uint64_t value)
+{
+	for (unsigned i = 0; i < 8; i++)
+		ptr[i] = (uint8_t)(value >> (8 * i));
+}
+
+static inline void SMCryptoXTSMultiplyAlpha(uint8_t tweak[kSMCryptoXTSBlockSize])
+{
+	// Multiply the tweak by the primitive element α of GF(2^128) (little-endian convention of IEEE 1619).
+	uint64_t lo = SMCryptoXTSLoad64(tweak);
+	uint64_t hi = SMCryptoXTSLoad64(tweak + 8);
+	uint64_t carry = hi >> 63;
+
+	hi = (hi << 1) | (lo >> 63);
+	lo = (lo << 1) ^ (carry * 0x87);
+
+	SMCryptoXTSStore64(tweak, lo);
+	SMCryptoXTSStore64(tweak + 8, hi);
+}
+
+static void SMCryptoAESMixColumns(uint8_t s[kSMCryptoXTSBlockSize])
+{
+	for (unsigned c = 0; c < 16; c += 4)
+	{
+		uint8_t a0 = s[c], a1 = s[c + 1], a2 = s[c + 2], a3 = s[c + 3];
+		uint8_t t = a0 ^ a1 ^ a2 ^ a3;
+
+		s[c] = a0 ^ t ^ SMCryptoAESXTime(a0 ^ a1);
+		s[c + 1] = a1 ^ t ^ SMCryptoAESXTime(a1 ^ a2);
+		s[c + 2] = a2 ^ t ^ SMCryptoAESXTime(a2 ^ a3);
+		s[c + 3] = a3 ^ t ^ SMCryptoAESXTime(a3 ^ a0);
+	}
+}
+
+static void SMCryptoAESInvMixColumns(uint8_t s[kSMCryptoXTSBlockSize])
+{
+	// InvMixColumns = MixColumns preceded by a multiplication with {04}x^2 + {05}.
+	for (unsigned c = 0; c < 16; c += 4)
+	{
+		uint8_t u = SMCryptoAESXTime(SMCryptoAESXTime(s[c] ^ s[c + 2]));
+		uint8_t v = SMCryptoAESXTime(SMCryptoAESXTime(s[c + 1] ^ s[c + 3]));
+
+		s[c] ^= u;
+		s[c + 1] ^= v;
+		s[c + 2] ^= u;
+		s[c + 3] ^= v;
+	}
+
+	SMCryptoAESMixColumns(s);
+}
+
+#pragma mark > Key schedule
+
+static void SMCryptoAESExpandKey(const uint8_t *key, size_t keySize, uint8_t roundKeys[][kSMCryptoXTSBlockSize], unsigned *rounds)
+{
+	unsigned	nk = (unsigned)(keySize / 4);
+	unsigned	nr = nk + 6;
+	unsigned	total = 4 * (nr + 1);
+	uint8_t		*w = (uint8_t *)roundKeys;
+	uint8_t		rcon = 1;
+
+	memcpy(w, key, keySize);
+
+	for (unsigned i = nk; i < total; i++)
+	{
+		uint8_t t[4];
+
+		memcpy(t, w + 4 * (i - 1), 4);
+
+		if (i % nk == 0)
+		{
+			uint8_t t0 = t[0];
+
+			t[0] = t[1];
+			t[1] = t[2];
+			t[2] = t[3];
+			t[3] = t0;
+
+			SMCryptoAESBitsliceSubWord(t);
+
+			t[0] ^= rcon;
+			rcon = SMCryptoAESXTime(rcon);
+		}
+		else if (nk > 6 && i % nk == 4)
+		{
+			SMCryptoAESBitsliceSubWord(t);
+		}
+
+		for (unsigned j = 0; j < 4; j++)
+			w[4 * i + j] = w[4 * (i - nk) + j] ^ t[j];
+	}
+
+	*rounds = nr;
+}
+
+#pragma mark > Block
+
+static void SMCryptoAESReferenceEncryptBlock(const uint8_t keys[][kSMCryptoXTSBlockSize], unsigned rounds, const uint8_t *input, uint8_t *output)
+{
+	uint8_t s[kSMCryptoXTSBlockSize];
+	uint8_t t[kSMCryptoXTSBlockSize];
+
+	for (unsigned i = 0; i < 16; i++)
+		s[i] = input[i] ^ keys[0][i];
+
+	for (unsigned r = 1; r <= rounds; r++)
+	{
+		// > SubBytes + ShiftRows (bytes are stored column by column).
+		for (unsigned c = 0; c < 4; c++)
+			for (unsigned row = 0; row < 4; row++)
+				t[4 * c + row] = gSBox[s[4 * ((c + row) & 3) + row]];
+
+		// > MixColumns (not on last round).
+		if (r != rounds)
+			SMCryptoAESMixColumns(t);
+
+		// > AddRoundKey.
+		for (unsigned i = 0; i < 16; i++)
+			s[i] = t[i] ^ keys[r][i];
+	}
+
+	memcpy(output, s, sizeof(s));
+}
+
+static void SMCryptoAESReferenceDecryptBlock(const uint8_t keys[][kSMCryptoXTSBlockSize], unsigned rounds, const uint8_t *input, uint8_t *output)
+{
+	// Equivalent inverse cipher: keys are the decryption key schedule.
+	uint8_t s[kSMCryptoXTSBlockSize];
+	uint8_t t[kSMCryptoXTSBlockSize];
+
+	for (unsigned i = 0; i < 16; i++)
+		s[i] = input[i] ^ keys[0][i];
+
+	for (unsigned r = 1; r <= rounds; r++)
+	{
+		// > InvSubBytes + InvShiftRows.
+		for (unsigned c = 0; c < 4; c++)
+			for (unsigned row = 0; row < 4; row++)
+				t[4 * c + row] = gInvSBox[s[4 * ((c - row) & 3) + row]];
+
+		// > InvMixColumns (not on last round).
+		if (r != rounds)
+			SMCryptoAESInvMixColumns(t);
+
+		// > AddRoundKey.
+		for (unsigned i = 0; i < 16; i++)
+			s[i] = t[i] ^ keys[r][i];
+	}
+
+	memcpy(output, s, sizeof(s));
+}
+
+#pragma mark > XTS
+
+static void SMCryptoXTSReferenceTweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks)
+{
+	for (size_t i = 0; i < count; i++)
+		SMCryptoAESReferenceEncryptBlock(ctx->tweakKeys, ctx->rounds, ivs + i * kSMCryptoXTSBlockSize, tweaks + i * kSMCryptoXTSBlockSize);
+}
+
+static void SMCryptoXTSReferenceEncrypt(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length)
+{
+	uint8_t tweak[kSMCryptoXTSBlockSize];
+	uint8_t block[kSMCryptoXTSBlockSize];
+
+	memcpy(tweak, initialTweak, sizeof(tweak));
+
+	for (size_t offset = 0; offset < length; offset += kSMCryptoXTSBlockSize)
+	{
+		for (unsigned i = 0; i < 16; i++)
+			block[i] = input[offset + i] ^ tweak[i];
+
+		SMCryptoAESReferenceEncryptBlock(ctx->encryptKeys, ctx->rounds, block, block);
+
+		for (unsigned i = 0; i < 16; i++)
+			output[offset + i] = block[i] ^ tweak[i];
+
+		SMCryptoXTSMultiplyAlpha(tweak);
+	}
+
+	gSecureMemset(block, 0, sizeof(block));
+}
+
+static void SMCryptoXTSReferenceDecrypt(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length)
+{
+	uint8_t tweak[kSMCryptoXTSBlockSize];
+	uint8_t block[kSMCryptoXTSBlockSize];
+
+	memcpy(tweak, initialTweak, sizeof(tweak));
+
+	for (size_t offset = 0; offset < length; offset += kSMCryptoXTSBlockSize)
+	{
+		for (unsigned i = 0; i < 16; i++)
+			block[i] = input[offset + i] ^ tweak[i];
+
+		SMCryptoAESReferenceDecryptBlock(ctx->decryptKeys, ctx->rounds, block, block);
+
+		for (unsigned i = 0; i < 16; i++)
+			output[offset + i] = block[i] ^ tweak[i];
+
+		SMCryptoXTSMultiplyAlpha(tweak);
+	}
+
+	gSecureMemset(block, 0, sizeof(block));
+}
+
+
+
+/*
+** Bitsliced
+*/
+#pragma mark - Bitsliced
+
+// Constant-time implementation, without table lookups: 8 blocks are processed at once as 8 bit planes.
+// Each plane is 2 words of 64 bits (rows 0-1, rows 2-3); bit (row % 2) * 32 + column * 8 + block of a plane holds one bit of the state byte [row, column] of a block.
+
+#define kSMCryptoXTSBitsliceBlocks	8
+
+#pragma mark > S-box
+
+static void SMCryptoAESBitsliceSBox(uint64_t q[8])
+{
+	// Boyar-Peralta S-box circuit (32 AND, 83 XOR / XNOR). q[i] holds bit i of each byte.
+	uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+	uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11, y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+	uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9, z10, z11, z12, z13, z14, z15, z16, z17;
+	uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15, t16, t17, t18, t19, t20, t21, t22, t23, t24, t25, t26, t27, t28, t29, t30, t31, t32, t33, t34, t35, t36, t37, t38, t39, t40, t41, t42, t43, t44, t45, t46, t47, t48, t49, t50, t51, t52, t53, t54, t55, t56, t57, t58, t59, t60, t61, t62, t63, t64, t65, t66, t67;
+	uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+	x0 = q[7];
+	x1 = q[6];
+	x2 = q[5];
+	x3 = q[4];
+	x4 = q[3];
+	x5 = q[2];
+	x6 = q[1];
+	x7 = q[0];
+
+	// > Top linear transformation.
+	y14 = x3 ^ x5;
+	y13 = x0 ^ x6;
+	y9 = x0 ^ x3;
+	y8 = x0 ^ x5;
+	t0 = x1 ^ x2;
+	y1 = t0 ^ x7;
+	y4 = y1 ^ x3;
+	y12 = y13 ^ y14;
+	y2 = y1 ^ x0;
+	y5 = y1 ^ x6;
+	y3 = y5 ^ y8;
+	t1 = x4 ^ y12;
+	y15 = t1 ^ x5;
+	y20 = t1 ^ x1;
+	y6 = y15 ^ x7;
+	y10 = y15 ^ t0;
+	y11 = y20 ^ y9;
+	y7 = x7 ^ y11;
+	y17 = y10 ^ y11;
+	y19 = y10 ^ y8;
+	y16 = t0 ^ y11;
+	y21 = y13 ^ y16;
+	y18 = x0 ^ y16;
+
+	// > Non-linear section.
+	t2 = y12 & y15;
+	t3 = y3 & y6;
+	t4 = t3 ^ t2;
+	t5 = y4 & x7;
+	t6 = t5 ^ t2;
+	t7 = y13 & y16;
+	t8 = y5 & y1;
+	t9 = t8 ^ t7;
+	t10 = y2 & y7;
+	t11 = t10 ^ t7;
+	t12 = y9 & y11;
+	t13 = y14 & y17;
+	t14 = t13 ^ t12;
+	t15 = y8 & y10;
+	t16 = t15 ^ t12;
+	t17 = t4 ^ t14;
+	t18 = t6 ^ t16;
+	t19 = t9 ^ t14;
+	t20 = t11 ^ t16;
+	t21 = t17 ^ y20;
+	t22 = t18 ^ y19;
+	t23 = t19 ^ y21;
+	t24 = t20 ^ y18;
+
+	t25 = t21 ^ t22;
+	t26 = t21 & t23;
+	t27 = t24 ^ t26;
+	t28 = t25 & t27;
+	t29 = t28 ^ t22;
+	t30 = t23 ^ t24;
+	t31 = t22 ^ t26;
+	t32 = t31 & t30;
+	t33 = t32 ^ t24;
+	t34 = t23 ^ t33;
+	t35 = t27 ^ t33;
+	t36 = t24 & t35;
+	t37 = t36 ^ t34;
+	t38 = t27 ^ t36;
+	t39 = t29 & t38;
+	t40 = t25 ^ t39;
+
+	t41 = t40 ^ t37;
+	t42 = t29 ^ t33;
+	t43 = t29 ^ t40;
+	t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15;
+	z1 = t37 & y6;
+	z2 = t33 & x7;
+	z3 = t43 & y16;
+	z4 = t40 & y1;
+	z5 = t29 & y7;
+	z6 = t42 & y11;
+	z7 = t45 & y17;
+	z8 = t41 & y10;
+	z9 = t44 & y12;
+	z10 = t37 & y3;
+	z11 = t33 & y4;
+	z12 = t43 & y13;
+	z13 = t40 & y5;
+	z14 = t29 & y2;
+	z15 = t42 & y9;
+	z16 = t45 & y14;
+	z17 = t41 & y8;
+
+	// > Bottom linear transformation.
+	t46 = z15 ^ z16;
+	t47 = z10 ^ z11;
+	t48 = z5 ^ z13;
+	t49 = z9 ^ z10;
+	t50 = z2 ^ z12;
+	t51 = z2 ^ z5;
+	t52 = z7 ^ z8;
+	t53 = z0 ^ z3;
+	t54 = z6 ^ z7;
+	t55 = z16 ^ z17;
+	t56 = z12 ^ t48;
+	t57 = t50 ^ t53;
+	t58 = z4 ^ t46;
+	t59 = z3 ^ t54;
+	t60 = t46 ^ t57;
+	t61 = z14 ^ t57;
+	t62 = t52 ^ t58;
+	t63 = t49 ^ t58;
+	t64 = z4 ^ t59;
+	t65 = t61 ^ t62;
+	t66 = z1 ^ t63;
+	s0 = t59 ^ t63;
+	s6 = t56 ^ ~t62;
+	s7 = t48 ^ ~t60;
+	t67 = t64 ^ t65;
+	s3 = t53 ^ t66;
+	s4 = t51 ^ t66;
+	s5 = t47 ^ t65;
+	s1 = t64 ^ ~s3;
+	s2 = t55 ^ ~t67;
+
+	q[7] = s0;
+	q[6] = s1;
+	q[5] = s2;
+	q[4] = s3;
+	q[3] = s4;
+	q[2] = s5;
+	q[1] = s6;
+	q[0] = s7;
+}
+
+static void SMCryptoAESBitsliceInvSBox(uint64_t q[8])
+{
+	// InvSBox(x) = T(SBox(T(x))), with T(x) = A^-1(x ^ 0x63) the inverse of the S-box affine transform.
+	uint64_t q0, q1, q2, q3, q4, q5, q6, q7;
+
+	for (unsigned i = 0; i < 2; i++)
+	{
+		q0 = ~q[0];
+		q1 = ~q[1];
+		q2 = q[2];
+		q3 = q[3];
+		q4 = q[4];
+		q5 = ~q[5];
+		q6 = ~q[6];
+		q7 = q[7];
+
+		q[7] = q1 ^ q4 ^ q6;
+		q[6] = q0 ^ q3 ^ q5;
+		q[5] = q7 ^ q2 ^ q4;
+		q[4] = q6 ^ q1 ^ q3;
+		q[3] = q5 ^ q0 ^ q2;
+		q[2] = q4 ^ q7 ^ q1;
+		q[1] = q3 ^ q6 ^ q0;
+		q[0] = q2 ^ q5 ^ q7;
+
+		if (i == 0)
+			SMCryptoAESBitsliceSBox(q);
+	}
+}
+
+static void SMCryptoAESBitsliceSubWord(uint8_t word[4])
+{
+	// Key schedule S-box, without table lookups (the key bytes are secret too).
+	uint64_t q[8];
+
+	for (unsigned j = 0; j < 8; j++)
+		q[j] = ((word[0] >> j) & 1) | (((word[1] >> j) & 1) << 1) | (((word[2] >> j) & 1) << 2) | (((word[3] >> j) & 1) << 3);
+
+	SMCryptoAESBitsliceSBox(q);
+
+	for (unsigned i = 0; i < 4; i++)
+	{
+		word[i] = 0;
+
+		for (unsigned j = 0; j < 8; j++)
+			word[i] |= (uint8_t)(((q[j] >> i) & 1) << j);
+	}
+
+	gSecureMemset(q, 0, sizeof(q));
+}
+
+#pragma mark > Helpers
+
+static inline void SMCryptoAESBitsliceSwap(uint64_t *a, uint64_t *b, unsigned shift, uint64_t mask)
+{
+	// Exchange the bits of a selected by (mask << shift) with the bits of b selected by mask.
+	uint64_t t = ((*a >> shift) ^ *b) & mask;
+
+	*b ^= t;
+	*a ^= t << shift;
+}
+
+static void SMCryptoAESBitsliceOrtho(uint64_t w[16])
+{
+	// Permute the 1024 bits between the block layout and the bitsliced layout (this is an involution).
+	// Bit index is (word << 6) | bit. Block layout: word = [block, column / 2], bit = [column % 2, row, bit of byte].
+	// Bitsliced layout: word = [bit of byte, row / 2], bit = [row % 2, column, block].
+
+	// > Exchange the bit-of-byte index with the block index.
+	for (unsigned x = 0; x < 16; x++)
+	{
+		if ((x & 2) == 0)
+			SMCryptoAESBitsliceSwap(&w[x], &w[x | 2], 1, 0x5555555555555555ull);
+	}
+
+	for (unsigned x = 0; x < 16; x++)
+	{
+		if ((x & 4) == 0)
+			SMCryptoAESBitsliceSwap(&w[x], &w[x | 4], 2, 0x3333333333333333ull);
+	}
+
+	for (unsigned x = 0; x < 16; x++)
+	{
+		if ((x & 8) == 0)
+			SMCryptoAESBitsliceSwap(&w[x], &w[x | 8], 4, 0x0f0f0f0f0f0f0f0full);
+	}
+
+	// > Exchange the high bit of the row with the high bit of the column.
+	for (unsigned x = 0; x < 16; x += 2)
+		SMCryptoAESBitsliceSwap(&w[x], &w[x + 1], 16, 0x0000ffff0000ffffull);
+
+	// > Exchange the low bit of the row with the low bit of the column.
+	for (unsigned x = 0; x < 16; x++)
+	{
+		uint64_t t = ((w[x] >> 24) ^ w[x]) & 0x00000000ff00ff00ull;
+
+		w[x] ^= t ^ (t << 24);
+	}
+}
+
+static void SMCryptoAESBitsliceLoad(const uint8_t *blocks, uint64_t q[16])
+{
+	uint64_t w[16];
+
+	for (unsigned x = 0; x < 16; x++)
+		w[x] = SMCryptoXTSLoad64(blocks + 8 * x);
+
+	SMCryptoAESBitsliceOrtho(w);
+
+	// Planes of rows 0-1 first, then planes of rows 2-3.
+	for (unsigned j = 0; j < 8; j++)
+	{
+		q[j] = w[2 * j];
+		q[8 + j] = w[2 * j + 1];
+	}
+}
+
+static void SMCryptoAESBitsliceStore(const uint64_t q[16], uint8_t *blocks)
+{
+	uint64_t w[16];
+
+	for (unsigned j = 0; j < 8; j++)
+	{
+		w[2 * j] = q[j];
+		w[2 * j + 1] = q[8 + j];
+	}
+
+	SMCryptoAESBitsliceOrtho(w);
+
+	for (unsigned x = 0; x < 16; x++)
+		SMCryptoXTSStore64(blocks + 8 * x, w[x]);
+}
+
+static void SMCryptoAESBitsliceExpandKeys(const uint8_t keys[][kSMCryptoXTSBlockSize], unsigned rounds, uint64_t bitsliceKeys[][16])
+{
+	// A round key is the same for all blocks: each of its bits fills a whole byte of its plane.
+	for (unsigned r = 0; r <= rounds; r++)
+	{
+		memset(bitsliceKeys[r], 0, sizeof(bitsliceKeys[r]));
+
+		for (unsigned p = 0; p < kSMCryptoXTSBlockSize; p++)
+		{
+			unsigned	row = p & 3, column = p >> 2;
+			unsigned	shift = (row & 1) * 32 + column * 8;
+
+			for (unsigned j = 0; j < 8; j++)
+				bitsliceKeys[r][(row >> 1) * 8 + j] |= ((uint64_t)(((keys[r][p] >> j) & 1) * 0xff)) << shift;
+		}
+	}
+}
+
+static inline void SMCryptoAESBitsliceAddRoundKey(uint64_t q[16], const uint64_t key[16])
+{
+	for (unsigned i = 0; i < 16; i++)
+		q[i] ^= key[i];
+}
+
+static inline uint64_t SMCryptoAESBitsliceRotateRows(uint64_t w, unsigned lowShift, unsigned highShift)
+{
+	// Rotate right each 32 bits half (one row) by its own amount of bits (a multiple of 8, lower than 32).
+	uint32_t low = (uint32_t)w;
+	uint32_t high = (uint32_t)(w >> 32);
+
+	low = (lowShift ? ((low >> lowShift) | (low << (32 - lowShift))) : low);
+	high = (high >> highShift) | (high << (32 - highShift));
+
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline void SMCryptoAESBitsliceShiftRows(uint64_t q[16])
+{
+	// Row r is rotated left by r columns.
+	for (unsigned j = 0; j < 8; j++)
+	{
+		q[j] = SMCryptoAESBitsliceRotateRows(q[j], 0, 8);
+		q[8 + j] = SMCryptoAESBitsliceRotateRows(q[8 + j], 16, 24);
+	}
+}
+
+static inline void SMCryptoAESBitsliceInvShiftRows(uint64_t q[16])
+{
+	for (unsigned j = 0; j < 8; j++)
+	{
+		q[j] = SMCryptoAESBitsliceRotateRows(q[j], 0, 24);
+		q[8 + j] = SMCryptoAESBitsliceRotateRows(q[8 + j], 16, 8);
+	}
+}
+
+static inline void SMCryptoAESBitsliceXTime(const uint64_t x[8], uint64_t y[8])
+{
+	// Multiply by x in GF(2^8) (modulo 0x11b), plane by plane.
+	y[0] = x[7];
+	y[1] = x[0] ^ x[7];
+	y[2] = x[1];
+	y[3] = x[2] ^ x[7];
+	y[4] = x[3] ^ x[7];
+	y[5] = x[4];
+	y[6] = x[5];
+	y[7] = x[6];
+}
+
+static void SMCryptoAESBitsliceMixColumns(uint64_t q[16])
+{
+	// out[r] = 2.(a[r] ^ a[r+1]) ^ a[r+1] ^ a[r+2] ^ a[r+3], with rows rotated between the two words of each plane.
+	uint64_t sum[8], doubled[8];
+	uint64_t others[16];
+
+	for (unsigned j = 0; j < 8; j++)
+	{
+		uint64_t a = q[j], b = q[8 + j];
+		uint64_t rotated0 = (a >> 32) | (b << 32);	// a[1], a[2]
+		uint64_t rotated1 = (b >> 32) | (a << 32);	// a[3], a[0]
+
+		others[j] = rotated0 ^ b ^ rotated1;
+		others[8 + j] = rotated1 ^ a ^ rotated0;
+
+		q[j] = a ^ rotated0;
+		q[8 + j] = b ^ rotated1;
+	}
+
+	for (unsigned h = 0; h < 2; h++)
+	{
+		for (unsigned j = 0; j < 8; j++)
+			sum[j] = q[h * 8 + j];
+
+		SMCryptoAESBitsliceXTime(sum, doubled);
+
+		for (unsigned j = 0; j < 8; j++)
+			q[h * 8 + j] = doubled[j] ^ others[h * 8 + j];
+	}
+}
+
+static void SMCryptoAESBitsliceInvMixColumns(uint64_t q[16])
+{
+	// InvMixColumns = MixColumns after adding 4.(a[r] ^ a[r+2]) to each row.
+	uint64_t sum[8], doubled[8], quadrupled[8];
+
+	for (unsigned j = 0; j < 8; j++)
+		sum[j] = q[j] ^ q[8 + j];
+
+	SMCryptoAESBitsliceXTime(sum, doubled);
+	SMCryptoAESBitsliceXTime(doubled, quadrupled);
+
+	for (unsigned j = 0; j < 8; j++)
+	{
+		q[j] ^= quadrupled[j];
+		q[8 + j] ^= quadrupled[j];
+	}
+
+	SMCryptoAESBitsliceMixColumns(q);
+}
+
+#pragma mark > Blocks
+
+static void SMCryptoAESBitsliceEncryptBlocks(const uint64_t keys[][16], unsigned rounds, uint8_t blocks[kSMCryptoXTSBitsliceBlocks * kSMCryptoXTSBlockSize])
+{
+	uint64_t q[16];
+
+	SMCryptoAESBitsliceLoad(blocks, q);
+	SMCryptoAESBitsliceAddRoundKey(q, keys[0]);
+
+	for (unsigned r = 1; r <= rounds; r++)
+	{
+		SMCryptoAESBitsliceSBox(q);
+		SMCryptoAESBitsliceSBox(q + 8);
+		SMCryptoAESBitsliceShiftRows(q);
+
+		if (r != rounds)
+			SMCryptoAESBitsliceMixColumns(q);
+
+		SMCryptoAESBitsliceAddRoundKey(q, keys[r]);
+	}
+
+	SMCryptoAESBitsliceStore(q, blocks);
+
+	gSecureMemset(q, 0, sizeof(q));
+}
+
+static void SMCryptoAESBitsliceDecryptBlocks(const uint64_t keys[][16], unsigned rounds, uint8_t blocks[kSMCryptoXTSBitsliceBlocks * kSMCryptoXTSBlockSize])
+{
+	// Equivalent inverse cipher: keys are the bitsliced decryption key schedule.
+	uint64_t q[16];
+
+	SMCryptoAESBitsliceLoad(blocks, q);
+	SMCryptoAESBitsliceAddRoundKey(q, keys[0]);
+
+	for (unsigned r = 1; r <= rounds; r++)
+	{
+		SMCryptoAESBitsliceInvSBox(q);
+		SMCryptoAESBitsliceInvSBox(q + 8);
+		SMCryptoAESBitsliceInvShiftRows(q);
+
+		if (r != rounds)
+			SMCryptoAESBitsliceInvMixColumns(q);
+
+		SMCryptoAESBitsliceAddRoundKey(q, keys[r]);
+	}
+
+	SMCryptoAESBitsliceStore(q, blocks);
+
+	gSecureMemset(q, 0, sizeof(q));
+}
+
+#pragma mark > XTS
+
+static void SMCryptoXTSBitsliceTweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks)
+{
+	uint8_t blocks[kSMCryptoXTSBitsliceBlocks * kSMCryptoXTSBlockSize];
+
+	for (size_t i = 0; i < count; i += kSMCryptoXTSBitsliceBlocks)
+	{
+		size_t batch = (count - i < kSMCryptoXTSBitsliceBlocks ? count - i : kSMCryptoXTSBitsliceBlocks);
+
+		memset(blocks, 0, sizeof(blocks));
+		memcpy(blocks, ivs + i * kSMCryptoXTSBlockSize, batch * kSMCryptoXTSBlockSize);
+
+		SMCryptoAESBitsliceEncryptBlocks(ctx->bitsliceTweakKeys, ctx->rounds, blocks);
+
+		memcpy(tweaks + i * kSMCryptoXTSBlockSize, blocks, batch * kSMCryptoXTSBlockSize);
+	}
+
+	gSecureMemset(blocks, 0, sizeof(blocks));
+}
+
+static void SMCryptoXTSBitsliceCrypt(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length, bool encrypt)
+{
+	uint64_t	tweakLow = SMCryptoXTSLoad64(initialTweak);
+	uint64_t	tweakHigh = SMCryptoXTSLoad64(initialTweak + 8);
+	uint64_t	tweaks[2 * kSMCryptoXTSBitsliceBlocks];
+	uint8_t		blocks[kSMCryptoXTSBitsliceBlocks * kSMCryptoXTSBlockSize];
+
+	for (size_t offset = 0; offset < length; offset += sizeof(blocks))
+	{
+		size_t batch = (length - offset < sizeof(blocks) ? length - offset : sizeof(blocks));
+
+		// > Compute tweaks and whiten input (a short batch is padded with zeros).
+		memset(blocks, 0, sizeof(blocks));
+
+		for (size_t i = 0; i < batch / kSMCryptoXTSBlockSize; i++)
+		{
+			const uint8_t *block = input + offset + i * kSMCryptoXTSBlockSize;
+
+			tweaks[2 * i] = tweakLow;
+			tweaks[2 * i + 1] = tweakHigh;
+
+			SMCryptoXTSStore64(blocks + i * kSMCryptoXTSBlockSize, SMCryptoXTSLoad64(block) ^ tweakLow);
+			SMCryptoXTSStore64(blocks + i * kSMCryptoXTSBlockSize + 8, SMCryptoXTSLoad64(block + 8) ^ tweakHigh);
+
+			// Multiply by α.
+			uint64_t carry = tweakHigh >> 63;
+
+			tweakHigh = (tweakHigh << 1) | (tweakLow >> 63);
+			tweakLow = (tweakLow << 1) ^ (carry * 0x87);
+		}
+
+		// > Crypt 8 blocks at once.
+		if (encrypt)
+			SMCryptoAESBitsliceEncryptBlocks(ctx->bitsliceEncryptKeys, ctx->rounds, blocks);
+		else
+			SMCryptoAESBitsliceDecryptBlocks(ctx->bitsliceDecryptKeys, ctx->rounds, blocks);
+
+		// > Whiten output.
+		for (size_t i = 0; i < batch / kSMCryptoXTSBlockSize; i++)
+		{
+			uint8_t *block = output + offset + i * kSMCryptoXTSBlockSize;
+
+			SMCryptoXTSStore64(block, SMCryptoXTSLoad64(blocks + i * kSMCryptoXTSBlockSize) ^ tweaks[2 * i]);
+			SMCryptoXTSStore64(block + 8, SMCryptoXTSLoad64(blocks + i * kSMCryptoXTSBlockSize + 8) ^ tweaks[2 * i + 1]);
+		}
+	}
+
+	gSecureMemset(blocks, 0, sizeof(blocks));
+}
+
+static void SMCryptoXTSBitsliceEncrypt(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length)
+{
+	SMCryptoXTSBitsliceCrypt(ctx, initialTweak, input, output, length, true);
+}
+
+static void SMCryptoXTSBitsliceDecrypt(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length)
+{
+	SMCryptoXTSBitsliceCrypt(ctx, initialTweak, input, output, length, false);
+}
+
+
+
+/*
+** x86
+*/
+#pragma mark - x86
+
+#if SM_XTS_X86
+
+#pragma mark > AES-NI
+
+#define SM_X8(Macro)	Macro(0) Macro(1) Macro(2) Macro(3) Macro(4) Macro(5) Macro(6) Macro(7)
+
+__attribute__((target("aes,sse2")))
+static inline __m128i SMCryptoXTSAESNIMultiplyAlpha(__m128i tweak)
+{
+	// Each 32 bits lane receives the carry of the previous one; the carry of the top lane is reduced with 0x87.
+	__m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(tweak, 31), 0x93);
+
+	carry = _mm_and_si128(carry, _mm_set_epi32(1, 1, 1, 0x87));
+
+	return _mm_xor_si128(_mm_slli_epi32(tweak, 1), carry);
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i SMCryptoXTSAESNIEncryptBlock(const SMCryptoXTSContext *ctx, const uint8_t keys[][kSMCryptoXTSBlockSize], __m128i block)
+{
+	block = _mm_xor_si128(block, _mm_load_si128((const __m128i *)keys[0]));
+
+	for (unsigned r = 1; r < ctx->rounds; r++)
+		block = _mm_aesenc_si128(block, _mm_load_si128((const __m128i *)keys[r]));
+
+	return _mm_aesenclast_si128(block, _mm_load_si128((const __m128i *)keys[ctx->rounds]));
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i SMCryptoXTSAESNIDecryptBlock(const SMCryptoXTSContext *ctx, __m128i block)
+{
+	block = _mm_xor_si128(block, _mm_load_si128((const __m128i *)ctx->decryptKeys[0]));
+
+	for (unsigned r = 1; r < ctx->rounds; r++)
+		block = _mm_aesdec_si128(block, _mm_load_si128((const __m128i *)ctx->decryptKeys[r]));
+
+	return _mm_aesdeclast_si128(block, _mm_load_si128((const __m128i *)ctx->decryptKeys[ctx->rounds]));
+}
+
+__attribute__((target("aes,sse2")))
+static void SMCryptoXTSAESNITweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks)
+{
+	const __m128i	*input = (const __m128i *)ivs;
+	__m128i			*output = (__m128i *)tweaks;
+	size_t			i = 0;
+
+	// 4 blocks in flight.
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i key = _mm_load_si128((const __m128i *)ctx->tweakKeys[0]);
+		__m128i b0 = _mm_xor_si128(_mm_loadu_si128(input + i), key);
+		__m128i b1 = _mm_xor_si128(_mm_loadu_si128(input + i + 1), key);
+		__m128i b2 = _mm_xor_si128(_mm_loadu_si128(input + i + 2), key);
+		__m128i b3 = _mm_xor_si128(_mm_loadu_si128(input + i + 3), key);
+
+		for (unsigned r = 1; r < ctx->rounds; r++)
+		{
+			key = _mm_load_si128((const __m128i *)ctx->tweakKeys[r]);
+
+			b0 = _mm_aesenc_si128(b0, key);
+			b1 = _mm_aesenc_si128(b1, key);
+			b2 = _mm_aesenc_si128(b2, key);
+			b3 = _mm_aesenc_si128(b3, key);
+		}
+
+		key = _mm_load_si128((const __m128i *)ctx->tweakKeys[ctx->rounds]);
+
+		_mm_storeu_si128(output + i, _mm_aesenclast_si128(b0, key));
+		_mm_storeu_si128(output + i + 1, _mm_aesenclast_si128(b1, key));
+		_mm_storeu_si128(output + i + 2, _mm_aesenclast_si128(b2, key));
+		_mm_storeu_si128(output + i + 3, _mm_aesenclast_si128(b3, key));
+	}
+
+	// Remaining blocks.
+	for (; i < count; i++)
+		_mm_storeu_si128(output + i, SMCryptoXTSAESNIEncryptBlock(ctx, ctx->tweakKeys, _mm_loadu_si128(input + i)));
+}
+
+__attribute__((target("aes,sse2")))
+static void SMCryptoXTSAESNIEncryptTail(const SMCryptoXTSContext *ctx, __m128i tweak, const uint8_t *input, uint8_t *output, size_t length)
+{
+	for (size_t offset = 0; offset < length; offset += kSMCryptoXTSBlockSize)
+	{
+		__m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + offset)), tweak);
+
+		block = _mm_xor_si128(SMCryptoXTSAESNIEncryptBlock(ctx, ctx->encryptKeys, block), tweak);
+		_mm_storeu_si128((__m128i *)(output + offset), block);
+
+		tweak = SMCryptoXTSAESNIMultiplyAlpha(tweak);
+	}
+}
+
+__attribute__((target("aes,sse2")))
+static void SMCryptoXTSAESNIDecryptTail(const SMCryptoXTSContext *ctx, __m128i tweak, const uint8_t *input, uint8_t *output, size_t length)
+{
+	for (size_t offset = 0; offset < length; offset += kSMCryptoXTSBlockSize)
+	{
+		__m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + offset)), tweak);
+
+		block = _mm_xor_si128(SMCryptoXTSAESNIDecryptBlock(ctx, block), tweak);
+		_mm_storeu_si128((__m128i *)(output + offset), block);
+
+		tweak = SMCryptoXTSAESNIMultiplyAlpha(tweak);
+	}
+}
+
+#define SM_XTS_AESNI_KERNEL(Name, Keys, Round, LastRound, Tail)																\
+	__attribute__((target("aes,sse2")))																						\
+	static void Name(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length)	\
+	{																														\
+		const unsigned	rounds = ctx->rounds;																				\
+		size_t			blocks = length / kSMCryptoXTSBlockSize;															\
+		__m128i			tweak = _mm_loadu_si128((const __m128i *)initialTweak);													\
+																															\
+		/* 8 blocks in flight to hide aesenc / aesdec latency. */															\
+		while (blocks >= 8)																									\
+		{																													\
+			__m128i key = _mm_load_si128((const __m128i *)ctx->Keys[0]);													\
+			__m128i t0, t1, t2, t3, t4, t5, t6, t7;																			\
+			__m128i b0, b1, b2, b3, b4, b5, b6, b7;																			\
+																															\
+			t0 = tweak;																										\
+			t1 = SMCryptoXTSAESNIMultiplyAlpha(t0);																			\
+			t2 = SMCryptoXTSAESNIMultiplyAlpha(t1);																			\
+			t3 = SMCryptoXTSAESNIMultiplyAlpha(t2);																			\
+			t4 = SMCryptoXTSAESNIMultiplyAlpha(t3);																			\
+			t5 = SMCryptoXTSAESNIMultiplyAlpha(t4);																			\
+			t6 = SMCryptoXTSAESNIMultiplyAlpha(t5);																			\
+			t7 = SMCryptoXTSAESNIMultiplyAlpha(t6);																			\
+			tweak = SMCryptoXTSAESNIMultiplyAlpha(t7);																		\
+																															\
+			SM_X8(SM_XTS_AESNI_LOAD)																						\
+																															\
+			for (unsigned r = 1; r < rounds; r++)																			\
+			{																												\
+				key = _mm_load_si128((const __m128i *)ctx->Keys[r]);														\
+				SM_X8(Round)																								\
+			}																												\
+																															\
+			key = _mm_load_si128((const __m128i *)ctx->Keys[rounds]);														\
+			SM_X8(LastRound)																								\
+			SM_X8(SM_XTS_AESNI_STORE)																						\
+																															\
+			input += 8 * kSMCryptoXTSBlockSize;																				\
+			output += 8 * kSMCryptoXTSBlockSize;																			\
+			blocks -= 8;																									\
+		}																													\
+																															\
+		/* Remaining blocks. */																								\
+		if (blocks > 0)																										\
+			Tail(ctx, tweak, input, output, blocks * kSMCryptoXTSBlockSize);												\
+	}
+
+#define SM_XTS_AESNI_LOAD(Index)		b##Index = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)input + Index), t##Index), key);
+#define SM_XTS_AESNI_STORE(Index)		_mm_storeu_si128((__m128i *)output + Index, _mm_xor_si128(b##Index, t##Index));
+#define SM_XTS_AESNI_ENC(Index)			b##Index = _mm_aesenc_si128(b##Index, key);
+#define SM_XTS_AESNI_ENCLAST(Index)		b##Index = _mm_aesenclast_si128(b##Index, key);
+#define SM_XTS_AESNI_DEC(Index)			b##Index = _mm_aesdec_si128(b##Index, key);
+#define SM_XTS_AESNI_DECLAST(Index)		b##Index = _mm_aesdeclast_si128(b##Index, key);
+
+SM_XTS_AESNI_KERNEL(SMCryptoXTSAESNIEncrypt, encryptKeys, SM_XTS_AESNI_ENC, SM_XTS_AESNI_ENCLAST, SMCryptoXTSAESNIEncryptTail)
+SM_XTS_AESNI_KERNEL(SMCryptoXTSAESNIDecrypt, decryptKeys, SM_XTS_AESNI_DEC, SM_XTS_AESNI_DECLAST, SMCryptoXTSAESNIDecryptTail)
+
+#pragma mark > VAES
+
+__attribute__((target("vaes,avx2,aes")))
+static inline __m256i SMCryptoXTSVAESMultiplyAlpha(__m256i tweaks)
+{
+	// Same as SMCryptoXTSAESNIMultiplyAlpha, on each 128 bits lane.
+	__m256i carry = _mm256_shuffle_epi32(_mm256_srai_epi32(tweaks, 31), 0x93);
+
+	carry = _mm256_and_si256(carry, _mm256_set_epi32(1, 1, 1, 0x87, 1, 1, 1, 0x87));
+
+	return _mm256_xor_si256(_mm256_slli_epi32(tweaks, 1), carry);
+}
+
+#define SM_XTS_VAES_KERNEL(Name, Keys, Round, LastRound, Tail)																\
+	__attribute__((target("vaes,avx2,aes")))																				\
+	static void Name(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length)	\
+	{																														\
+		const unsigned	rounds = ctx->rounds;																				\
+		size_t			blocks = length / kSMCryptoXTSBlockSize;															\
+		__m128i			tweak = _mm_loadu_si128((const __m128i *)initialTweak);													\
+																															\
+		/* 16 blocks in flight: 8 registers of 2 blocks. */																	\
+		if (blocks >= 16)																									\
+		{																													\
+			__m256i tweaks = _mm256_inserti128_si256(_mm256_castsi128_si256(tweak), SMCryptoXTSAESNIMultiplyAlpha(tweak), 1);	\
+																															\
+			while (blocks >= 16)																							\
+			{																												\
+				__m256i key = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ctx->Keys[0]));					\
+				__m256i t0, t1, t2, t3, t4, t5, t6, t7;																		\
+				__m256i b0, b1, b2, b3, b4, b5, b6, b7;																		\
+																															\
+				t0 = tweaks;																								\
+				t1 = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t0));										\
+				t2 = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t1));										\
+				t3 = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t2));										\
+				t4 = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t3));										\
+				t5 = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t4));										\
+				t6 = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t5));										\
+				t7 = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t6));										\
+				tweaks = SMCryptoXTSVAESMultiplyAlpha(SMCryptoXTSVAESMultiplyAlpha(t7));									\
+																															\
+				SM_X8(SM_XTS_VAES_LOAD)																						\
+																															\
+				for (unsigned r = 1; r < rounds; r++)																		\
+				{																											\
+					key = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ctx->Keys[r]));						\
+					SM_X8(Round)																							\
+				}																											\
+																															\
+				key = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ctx->Keys[rounds]));						\
+				SM_X8(LastRound)																							\
+				SM_X8(SM_XTS_VAES_STORE)																					\
+																															\
+				input += 16 * kSMCryptoXTSBlockSize;																		\
+				output += 16 * kSMCryptoXTSBlockSize;																		\
+				blocks -= 16;																								\
+			}																												\
+																															\
+			tweak = _mm256_castsi256_si128(tweaks);																			\
+		}																													\
+																															\
+		/* Remaining blocks: AES-NI, continuing the tweak sequence. */														\
+		if (blocks > 0)																										\
+			Tail(ctx, tweak, input, output, blocks * kSMCryptoXTSBlockSize);												\
+	}
+
+#define SM_XTS_VAES_LOAD(Index)		b##Index = _mm256_xor_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)input + Index), t##Index), key);
+#define SM_XTS_VAES_STORE(Index)	_mm256_storeu_si256((__m256i *)output + Index, _mm256_xor_si256(b##Index, t##Index));
+#define SM_XTS_VAES_ENC(Index)		b##Index = _mm256_aesenc_epi128(b##Index, key);
+#define SM_XTS_VAES_ENCLAST(Index)	b##Index = _mm256_aesenclast_epi128(b##Index, key);
+#define SM_XTS_VAES_DEC(Index)		b##Index = _mm256_aesdec_epi128(b##Index, key);
+#define SM_XTS_VAES_DECLAST(Index)	b##Index = _mm256_aesdeclast_epi128(b##Index, key);
+
+SM_XTS_VAES_KERNEL(SMCryptoXTSVAESEncrypt, encryptKeys, SM_XTS_VAES_ENC, SM_XTS_VAES_ENCLAST, SMCryptoXTSAESNIEncryptTail)
+SM_XTS_VAES_KERNEL(SMCryptoXTSVAESDecrypt, decryptKeys, SM_XTS_VAES_DEC, SM_XTS_VAES_DECLAST, SMCryptoXTSAESNIDecryptTail)
+
+#pragma mark > AVX-512
+
+__attribute__((target("avx512f,avx512bw,vpclmulqdq")))
+static inline __m512i SMCryptoXTSAVX512MultiplyAlpha4(__m512i tweaks)
+{
+	// Multiply each 128 bits lane by alpha^4: shift by 4, carry the low qword top nibble into the high qword, and reduce the high qword top nibble with a carry-less multiply by 0x87.
+	__m512i carry = _mm512_srli_epi64(tweaks, 60);
+	__m512i reduced = _mm512_clmulepi64_epi128(carry, _mm512_set1_epi64(0x87), 0x01);
+
+	return _mm512_ternarylogic_epi64(_mm512_slli_epi64(tweaks, 4), _mm512_bslli_epi128(carry, 8), reduced, 0x96);
+}
+
+__attribute__((target("avx512f,avx512bw,vaes,aes")))
+static void SMCryptoXTSAVX512Tweaks(const SMCryptoXTSContext *ctx, const uint8_t *ivs, size_t count, uint8_t *tweaks)
+{
+	const __m512i	*input = (const __m512i *)ivs;
+	__m512i			*output = (__m512i *)tweaks;
+	size_t			i = 0;
+
+	// 16 blocks in flight: 4 registers of 4 blocks.
+	for (; i + 16 <= count; i += 16, input += 4, output += 4)
+	{
+		__m512i key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->tweakKeys[0]));
+		__m512i b0 = _mm512_xor_si512(_mm512_loadu_si512(input), key);
+		__m512i b1 = _mm512_xor_si512(_mm512_loadu_si512(input + 1), key);
+		__m512i b2 = _mm512_xor_si512(_mm512_loadu_si512(input + 2), key);
+		__m512i b3 = _mm512_xor_si512(_mm512_loadu_si512(input + 3), key);
+
+		for (unsigned r = 1; r < ctx->rounds; r++)
+		{
+			key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->tweakKeys[r]));
+
+			b0 = _mm512_aesenc_epi128(b0, key);
+			b1 = _mm512_aesenc_epi128(b1, key);
+			b2 = _mm512_aesenc_epi128(b2, key);
+			b3 = _mm512_aesenc_epi128(b3, key);
+		}
+
+		key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->tweakKeys[ctx->rounds]));
+
+		_mm512_storeu_si512(output, _mm512_aesenclast_epi128(b0, key));
+		_mm512_storeu_si512(output + 1, _mm512_aesenclast_epi128(b1, key));
+		_mm512_storeu_si512(output + 2, _mm512_aesenclast_epi128(b2, key));
+		_mm512_storeu_si512(output + 3, _mm512_aesenclast_epi128(b3, key));
+	}
+
+	// Remaining blocks.
+	if (i < count)
+		SMCryptoXTSAESNITweaks(ctx, ivs + i * kSMCryptoXTSBlockSize, count - i, tweaks + i * kSMCryptoXTSBlockSize);
+}
+
+#define SM_X4(Macro)	Macro(0) Macro(1) Macro(2) Macro(3)
+
+#define SM_XTS_AVX512_KERNEL(Name, Keys, Round, LastRound, Tail)															\
+	__attribute__((target("avx512f,avx512bw,vaes,vpclmulqdq,aes")))														\
+	static void Name(const SMCryptoXTSContext *ctx, const uint8_t *initialTweak, const uint8_t *input, uint8_t *output, size_t length)	\
+	{																														\
+		const unsigned	rounds = ctx->rounds;																				\
+		size_t			blocks = length / kSMCryptoXTSBlockSize;															\
+		__m128i			tweak = _mm_loadu_si128((const __m128i *)initialTweak);													\
+																															\
+		if (blocks >= 4)																									\
+		{																													\
+			/* Lanes hold T, T.a, T.a^2, T.a^3; each step multiplies every lane by a^4, so the chain never leaves the registers. */	\
+			__m128i	tweak1 = SMCryptoXTSAESNIMultiplyAlpha(tweak);															\
+			__m128i	tweak2 = SMCryptoXTSAESNIMultiplyAlpha(tweak1);															\
+			__m128i	tweak3 = SMCryptoXTSAESNIMultiplyAlpha(tweak2);															\
+			__m512i	tweaks = _mm512_castsi128_si512(tweak);																	\
+																															\
+			tweaks = _mm512_inserti32x4(tweaks, tweak1, 1);																	\
+			tweaks = _mm512_inserti32x4(tweaks, tweak2, 2);																	\
+			tweaks = _mm512_inserti32x4(tweaks, tweak3, 3);																	\
+																															\
+			/* 16 blocks in flight: 4 registers of 4 blocks. */																\
+			while (blocks >= 16)																							\
+			{																												\
+				__m512i key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->Keys[0]));						\
+				__m512i t0, t1, t2, t3;																						\
+				__m512i b0, b1, b2, b3;																						\
+																															\
+				t0 = tweaks;																								\
+				t1 = SMCryptoXTSAVX512MultiplyAlpha4(t0);																	\
+				t2 = SMCryptoXTSAVX512MultiplyAlpha4(t1);																	\
+				t3 = SMCryptoXTSAVX512MultiplyAlpha4(t2);																	\
+				tweaks = SMCryptoXTSAVX512MultiplyAlpha4(t3);																\
+																															\
+				SM_X4(SM_XTS_AVX512_LOAD)																					\
+																															\
+				for (unsigned r = 1; r < rounds; r++)																		\
+				{																											\
+					key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->Keys[r]));							\
+					SM_X4(Round)																							\
+				}																											\
+																															\
+				key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->Keys[rounds]));							\
+				SM_X4(LastRound)																							\
+				SM_X4(SM_XTS_AVX512_STORE)																					\
+																															\
+				input += 16 * kSMCryptoXTSBlockSize;																		\
+				output += 16 * kSMCryptoXTSBlockSize;																		\
+				blocks -= 16;																								\
+			}																												\
+																															\
+			/* 4 blocks in flight. */																						\
+			while (blocks >= 4)																								\
+			{																												\
+				__m512i key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->Keys[0]));						\
+				__m512i t0 = tweaks;																						\
+				__m512i b0;																									\
+																															\
+				tweaks = SMCryptoXTSAVX512MultiplyAlpha4(t0);																\
+																															\
+				SM_XTS_AVX512_LOAD(0)																						\
+																															\
+				for (unsigned r = 1; r < rounds; r++)																		\
+				{																											\
+					key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->Keys[r]));							\
+					Round(0)																								\
+				}																											\
+																															\
+				key = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)ctx->Keys[rounds]));							\
+				LastRound(0)																								\
+				SM_XTS_AVX512_STORE(0)																						\
+																															\
+				input += 4 * kSMCryptoXTSBlockSize;																			\
+				output += 4 * kSMCryptoXTSBlockSize;																		\
+				blocks -= 4;																								\
+			}																												\
+																															\
+			tweak = _mm512_castsi512_si128(tweaks);																			\
+		}																													\
+																															\
+		/* Remaining blocks: AES-NI, continuing the tweak sequence. */														\
+		if (blocks > 0)																										\
+			Tail(ctx, tweak, input, output, blocks * kSMCryptoXTSBlockSize);												\
+	}
+
+#define SM_XTS_AVX512_LOAD(Index)		b##Index = _mm512_ternarylogic_epi64(_mm512_loadu_si512((const __m512i *)input + Index), t##Index, key, 0x96);
+#define SM_XTS_AVX512_STORE(Index)		_mm512_storeu_si512((__m512i *)output + Index, _mm512_xor_si512(b##Index, t##Index));
+#define SM_XTS_AVX512_ENC(Index)		b##Index = _mm512_aesenc_epi128(b##Index, key);
+#define SM_XTS_AVX512_ENCLAST(Index)	b##Index = _mm512_aesenclast_epi128(b##Index, key);
+#define SM_XTS_AVX512_DEC(Index)		b##Index = _mm512_aesdec_epi128(b##Index, key);
+#define SM_XTS_AVX512_DECLAST(Index)	b##Index = _mm512_aesdeclast_epi128(b##Index, key);
+
+SM_XTS_AVX512_KERNEL(SMCryptoXTSAVX512Encrypt, encryptKeys, SM_XTS_AVX512_ENC, SM_XTS_AVX512_ENCLAST, SMCryptoXTSAESNIEncryptTail)
+SM_XTS_AVX512_KERNEL(SMCryptoXTSAVX512Decrypt, decryptKeys, SM_XTS_AVX512_DEC, SM_XTS_AVX512_DECLAST, SMCryptoXTSAESNIDecryptTail)
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * SMCryptoXTS.h
+ *
+ * Copyright 2021 Avérous Julien-Pierre
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * -- Informations --
+ *
+ * Built-in AES-XTS engine (IEEE 1619), used by SMCryptoFile to crypt / decrypt data blocks.
+ *
+ * The engine selects at runtime the fastest kernel supported by the CPU (AES-NI, VAES, AVX-512), with a constant-time bitsliced C fallback.
+ * Output is bit-for-bit compatible with CommonCrypto kCCModeXTS.
+ *
+ */
+
+
+#ifndef SMCRYPTOXTS_H_
+# define SMCRYPTOXTS_H_
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stddef.h>
+
+
+/*
+** Defines
+*/
+#pragma mark - Defines
+
+#define kSMCryptoXTSBlockSize	16	// AES block size.
+#define kSMCryptoXTSMaxRounds	14	// AES 256 rounds.
+
+
+
+/*
+** Types
+*/
+#pragma mark - Types
+
+typedef enum
+{
+	SMCryptoXTSEngineReference,	// Scalar reference implementation (portable C, table based).
+	SMCryptoXTSEngineBitsliced,	// Constant-time bitsliced implementation (portable C), 8 blocks at once.
+	SMCryptoXTSEngineAESNI,		// x86 AES-NI, 8 blocks in flight.
+	SMCryptoXTSEngineVAES,		// x86 VAES + AVX2, 16 blocks in flight.
+	SMCryptoXTSEngineAVX512,	// x86 VAES + VPCLMULQDQ + AVX-512, 16 blocks in flight, tweaks computed 4 by 4 in registers.
+} SMCryptoXTSEngine;
+
+typedef struct SMCryptoXTSContext
+{
+	uint8_t		encryptKeys[kSMCryptoXTSMaxRounds + 1][kSMCryptoXTSBlockSize] __attribute__ ((aligned(16)));	// Data key schedule.
+	uint8_t		decryptKeys[kSMCryptoXTSMaxRounds + 1][kSMCryptoXTSBlockSize] __attribute__ ((aligned(16)));	// Data key schedule for the equivalent inverse cipher.
+	uint8_t		tweakKeys[kSMCryptoXTSMaxRounds + 1][kSMCryptoXTSBlockSize] __attribute__ ((aligned(16)));		// Tweak key schedule.
+
+	uint64_t	bitsliceEncryptKeys[kSMCryptoXTSMaxRounds + 1][16];	// Bitsliced key schedules (see SMCryptoXTSEngineBitsliced).
+	uint64_t	bitsliceDecryptKeys[kSMCryptoXTSMaxRounds + 1][16];
+	uint64_t	bitsliceTweakKeys[kSMCryptoXTSMaxRounds + 1][16];
+
+	unsigned	rounds;	// 10, 12 or 14.
+} SMCryptoXTSContext;
+
+
+
+/*
+** Functions
+*/
+#pragma mark - Functions
+
+// -- Engine --
+SMCryptoXTSEngine	SMCryptoXTSCurrentEngine(void); // Engine selected for this CPU.
+const char *		SMCryptoXTSEngineName(SMCryptoXTSEngine engine);
+bool				SMCryptoXTSEngineIsAvailable(SMCryptoXTSEngine engine);		// The engine can run on this CPU.
+bool				SMCryptoXTSEngineIsAccelerated(SMCryptoXTSEngine engine);	// The engine uses hardware AES instructions.
+
+// -- Context --
+bool	SMCryptoXTSContextInit(SMCryptoXTSContext *ctx, const void *dataKey, const void *tweakKey, size_t keySize); // keySize is 16, 24 or 32 bytes (for each key).
+void	SMCryptoXTSContextClean(SMCryptoXTSContext *ctx);
+
+// -- Crypt / Decrypt --
+void	SMCryptoXTSEncrypt(const SMCryptoXTSContext *ctx, const void *iv, const void *input, size_t length, void *output); // iv is the 16 bytes data-unit tweak. length should be a multiple of kSMCryptoXTSBlockSize.
+void	SMCryptoXTSDecrypt(const SMCryptoXTSContext *ctx, const void *iv, const void *input, size_t length, void *output);
+
+void	SMCryptoXTSEncryptUnits(const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output); // Crypt consecutive data-units; the tweak of unit n is n (little-endian). length should be a multiple of unitSize.
+void	SMCryptoXTSDecryptUnits(const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+
+// -- Crypt / Decrypt with a specific engine (cross-checks, benchmarks) --
+bool	SMCryptoXTSEncryptUnitsWithEngine(SMCryptoXTSEngine engine, const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output); // Return false if the engine is not available.
+bool	SMCryptoXTSDecryptUnitsWithEngine(SMCryptoXTSEngine engine, const SMCryptoXTSContext *ctx, uint64_t firstUnit, size_t unitSize, const void *input, size_t length, void *output);
+
+#endif
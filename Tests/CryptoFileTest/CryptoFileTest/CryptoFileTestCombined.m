@@ -285,6 +285,39 @@
 }
 
 
+#pragma mark Combined random access / cache slots
+
+- (void)testCombined_RandomAccess_CacheSize4096_CacheSlots1
+{
+	[self doTestRandomAccessWithCacheSize:4096 cacheSlots:1 positional:NO noCache:NO];
+}
+
+- (void)testCombined_RandomAccess_CacheSize16384_CacheSlots4
+{
+	[self doTestRandomAccessWithCacheSize:16384 cacheSlots:4 positional:NO noCache:NO];
+}
+
+- (void)testCombined_RandomAccess_CacheSize65536_CacheSlots256
+{
+	[self doTestRandomAccessWithCacheSize:65536 cacheSlots:256 positional:NO noCache:NO];
+}
+
+- (void)testCombined_RandomAccess_CacheSize1048576_CacheSlotsAuto
+{
+	[self doTestRandomAccessWithCacheSize:1048576 cacheSlots:0 positional:NO noCache:NO];
+}
+
+- (void)testCombined_RandomAccess_CacheSize65536_CacheSlots16_Positional
+{
+	[self doTestRandomAccessWithCacheSize:65536 cacheSlots:16 positional:YES noCache:NO];
+}
+
+- (void)testCombined_RandomAccess_CacheSize65536_CacheSlots16_NoCache
+{
+	[self doTestRandomAccessWithCacheSize:65536 cacheSlots:16 positional:NO noCache:YES];
+}
+
+
 
 /*
 ** CryptoFileTestCombined - Helpers
@@ -1213,4 +1246,132 @@ clean:
 	unlink(stdPath);
 }
 
+- (void)doTestRandomAccessWithCacheSize:(uint32_t)cacheSize cacheSlots:(uint32_t)cacheSlots positional:(BOOL)positional noCache:(BOOL)noCache
+{
+	// Random reads, writes and truncates on a file larger than the cache, compared with an in-memory model. Positional reads and writes should not move the current position.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .cacheSize = cacheSize, .cacheSlots = cacheSlots, .noCache = noCache };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const uint32_t		maxSize = 256 * 1024;
+	NSMutableData		*model = [NSMutableData dataWithLength:maxSize];
+	uint8_t				*modelBytes = model.mutableBytes;
+	uint64_t			modelSize = 0;
+	uint8_t				*buffer = malloc(maxSize);
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Random operations.
+	for (unsigned i = 0; i < 2000; i++)
+	{
+		uint32_t operation = arc4random_uniform(100);
+		uint32_t offset = arc4random_uniform(maxSize);
+		uint32_t size = MIN(arc4random_uniform(8 * 1024), maxSize - offset);
+		
+		uint64_t position = positional ? arc4random_uniform(maxSize) : offset;
+		
+		if (SMCryptoFileSeek(file, (int64_t)position, SMCryptoFileSeekSet, &error) == false)
+		{
+			XCTFail(@"Can't seek (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		if (operation < 45)
+		{
+			// > Write.
+			bool result;
+			
+			arc4random_buf(buffer, size);
+			
+			if (positional)
+				result = SMCryptoFilePWrite(file, buffer, size, offset, &error);
+			else
+				result = SMCryptoFileWrite(file, buffer, size, &error);
+			
+			if (result == false)
+			{
+				XCTFail(@"Can't write (%@)", [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			memcpy(modelBytes + offset, buffer, size);
+			
+			if (size > 0 && offset + size > modelSize)
+				modelSize = offset + size;
+		}
+		else if (operation < 95)
+		{
+			// > Read.
+			uint64_t	expectedSize = (offset >= modelSize) ? 0 : MIN(size, modelSize - offset);
+			int64_t		readSize = positional ? SMCryptoFilePRead(file, buffer, size, offset, &error) : SMCryptoFileRead(file, buffer, size, &error);
+			
+			if (readSize != (int64_t)expectedSize)
+			{
+				XCTFail(@"Invalid read size - readSize: %lld; expectedSize: %llu", readSize, expectedSize);
+				goto clean;
+			}
+			
+			if (memcmp(buffer, modelBytes + offset, expectedSize) != 0)
+			{
+				XCTFail(@"Read data are different from written data - offset: %u; size: %llu", offset, expectedSize);
+				goto clean;
+			}
+		}
+		else
+		{
+			// > Truncate.
+			if (SMCryptoFileTruncate(file, offset, &error) == false)
+			{
+				XCTFail(@"Can't truncate (%@)", [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			if (offset < modelSize)
+				memset(modelBytes + offset, 0, modelSize - offset);
+			
+			modelSize = offset;
+		}
+		
+		// > Check position.
+		if (positional && SMCryptoFileTell(file) != position)
+		{
+			XCTFail(@"Positional operation moved the current position - position: %llu; tell: %llu", position, SMCryptoFileTell(file));
+			goto clean;
+		}
+	}
+	
+	// Reopen and compare.
+	if (SMCryptoFileClose(file, &error) == false)
+	{
+		file = NULL;
+		XCTFail(@"Can't close file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = SMCryptoFileOpenWithOptions(path, pass, true, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileRead(file, buffer, maxSize, &error) != (int64_t)modelSize || memcmp(buffer, modelBytes, modelSize) != 0)
+		XCTFail(@"Reopened file content is different from written data");
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	free(buffer);
+}
+
 @end
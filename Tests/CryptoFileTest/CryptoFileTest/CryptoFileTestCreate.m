@@ -19,6 +19,8 @@
 
 #import <XCTest/XCTest.h>
 
+#include <sys/stat.h>
+
 #import "SMCryptoFile.h"
 #import "TestHelper.h"
 
@@ -155,6 +157,66 @@ clean:
 	unlink(path);
 }
 
+- (void)testCreate_BadArgumentBlockSize
+{
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	const uint32_t		blockSizes[] = { 16, 128, 300, 4095, 128 * 1024 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	
+	for (size_t i = 0; i < sizeof(blockSizes) / sizeof(blockSizes[0]); i++)
+	{
+		SMCryptoFileOptions options = { .blockSize = blockSizes[i] };
+		
+		file = SMCryptoFileCreateWithOptions(path, "azerty", SMCryptoFileKeySize256, &options, &error);
+		
+		if (file)
+		{
+			XCTFail(@"Can create a file with a bad block size (%u)", blockSizes[i]);
+			goto clean;
+		}
+		else if (error != SMCryptoFileErrorArguments)
+		{
+			XCTFail(@"The error returned should be SMCryptoFileErrorArguments (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)testCreate_BadArgumentDataAlignment
+{
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	const uint32_t		dataAlignments[] = { 1, 256, 1000, 4095, 128 * 1024 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	
+	for (size_t i = 0; i < sizeof(dataAlignments) / sizeof(dataAlignments[0]); i++)
+	{
+		SMCryptoFileOptions options = { .dataAlignment = dataAlignments[i] };
+		
+		file = SMCryptoFileCreateWithOptions(path, "azerty", SMCryptoFileKeySize256, &options, &error);
+		
+		if (file)
+		{
+			XCTFail(@"Can create a file with a bad data alignment (%u)", dataAlignments[i]);
+			goto clean;
+		}
+		else if (error != SMCryptoFileErrorArguments)
+		{
+			XCTFail(@"The error returned should be SMCryptoFileErrorArguments (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
 
 #pragma mark Operations
 
@@ -239,6 +301,122 @@ clean:
 	unlink(path);
 }
 
+- (void)testCreate_BlockSize
+{
+	const uint32_t	blockSizes[] = { 256, 512, 4096, 65536 };
+	const char		*password = "azerty";
+	uint8_t			wbuffer[150000];
+	uint8_t			rbuffer[sizeof(wbuffer)];
+	
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	for (size_t i = 0; i < sizeof(blockSizes) / sizeof(blockSizes[0]); i++)
+	{
+		const char			*path = [[TestHelper generateTempPath] UTF8String];
+		SMCryptoFileOptions	options = { .blockSize = blockSizes[i] };
+		SMCryptoFileError	error;
+		SMCryptoFile		*file;
+		
+		// Create, and write at unaligned offsets.
+		file = SMCryptoFileCreateWithOptions(path, password, SMCryptoFileKeySize256, &options, &error);
+		
+		if (!file)
+		{
+			XCTFail(@"Can't create file with block size %u (%@)", blockSizes[i], [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		XCTAssertEqual(SMCryptoFileBlockSize(file), blockSizes[i]);
+		
+		if (SMCryptoFileSeek(file, 1000, SMCryptoFileSeekSet, &error) == false || SMCryptoFileWrite(file, wbuffer + 1000, sizeof(wbuffer) - 1000, &error) == false)
+		{
+			XCTFail(@"Can't write file with block size %u (%@)", blockSizes[i], [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		if (SMCryptoFileSeek(file, 0, SMCryptoFileSeekSet, &error) == false || SMCryptoFileWrite(file, wbuffer, 1000, &error) == false)
+		{
+			XCTFail(@"Can't write file with block size %u (%@)", blockSizes[i], [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		SMCryptoFileClose(file, NULL);
+		
+		// Re-open: the block size is read from the file.
+		file = SMCryptoFileOpen(path, password, true, &error);
+		
+		if (!file)
+		{
+			XCTFail(@"Can't open file with block size %u (%@)", blockSizes[i], [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		XCTAssertEqual(SMCryptoFileBlockSize(file), blockSizes[i]);
+		XCTAssertEqual(SMCryptoFileRead(file, rbuffer, sizeof(rbuffer), &error), (int64_t)sizeof(rbuffer));
+		XCTAssertEqual(memcmp(wbuffer, rbuffer, sizeof(wbuffer)), 0, @"Invalid content with block size %u", blockSizes[i]);
+		
+	clean:
+		SMCryptoFileClose(file, NULL);
+		unlink(path);
+	}
+}
+
+- (void)testCreate_DataAlignment
+{
+	const uint32_t	dataAlignments[] = { 512, 4096, 65536 };
+	const char		*password = "azerty";
+	uint8_t			wbuffer[150000];
+	uint8_t			rbuffer[sizeof(wbuffer)];
+	
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	for (size_t i = 0; i < sizeof(dataAlignments) / sizeof(dataAlignments[0]); i++)
+	{
+		const char			*path = [[TestHelper generateTempPath] UTF8String];
+		SMCryptoFileOptions	options = { .blockSize = 4096, .dataAlignment = dataAlignments[i] };
+		SMCryptoFileError	error;
+		SMCryptoFile		*file;
+		struct stat			st;
+		
+		// Create, and write.
+		file = SMCryptoFileCreateWithOptions(path, password, SMCryptoFileKeySize256, &options, &error);
+		
+		if (!file)
+		{
+			XCTFail(@"Can't create file with data alignment %u (%@)", dataAlignments[i], [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		if (SMCryptoFileWrite(file, wbuffer, sizeof(wbuffer), &error) == false)
+		{
+			XCTFail(@"Can't write file with data alignment %u (%@)", dataAlignments[i], [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		SMCryptoFileClose(file, NULL);
+		
+		// Check the file size: aligned data area, followed by whole blocks.
+		XCTAssertEqual(stat(path, &st), 0);
+		XCTAssertEqual(st.st_size, (off_t)(dataAlignments[i] + 37 * 4096));
+		
+		// Re-open: the layout is read from the file.
+		file = SMCryptoFileOpen(path, password, true, &error);
+		
+		if (!file)
+		{
+			XCTFail(@"Can't open file with data alignment %u (%@)", dataAlignments[i], [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		XCTAssertEqual(SMCryptoFileRead(file, rbuffer, sizeof(rbuffer), &error), (int64_t)sizeof(rbuffer));
+		XCTAssertEqual(memcmp(wbuffer, rbuffer, sizeof(wbuffer)), 0, @"Invalid content with data alignment %u", dataAlignments[i]);
+		
+	clean:
+		SMCryptoFileClose(file, NULL);
+		unlink(path);
+	}
+}
+
 - (void)testCreate_Impersonated
 {
 	const char			*password = "mlkezldkqs654qs8";
@@ -410,6 +588,49 @@ clean:
 	SMCryptoFileClose(file, NULL);
 }
 
+- (void)testCreate_VolatileNoPathAuthenticated
+{
+	// Volatile authenticated file: the side file is temporary too.
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file;
+	uint8_t				wbuffer[3 * 4096 + 700];
+	uint8_t				rbuffer[3 * 4096 + 700];
+	
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	// Create file.
+	file = SMCryptoFileCreateVolatileWithOptions(NULL, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create volatile file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Write, commit, and rewrite part of a committed block.
+	if (SMCryptoFileWrite(file, wbuffer, sizeof(wbuffer), &error) == false || SMCryptoFileFlush(file, SMCryptoFileSyncNo, &error) == false)
+	{
+		XCTFail(@"Can't write bytes (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFilePWrite(file, wbuffer, 100, 5000, &error) == false)
+	{
+		XCTFail(@"Can't write bytes (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	memcpy(wbuffer + 5000, wbuffer, 100);
+	
+	// Read, and compare.
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, sizeof(rbuffer), 0, &error), (int64_t)sizeof(rbuffer));
+	XCTAssertEqual(memcmp(rbuffer, wbuffer, sizeof(rbuffer)), 0);
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+}
+
 - (void)testCreate_VolatilePath
 {
 	const char			*path = [[TestHelper generateTempPath] UTF8String];
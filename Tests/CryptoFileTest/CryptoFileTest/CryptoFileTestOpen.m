@@ -19,6 +19,8 @@
 
 #import <XCTest/XCTest.h>
 
+#include <fcntl.h>
+
 #import "SMCryptoFile.h"
 #import "TestHelper.h"
 
@@ -315,6 +317,323 @@ clean:
 	if (path) unlink(path);
 }
 
+- (void)testOpen_DualHeaderTorn
+{
+	// Damage the newest header slot, as a torn write would, and check the previous one is used.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .dualHeader = true };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	int					fd = -1;
+	uint8_t				byte;
+	
+	// Create file, commit a first length, then a second one.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, "0123456789", 10, &error) == false || SMCryptoFileFlush(file, SMCryptoFileSyncNormal, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, "abcdef", 6, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = NULL;
+	
+	// Damage the newest slot: generation 4 (2 written on creation, 2 commits), so the first slot, right after the 45 bytes prefix.
+	fd = open(path, O_RDWR);
+	
+	if (fd == -1 || pread(fd, &byte, 1, 45 + 20) != 1)
+	{
+		XCTFail(@"Can't read header slot.");
+		goto clean;
+	}
+	
+	byte ^= 0x01;
+	
+	if (pwrite(fd, &byte, 1, 45 + 20) != 1)
+	{
+		XCTFail(@"Can't damage header slot.");
+		goto clean;
+	}
+	
+	// Open: the first commit should be found.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file with a torn header slot (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileSize(file) != 10)
+	{
+		XCTFail(@"Invalid file size (%llu)", SMCryptoFileSize(file));
+		goto clean;
+	}
+	
+clean:
+	if (fd != -1) close(fd);
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)testOpen_AuthenticatedPreviousHeader
+{
+	// Put back the header of a first commit over the one of a second commit, as a crash before its header write would leave it, and check the first tree is used.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	uint8_t				wbuffer[24 * 4096];
+	uint8_t				rbuffer[16 * 4096];
+	uint8_t				header[144]; // Authenticated header, right after the 45 bytes prefix.
+	int					fd = -1;
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	// Create file, commit 16 blocks, and save the header.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, wbuffer, 16 * 4096, &error) == false || SMCryptoFileFlush(file, SMCryptoFileSyncNormal, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	fd = open(path, O_RDWR);
+	
+	if (fd == -1 || pread(fd, header, sizeof(header), 45) != sizeof(header))
+	{
+		XCTFail(@"Can't read header.");
+		goto clean;
+	}
+	
+	// Append 8 blocks, rewrite block 2, and commit.
+	if (SMCryptoFileWrite(file, wbuffer + 16 * 4096, 8 * 4096, &error) == false || SMCryptoFilePWrite(file, wbuffer, 4096, 2 * 4096, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = NULL;
+	
+	// Put the first header back.
+	if (pwrite(fd, header, sizeof(header), 45) != sizeof(header))
+	{
+		XCTFail(@"Can't write header.");
+		goto clean;
+	}
+	
+	// Open: the first commit should be found, only the rewritten block doesn't authenticate.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file with the previous header (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileSize(file) != 16 * 4096)
+	{
+		XCTFail(@"Invalid file size (%llu)", SMCryptoFileSize(file));
+		goto clean;
+	}
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, 2 * 4096, 0, &error), (int64_t)(2 * 4096));
+	XCTAssertEqual(memcmp(rbuffer, wbuffer, 2 * 4096), 0);
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, 13 * 4096, 3 * 4096, &error), (int64_t)(13 * 4096));
+	XCTAssertEqual(memcmp(rbuffer, wbuffer + 3 * 4096, 13 * 4096), 0);
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, 4096, 2 * 4096, &error), -1);
+	XCTAssertEqual(error, SMCryptoFileErrorIntegrity);
+	
+clean:
+	if (fd != -1) close(fd);
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+}
+
+- (void)testOpen_AuthenticatedTreeAreaLost
+{
+	// Put back the page hashes areas of a first commit under the header of a second commit, as a header reaching the disk before the side file would leave them (what syncing the side file before the header write rules out), and check it's detected.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	uint8_t				wbuffer[24 * 4096];
+	uint8_t				areas[2 * 4096];	// Page hashes areas of the first capacity, after its 16 leaf pages copies.
+	off_t				areasOffset = 2 * 16 * 4096;
+	int					fd = -1;
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	memset(areas, 0, sizeof(areas));
+	
+	// Create file, commit 16 blocks, and save the areas (the spare one may not be written yet).
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, wbuffer, 16 * 4096, &error) == false || SMCryptoFileFlush(file, SMCryptoFileSyncNormal, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	fd = open(treePath, O_RDWR);
+	
+	if (fd == -1 || pread(fd, areas, sizeof(areas), areasOffset) == -1)
+	{
+		XCTFail(@"Can't read tree areas.");
+		goto clean;
+	}
+	
+	// Append 8 blocks, and commit.
+	if (SMCryptoFileWrite(file, wbuffer + 16 * 4096, 8 * 4096, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = NULL;
+	
+	// Put the first areas back.
+	if (pwrite(fd, areas, sizeof(areas), areasOffset) != sizeof(areas))
+	{
+		XCTFail(@"Can't write tree areas.");
+		goto clean;
+	}
+	
+	// Open: the tree doesn't match the header root anymore.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (file)
+	{
+		XCTFail(@"Can open a file with a header newer than its tree.");
+		goto clean;
+	}
+	
+	XCTAssertEqual(error, SMCryptoFileErrorIntegrity);
+	
+clean:
+	if (fd != -1) close(fd);
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+}
+
+#pragma mark Backends
+
+- (void)testOpen_Backends
+{
+	// Each backend should read files written by any other backend.
+	const SMCryptoFileBackend backends[] = { SMCryptoFileBackendCommonCrypto, SMCryptoFileBackendBuiltin, SMCryptoFileBackendReference, SMCryptoFileBackendOpenSSL };
+	const size_t backendsCount = sizeof(backends) / sizeof(backends[0]);
+	
+	const char		*pass = "azerty";
+	uint8_t			wbuffer[10000];
+	uint8_t			rbuffer[sizeof(wbuffer)];
+	
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	for (size_t w = 0; w < backendsCount; w++)
+	{
+		for (size_t r = 0; r < backendsCount; r++)
+		{
+			const char			*path = [[TestHelper generateTempPath] UTF8String];
+			SMCryptoFileError	error;
+			SMCryptoFile		*file;
+			
+			SMCryptoFileOptions	woptions = { .backend = backends[w] };
+			SMCryptoFileOptions	roptions = { .backend = backends[r] };
+			
+			// Create a file.
+			file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize192, &woptions, &error);
+			
+			if (SMCryptoFileBackendIsAvailable(backends[w]) == false)
+			{
+				XCTAssertTrue(file == NULL && error == SMCryptoFileErrorArguments, @"Unavailable backend should not be usable");
+				
+				SMCryptoFileClose(file, NULL);
+				unlink(path);
+				
+				break;
+			}
+			
+			if (!file)
+			{
+				XCTFail(@"Can't create file with backend %s (%@)", SMCryptoFileBackendName(backends[w]), [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			XCTAssertEqual(SMCryptoFileGetBackend(file), backends[w]);
+			
+			if (SMCryptoFileWrite(file, wbuffer, sizeof(wbuffer), &error) == false)
+			{
+				XCTFail(@"Can't write file with backend %s (%@)", SMCryptoFileBackendName(backends[w]), [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			SMCryptoFileClose(file, NULL);
+			file = NULL;
+			
+			// Open the file.
+			if (SMCryptoFileBackendIsAvailable(backends[r]) == false)
+				goto clean;
+			
+			file = SMCryptoFileOpenWithOptions(path, pass, true, &roptions, &error);
+			
+			if (!file)
+			{
+				XCTFail(@"Can't open file with backend %s (%@)", SMCryptoFileBackendName(backends[r]), [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			// Read and compare.
+			if (SMCryptoFileRead(file, rbuffer, sizeof(rbuffer), &error) != sizeof(rbuffer))
+			{
+				XCTFail(@"Can't read file with backend %s (%@)", SMCryptoFileBackendName(backends[r]), [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			XCTAssertEqual(memcmp(wbuffer, rbuffer, sizeof(wbuffer)), 0, @"Data written with backend %s and read with backend %s differ", SMCryptoFileBackendName(backends[w]), SMCryptoFileBackendName(backends[r]));
+			
+		clean:
+			SMCryptoFileClose(file, NULL);
+			unlink(path);
+		}
+	}
+}
+
 
 
 @end
@@ -20,6 +20,7 @@
 #import <XCTest/XCTest.h>
 
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #import "SMCryptoFile.h"
 #import "TestHelper.h"
@@ -190,6 +191,319 @@ clean:
 }
 
 
+#pragma mark Cache size
+
+- (void)testRead_CacheSize_BadArgument
+{
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .cacheSize = 1024 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = SMCryptoFileCreateWithOptions(path, "azerty", SMCryptoFileKeySize256, &options, &error);
+	
+	if (file)
+		XCTFail(@"Can create a file with a too small cache");
+	else if (error != SMCryptoFileErrorArguments)
+		XCTFail(@"The error returned should be SMCryptoFileErrorArguments (%@)", [TestHelper stringWithError:error]);
+	
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)testRead_CacheSize1MiB_Reopen_FileSize3000000_ChunkSize100000
+{
+	[self doTestReadForFileSize:3000000 chunkSize:100000 reopen:YES cacheSize:1024 * 1024];
+}
+
+- (void)testRead_CacheSize1MiB_Seek_FileSize3000000_ChunkSize1000
+{
+	[self doTestReadForFileSize:3000000 chunkSize:1000 reopen:NO cacheSize:1024 * 1024];
+}
+
+- (void)testRead_CacheSize5000_Reopen_FileSize10000_ChunkSize10
+{
+	[self doTestReadForFileSize:10000 chunkSize:10 reopen:YES cacheSize:5000];
+}
+
+- (void)testRead_CacheSize1MiB_Performance
+{
+	// Sequential read of 32 MiB, 1 MiB cache.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .cacheSize = 1024 * 1024 };
+	SMCryptoFileError	error;
+	size_t				length = 32 * 1024 * 1024;
+	NSMutableData		*data = [NSMutableData dataWithLength:length];
+	SMCryptoFile		*file = SMCryptoFileCreateWithOptions(path, "azerty", SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create file (%@)", [TestHelper stringWithError:error]);
+		return;
+	}
+	
+	XCTAssertEqual(SMCryptoFileCacheSize(file), options.cacheSize);
+	XCTAssertTrue(SMCryptoFileWrite(file, data.bytes, length, &error));
+	
+	[self measureBlock:^{
+		SMCryptoFileSeek(file, 0, SMCryptoFileSeekSet, NULL);
+		SMCryptoFileRead(file, data.mutableBytes, length, NULL);
+	}];
+	
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+#pragma mark Read-ahead
+
+- (void)testRead_ReadAhead_Sequential_ChunkSize10000
+{
+	[self doTestReadAheadWithChunkSize:10000 stride:10000 readAheadSlots:0];
+}
+
+- (void)testRead_ReadAhead_Sequential_ChunkSize100000
+{
+	[self doTestReadAheadWithChunkSize:100000 stride:100000 readAheadSlots:8];
+}
+
+- (void)testRead_ReadAhead_Strided_ChunkSize4096_Stride200000
+{
+	[self doTestReadAheadWithChunkSize:4096 stride:200000 readAheadSlots:4];
+}
+
+- (void)testRead_ReadAhead_Disabled
+{
+	[self doTestReadAheadWithChunkSize:10000 stride:10000 readAheadSlots:SMCryptoFileReadAheadDisabled];
+}
+
+
+#pragma mark Large reads
+
+- (void)testRead_Large_CacheSize4096
+{
+	[self doTestLargeReadWithCacheSize:4096 blockSize:0];
+}
+
+- (void)testRead_Large_CacheSize65536_BlockSize4096
+{
+	[self doTestLargeReadWithCacheSize:65536 blockSize:4096];
+}
+
+
+#pragma mark Mapped
+
+- (void)testRead_Mapped_CacheSize4096
+{
+	[self doTestMappedReadWithCacheSize:4096 blockSize:0];
+}
+
+- (void)testRead_Mapped_CacheSize1MiB_BlockSize4096
+{
+	[self doTestMappedReadWithCacheSize:1024 * 1024 blockSize:4096];
+}
+
+
+#pragma mark Authenticated
+
+- (void)testRead_Authenticated_Tampered
+{
+	// Change a byte of a data block on disk, and check the block is rejected while the others are still readable.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	uint8_t				wbuffer[16 * 4096];
+	uint8_t				rbuffer[4096];
+	off_t				offset = 45 + 144 + 5 * 4096 + 100; // v4 prefix, authenticated header, block 5.
+	int					fd = -1;
+	uint8_t				byte;
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, wbuffer, sizeof(wbuffer), &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = NULL;
+	
+	// Damage block 5.
+	fd = open(path, O_RDWR);
+	
+	if (fd == -1 || pread(fd, &byte, 1, offset) != 1)
+	{
+		XCTFail(@"Can't read data block.");
+		goto clean;
+	}
+	
+	byte ^= 0x01;
+	
+	if (pwrite(fd, &byte, 1, offset) != 1)
+	{
+		XCTFail(@"Can't damage data block.");
+		goto clean;
+	}
+	
+	// Open: other blocks are readable, block 5 is rejected.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, sizeof(rbuffer), 12 * 4096, &error), (int64_t)sizeof(rbuffer));
+	XCTAssertEqual(memcmp(rbuffer, wbuffer + 12 * 4096, sizeof(rbuffer)), 0);
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, sizeof(rbuffer), 5 * 4096, &error), -1);
+	XCTAssertEqual(error, SMCryptoFileErrorIntegrity);
+	
+clean:
+	if (fd != -1) close(fd);
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+}
+
+- (void)testRead_Authenticated_TreeTampered
+{
+	// Change the hash of a block in the side file, and check the blocks of its leaf page are rejected.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	uint8_t				wbuffer[16 * 4096];
+	uint8_t				rbuffer[4096];
+	off_t				offset = 4096 + 5 * 32 + 3; // Leaf page 0, copy 1 (first commit), hash of block 5.
+	int					fd = -1;
+	uint8_t				byte;
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, wbuffer, sizeof(wbuffer), &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = NULL;
+	
+	// Damage the hash of block 5.
+	fd = open(treePath, O_RDWR);
+	
+	if (fd == -1 || pread(fd, &byte, 1, offset) != 1)
+	{
+		XCTFail(@"Can't read tree leaf page.");
+		goto clean;
+	}
+	
+	byte ^= 0x01;
+	
+	if (pwrite(fd, &byte, 1, offset) != 1)
+	{
+		XCTFail(@"Can't damage tree leaf page.");
+		goto clean;
+	}
+	
+	// Open: the leaf page doesn't match its page hash anymore.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, sizeof(rbuffer), 5 * 4096, &error), -1);
+	XCTAssertEqual(error, SMCryptoFileErrorIntegrity);
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, sizeof(rbuffer), 12 * 4096, &error), -1);
+	XCTAssertEqual(error, SMCryptoFileErrorIntegrity);
+	
+clean:
+	if (fd != -1) close(fd);
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+}
+
+- (void)testRead_Authenticated_Sparse
+{
+	// Write both ends of a sparse authenticated file, and check the holes authenticate and read as zeros.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .sparse = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	uint8_t				wbuffer[2 * 4096];
+	uint8_t				rbuffer[11 * 4096];
+	uint8_t				zeros[9 * 4096];
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	memset(zeros, 0, sizeof(zeros));
+	
+	// Create file, and write blocks 0 and 10.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFilePWrite(file, wbuffer, 4096, 0, &error) == false || SMCryptoFilePWrite(file, wbuffer + 4096, 4096, 10 * 4096, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Reopen, and read everything.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, sizeof(rbuffer), 0, &error), (int64_t)sizeof(rbuffer));
+	XCTAssertEqual(memcmp(rbuffer, wbuffer, 4096), 0);
+	XCTAssertEqual(memcmp(rbuffer + 4096, zeros, sizeof(zeros)), 0);
+	XCTAssertEqual(memcmp(rbuffer + 10 * 4096, wbuffer + 4096, 4096), 0);
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+}
+
+
 #pragma mark End-of-File
 
 - (void)testRead_EmptyFile_EOF
@@ -329,19 +643,25 @@ clean:
 #pragma mark - CryptoFileTestRead - Helper
 
 - (void)doTestReadForFileSize:(unsigned)fileSize chunkSize:(unsigned)chunkSize reopen:(BOOL)reopen
+{
+	[self doTestReadForFileSize:fileSize chunkSize:chunkSize reopen:reopen cacheSize:0];
+}
+
+- (void)doTestReadForFileSize:(unsigned)fileSize chunkSize:(unsigned)chunkSize reopen:(BOOL)reopen cacheSize:(uint32_t)cacheSize
 {
 	const char			*path = [[TestHelper generateTempPath] UTF8String];
 	SMCryptoFileError	error;
 	SMCryptoFile		*file = NULL;
 	
 	const char			*pass = "azerty";
+	SMCryptoFileOptions	options = { .cacheSize = cacheSize };
 	
 	NSMutableData		*originalData;
 	NSMutableData		*readData;
 	NSMutableData		*chunk;
 	
 	// Create file.
-	file = SMCryptoFileCreate(path, pass, SMCryptoFileKeySize256, &error);
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
 	
 	if (!file)
 	{
@@ -366,7 +686,7 @@ clean:
 		
 		SMCryptoFileClose(file, NULL);
 		
-		file = SMCryptoFileOpen(path, pass, true, &error);
+		file = SMCryptoFileOpenWithOptions(path, pass, true, &options, &error);
 		
 		if (!file)
 		{
@@ -426,4 +746,241 @@ clean:
 	unlink(path);
 }
 
+- (void)doTestReadAheadWithChunkSize:(unsigned)chunkSize stride:(unsigned)stride readAheadSlots:(uint32_t)readAheadSlots
+{
+	// Scan a file with a pattern detected by the read-ahead, with a few writes in the middle.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .cacheSize = 1024 * 1024, .cacheSlots = 16, .readAheadSlots = readAheadSlots };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		fileSize = 8 * 1024 * 1024;
+	NSMutableData		*originalData = [NSMutableData dataWithLength:fileSize];
+	NSMutableData		*readData = [NSMutableData dataWithLength:chunkSize];
+	
+	arc4random_buf(originalData.mutableBytes, fileSize);
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, originalData.bytes, fileSize, &error) == false)
+	{
+		XCTFail(@"Can't write data (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Reopen.
+	SMCryptoFileClose(file, NULL);
+	
+	file = SMCryptoFileOpenWithOptions(path, pass, false, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Scan.
+	for (unsigned offset = 0, index = 0; offset < fileSize; offset += stride, index++)
+	{
+		unsigned size = MIN(chunkSize, fileSize - offset);
+		
+		// > Read.
+		SMCryptoFileSeek(file, offset, SMCryptoFileSeekSet, NULL);
+		
+		if (SMCryptoFileRead(file, readData.mutableBytes, size, &error) != size)
+		{
+			XCTFail(@"Can't read chunk (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		if (memcmp(readData.bytes, originalData.bytes + offset, size) != 0)
+		{
+			XCTFail(@"Read data are different from written data - offset: %u", offset);
+			goto clean;
+		}
+		
+		// > Write a few bytes further, in the region probably read ahead.
+		if (index % 16 == 15 && offset + 3 * stride < fileSize)
+		{
+			uint8_t		bytes[100];
+			unsigned	writeOffset = offset + 2 * stride;
+			
+			arc4random_buf(bytes, sizeof(bytes));
+			memcpy(originalData.mutableBytes + writeOffset, bytes, sizeof(bytes));
+			
+			SMCryptoFileSeek(file, writeOffset, SMCryptoFileSeekSet, NULL);
+			
+			if (SMCryptoFileWrite(file, bytes, sizeof(bytes), &error) == false)
+			{
+				XCTFail(@"Can't write chunk (%@)", [TestHelper stringWithError:error]);
+				goto clean;
+			}
+		}
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)doTestLargeReadWithCacheSize:(uint32_t)cacheSize blockSize:(uint32_t)blockSize
+{
+	// Read chunks larger than the cache (mostly read outside of the cache), while small writes not flushed yet are spread in the file.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .blockSize = blockSize, .cacheSize = cacheSize, .readAheadSlots = SMCryptoFileReadAheadDisabled };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		fileSize = 4 * 1024 * 1024 + 1234;
+	NSMutableData		*originalData = [NSMutableData dataWithLength:fileSize];
+	NSMutableData		*readData = [NSMutableData dataWithLength:fileSize];
+	
+	arc4random_buf(originalData.mutableBytes, fileSize);
+	
+	// Create file, with a hole at its end.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, originalData.bytes, fileSize / 2, &error) == false || SMCryptoFileTruncate(file, fileSize, &error) == false)
+	{
+		XCTFail(@"Can't write data (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	memset(originalData.mutableBytes + fileSize / 2, 0, fileSize - fileSize / 2);
+	
+	// Read.
+	for (unsigned i = 0; i < 50; i++)
+	{
+		// > Small write, kept in cache.
+		unsigned	writeOffset = arc4random_uniform(fileSize - 100);
+		uint8_t		bytes[100];
+		
+		arc4random_buf(bytes, sizeof(bytes));
+		memcpy(originalData.mutableBytes + writeOffset, bytes, sizeof(bytes));
+		
+		if (SMCryptoFilePWrite(file, bytes, sizeof(bytes), writeOffset, &error) == false)
+		{
+			XCTFail(@"Can't write chunk (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		// > Large read, at any offset.
+		unsigned readOffset = arc4random_uniform(fileSize);
+		unsigned readSize = MIN(fileSize - readOffset, 4 * cacheSize + arc4random_uniform(100000));
+		
+		if (SMCryptoFilePRead(file, readData.mutableBytes, readSize, readOffset, &error) != readSize)
+		{
+			XCTFail(@"Can't read chunk (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		if (memcmp(readData.bytes, originalData.bytes + readOffset, readSize) != 0)
+		{
+			XCTFail(@"Read data are different from written data - offset: %u; size: %u", readOffset, readSize);
+			goto clean;
+		}
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)doTestMappedReadWithCacheSize:(uint32_t)cacheSize blockSize:(uint32_t)blockSize
+{
+	// Read a file opened read-only with its data mapped: sequential reads, then small and large reads at any offset.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .blockSize = blockSize, .cacheSize = cacheSize, .mapData = true };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		fileSize = 4 * 1024 * 1024 + 1234;
+	NSMutableData		*originalData = [NSMutableData dataWithLength:fileSize];
+	NSMutableData		*readData = [NSMutableData dataWithLength:fileSize];
+	
+	arc4random_buf(originalData.mutableBytes, fileSize);
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, originalData.bytes, fileSize, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write data (%@)", [TestHelper stringWithError:error]);
+		file = NULL;
+		goto clean;
+	}
+	
+	// Open read-only.
+	file = SMCryptoFileOpenWithOptions(path, pass, true, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Read sequentially.
+	for (unsigned offset = 0; offset < fileSize; offset += 10000)
+	{
+		unsigned size = MIN(10000, fileSize - offset);
+		
+		if (SMCryptoFileRead(file, readData.mutableBytes + offset, size, &error) != size)
+		{
+			XCTFail(@"Can't read chunk (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+	}
+	
+	if (memcmp(readData.bytes, originalData.bytes, fileSize) != 0)
+	{
+		XCTFail(@"Read data are different from written data.");
+		goto clean;
+	}
+	
+	// Read at any offset.
+	for (unsigned i = 0; i < 100; i++)
+	{
+		unsigned readOffset = arc4random_uniform(fileSize);
+		unsigned readSize = MIN(fileSize - readOffset, (i % 2) ? 1 + arc4random_uniform(1000) : 4 * cacheSize + arc4random_uniform(100000));
+		
+		if (SMCryptoFilePRead(file, readData.mutableBytes, readSize, readOffset, &error) != readSize)
+		{
+			XCTFail(@"Can't read chunk (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		if (memcmp(readData.bytes, originalData.bytes + readOffset, readSize) != 0)
+		{
+			XCTFail(@"Read data are different from written data - offset: %u; size: %u", readOffset, readSize);
+			goto clean;
+		}
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
 @end
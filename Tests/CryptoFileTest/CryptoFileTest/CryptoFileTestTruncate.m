@@ -94,6 +94,324 @@
 	[self doTestTruncateForSize:10000];
 }
 
+- (void)testTruncate_Truncate3000000
+{
+	// Gap filled with several runs.
+	[self doTestTruncateForSize:3000000];
+}
+
+- (void)testTruncate_Sparse
+{
+	// Grow a sparse file a lot, write in the middle of the gap, and read it back.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .blockSize = 4096, .sparse = true };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		fileSize = 64 * 1024 * 1024;
+	const unsigned		writeOffset = 32 * 1024 * 1024 + 1000;
+	uint8_t				bytes[10000];
+	uint8_t				*buffer = malloc(1024 * 1024);
+	
+	arc4random_buf(bytes, sizeof(bytes));
+	
+	// Create file, and grow it.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, bytes, 100, &error) == false || SMCryptoFileTruncate(file, fileSize, &error) == false)
+	{
+		XCTFail(@"Can't grow file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFilePWrite(file, bytes, sizeof(bytes), writeOffset, &error) == false)
+	{
+		XCTFail(@"Can't write in the gap (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Close and reopen.
+	SMCryptoFileClose(file, NULL);
+	
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file || SMCryptoFileSize(file) != fileSize)
+	{
+		XCTFail(@"Can't open grown file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Check content.
+	for (unsigned offset = 0; offset < fileSize; offset += 1024 * 1024)
+	{
+		if (SMCryptoFilePRead(file, buffer, 1024 * 1024, offset, &error) != 1024 * 1024)
+		{
+			XCTFail(@"Can't read file (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		for (unsigned i = 0; i < 1024 * 1024; i++)
+		{
+			unsigned	position = offset + i;
+			uint8_t		expected = 0;
+			
+			if (position < 100)
+				expected = bytes[position];
+			else if (position >= writeOffset && position < writeOffset + sizeof(bytes))
+				expected = bytes[position - writeOffset];
+			
+			if (buffer[i] != expected)
+			{
+				XCTFail(@"Invalid byte read - offset: %u", position);
+				goto clean;
+			}
+		}
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	free(buffer);
+}
+
+- (void)testTruncate_Preallocated
+{
+	// Grow a file with preallocation, reserve more space, and check the truncate releases the space reserved past the data.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .preallocationSize = 1024 * 1024 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		fileSize = 3000000;
+	const unsigned		truncateSize = 100000;
+	uint8_t				*bytes = malloc(fileSize);
+	uint8_t				*buffer = malloc(truncateSize);
+	struct stat			st;
+	
+	arc4random_buf(bytes, fileSize);
+	
+	// Create file, and grow it by small writes.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	for (unsigned offset = 0; offset < fileSize; offset += 4000)
+	{
+		if (SMCryptoFileWrite(file, bytes + offset, MIN(4000, fileSize - offset), &error) == false)
+		{
+			XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+	}
+	
+	// Reserve more space.
+	if (SMCryptoFilePreallocate(file, 8 * fileSize, &error) == false)
+	{
+		XCTFail(@"Can't preallocate file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileSize(file) != fileSize)
+	{
+		XCTFail(@"Preallocation changed the file size (%llu)", SMCryptoFileSize(file));
+		goto clean;
+	}
+	
+	// Truncate, and close.
+	if (SMCryptoFileTruncate(file, truncateSize, &error) == false)
+	{
+		XCTFail(@"Can't truncate file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	SMCryptoFileClose(file, NULL);
+	file = NULL;
+	
+	// Check the reserved space was released.
+	if (stat(path, &st) != 0 || st.st_blocks * 512 >= fileSize)
+	{
+		XCTFail(@"The reserved space wasn't released (%lld bytes allocated)", (long long)st.st_blocks * 512);
+		goto clean;
+	}
+	
+	// Reopen, and check content.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file || SMCryptoFileSize(file) != truncateSize)
+	{
+		XCTFail(@"Can't open truncated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileRead(file, buffer, truncateSize, &error) != truncateSize || memcmp(buffer, bytes, truncateSize) != 0)
+	{
+		XCTFail(@"Invalid content read (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Read-only handles can't preallocate.
+	if (SMCryptoFilePreallocate(file, fileSize, &error) == true || error != SMCryptoFileErrorReadOnly)
+	{
+		XCTFail(@"Can preallocate a file opened in read-only mode.");
+		goto clean;
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	free(bytes);
+	free(buffer);
+}
+
+- (void)testTruncate_PreallocatedClose
+{
+	// Reserve space past the data, and check closing the file releases it (no truncate).
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		fileSize = 1000000;
+	const unsigned		reserveSize = 16 * fileSize;
+	uint8_t				*bytes = malloc(fileSize);
+	uint8_t				*buffer = malloc(fileSize);
+	struct stat			st;
+	
+	arc4random_buf(bytes, fileSize);
+	
+	// Create file, and write content.
+	file = SMCryptoFileCreate(path, pass, SMCryptoFileKeySize256, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, bytes, fileSize, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Reserve space, and check it's allocated.
+	if (SMCryptoFilePreallocate(file, reserveSize, &error) == false)
+	{
+		XCTFail(@"Can't preallocate file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (stat(path, &st) != 0 || st.st_blocks * 512 < reserveSize)
+	{
+		XCTFail(@"The space wasn't reserved (%lld bytes allocated)", (long long)st.st_blocks * 512);
+		goto clean;
+	}
+	
+	// Close.
+	SMCryptoFileClose(file, NULL);
+	file = NULL;
+	
+	// Check the reserved space was released.
+	if (stat(path, &st) != 0 || st.st_blocks * 512 >= 2 * fileSize)
+	{
+		XCTFail(@"The reserved space wasn't released on close (%lld bytes allocated)", (long long)st.st_blocks * 512);
+		goto clean;
+	}
+	
+	// Reopen, and check content.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file || SMCryptoFileSize(file) != fileSize)
+	{
+		XCTFail(@"Can't open file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileRead(file, buffer, fileSize, &error) != fileSize || memcmp(buffer, bytes, fileSize) != 0)
+	{
+		XCTFail(@"Invalid content read (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	free(bytes);
+	free(buffer);
+}
+
+- (void)testTruncate_Authenticated
+{
+	// Shrink an authenticated file in the middle of a block, grow it back, and check the content authenticates.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	const unsigned		shrinkSize = 4096 + 500;
+	uint8_t				wbuffer[3 * 4096 + 1000];
+	uint8_t				rbuffer[3 * 4096];
+	uint8_t				zeros[3 * 4096];
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	memset(zeros, 0, sizeof(zeros));
+	
+	// Create file, and write content.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, wbuffer, sizeof(wbuffer), &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Shrink, grow, and close.
+	if (SMCryptoFileTruncate(file, shrinkSize, &error) == false || SMCryptoFileTruncate(file, sizeof(rbuffer), &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't truncate file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Reopen, and check content: the bytes past the shrink size are zeros.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	XCTAssertEqual(SMCryptoFileSize(file), (uint64_t)sizeof(rbuffer));
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, sizeof(rbuffer), 0, &error), (int64_t)sizeof(rbuffer));
+	XCTAssertEqual(memcmp(rbuffer, wbuffer, shrinkSize), 0);
+	XCTAssertEqual(memcmp(rbuffer + shrinkSize, zeros, sizeof(rbuffer) - shrinkSize), 0);
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+}
+
 - (void)testTruncate_ReadOnly
 {
 	const char			*path = [[TestHelper generateTempPath] UTF8String];
@@ -151,6 +469,7 @@ clean:
 	const char			*path = [[TestHelper generateTempPath] UTF8String];
 	SMCryptoFileError	error;
 	SMCryptoFile		*file = NULL;
+	uint8_t				*buffer = NULL;
 	
 	const char			*pass = "azerty";
 		
@@ -196,7 +515,7 @@ clean:
 	}
 	
 	// Read content.
-	uint8_t *buffer = alloca(fileSize);
+	buffer = malloc(fileSize);
 	int64_t size;
 	
 	memset(buffer, 0xab, fileSize);
@@ -309,6 +628,7 @@ clean:
 clean:
 	SMCryptoFileClose(file, NULL);
 	unlink(path);
+	free(buffer);
 }
 
 @end
@@ -189,6 +189,265 @@ clean:
 }
 
 
+#pragma mark Write-behind
+
+- (void)testWrite_WriteBehind_Slots1
+{
+	[self doTestWriteBehindWithSlots:1 blockSize:0];
+}
+
+- (void)testWrite_WriteBehind_Slots4_BlockSize4096
+{
+	[self doTestWriteBehindWithSlots:4 blockSize:4096];
+}
+
+- (void)testWrite_WriteBehind_Disabled
+{
+	[self doTestWriteBehindWithSlots:0 blockSize:0];
+}
+
+
+#pragma mark Large writes
+
+- (void)testWrite_Large_CacheSize4096
+{
+	[self doTestLargeWriteWithCacheSize:4096 blockSize:0];
+}
+
+- (void)testWrite_Large_CacheSize65536_BlockSize4096
+{
+	[self doTestLargeWriteWithCacheSize:65536 blockSize:4096];
+}
+
+
+#pragma mark Vectored
+
+- (void)testWrite_Vectored_Segments1
+{
+	[self doTestWriteVectoredWithSegmentCount:1];
+}
+
+- (void)testWrite_Vectored_Segments16
+{
+	[self doTestWriteVectoredWithSegmentCount:16];
+}
+
+- (void)testWrite_Vectored_Segments1000
+{
+	[self doTestWriteVectoredWithSegmentCount:1000];
+}
+
+
+#pragma mark Batched flush
+
+- (void)testWrite_BatchedFlush_Slots64
+{
+	[self doTestBatchedFlushWithCacheSlots:64 blockSize:0];
+}
+
+- (void)testWrite_BatchedFlush_Slots256_BlockSize4096
+{
+	[self doTestBatchedFlushWithCacheSlots:256 blockSize:4096];
+}
+
+
+#pragma mark Lazy length
+
+- (void)testWrite_LazyLength
+{
+	// Flush appends without a sync, and check another handle recovers the length from the data on disk, then the exact length once synced.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .blockSize = 4096, .lazyLength = true };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	SMCryptoFile		*other = NULL;
+	const char			*pass = "azerty";
+	
+	uint8_t				bytes[10000];
+	uint8_t				buffer[3 * 4096];
+	
+	arc4random_buf(bytes, sizeof(bytes));
+	
+	// Create file, and flush an append without a sync.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, bytes, sizeof(bytes), &error) == false || SMCryptoFileFlush(file, SMCryptoFileSyncNo, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Open it again: the length is recovered from the blocks on disk.
+	other = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!other || SMCryptoFileSize(other) != sizeof(buffer))
+	{
+		XCTFail(@"Invalid recovered length (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileRead(other, buffer, sizeof(buffer), &error) != sizeof(buffer) || memcmp(buffer, bytes, sizeof(bytes)) != 0 || buffer[sizeof(buffer) - 1] != 0)
+	{
+		XCTFail(@"Invalid content read (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	SMCryptoFileClose(other, NULL);
+	
+	// Sync, and open it again: the exact length is in the header.
+	if (SMCryptoFileFlush(file, SMCryptoFileSyncNormal, &error) == false)
+	{
+		XCTFail(@"Can't sync file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	other = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!other || SMCryptoFileSize(other) != sizeof(bytes))
+	{
+		XCTFail(@"Invalid synced length (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+clean:
+	SMCryptoFileClose(other, NULL);
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+
+#pragma mark Authenticated
+
+- (void)testWrite_Authenticated_Reopen
+{
+	// Write an authenticated file, reopen it read-write to append, and check the whole content authenticates.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 4096 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	uint8_t				wbuffer[30000];
+	uint8_t				rbuffer[30000];
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, sizeof(wbuffer));
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, wbuffer, 10000, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Reopen read-write, and append (the last block is partial).
+	file = SMCryptoFileOpen(path, pass, false, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileSeek(file, 0, SMCryptoFileSeekEnd, &error) == false || SMCryptoFileWrite(file, wbuffer + 10000, sizeof(wbuffer) - 10000, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't append to file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Reopen, and read back.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	XCTAssertEqual(SMCryptoFileSize(file), (uint64_t)sizeof(wbuffer));
+	XCTAssertEqual(SMCryptoFileRead(file, rbuffer, sizeof(rbuffer), &error), (int64_t)sizeof(rbuffer));
+	XCTAssertEqual(memcmp(rbuffer, wbuffer, sizeof(rbuffer)), 0);
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+}
+
+- (void)testWrite_Authenticated_Growth
+{
+	// Write past the first tree capacity (16 leaf pages, 128 hashes each), with a flush in between, and check the content authenticates.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	char				treePath[PATH_MAX];
+	SMCryptoFileOptions	options = { .authenticated = true, .blockSize = 256 };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	const unsigned		fileSize = 20 * 128 * 256 + 1000;
+	uint8_t				*wbuffer = malloc(fileSize);
+	uint8_t				*rbuffer = malloc(fileSize);
+	
+	snprintf(treePath, sizeof(treePath), "%s-tree", path);
+	arc4random_buf(wbuffer, fileSize);
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Write a quarter, commit it, and write the rest (the tree grows).
+	if (SMCryptoFileWrite(file, wbuffer, fileSize / 4, &error) == false || SMCryptoFileFlush(file, SMCryptoFileSyncNo, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileWrite(file, wbuffer + fileSize / 4, fileSize - fileSize / 4, &error) == false || SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't write file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Reopen, and read back.
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open authenticated file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	XCTAssertEqual(SMCryptoFileSize(file), (uint64_t)fileSize);
+	XCTAssertEqual(SMCryptoFilePRead(file, rbuffer, fileSize, 0, &error), (int64_t)fileSize);
+	XCTAssertEqual(memcmp(rbuffer, wbuffer, fileSize), 0);
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	unlink(treePath);
+	free(wbuffer);
+	free(rbuffer);
+}
+
+
 #pragma mark Others
 
 - (void)testWrite_ReadOnly
@@ -349,4 +608,348 @@ clean:
 	unlink(path);
 }
 
+- (void)doTestWriteBehindWithSlots:(uint32_t)writeBehindSlots blockSize:(uint32_t)blockSize
+{
+	// Append chunks of random sizes (log-like), with a few reads of written data and truncates in the middle, then check the file after reopening.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .blockSize = blockSize, .cacheSize = 1024 * 1024, .cacheSlots = 16, .writeBehindSlots = writeBehindSlots };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		fileSize = 8 * 1024 * 1024;
+	NSMutableData		*originalData = [NSMutableData dataWithLength:fileSize];
+	NSMutableData		*readData = [NSMutableData dataWithLength:fileSize];
+	unsigned			length = 0;
+	
+	arc4random_buf(originalData.mutableBytes, fileSize);
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Append.
+	for (unsigned index = 0; length < fileSize; index++)
+	{
+		unsigned size = MIN(1 + arc4random_uniform(20000), fileSize - length);
+		
+		// > Write.
+		SMCryptoFileSeek(file, length, SMCryptoFileSeekSet, NULL);
+		
+		if (SMCryptoFileWrite(file, originalData.bytes + length, size, &error) == false)
+		{
+			XCTFail(@"Can't write chunk (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		length += size;
+		
+		// > Read back data probably written in background.
+		if (index % 32 == 31)
+		{
+			unsigned offset = arc4random_uniform(length);
+			unsigned rsize = MIN(5000, length - offset);
+			
+			SMCryptoFileSeek(file, offset, SMCryptoFileSeekSet, NULL);
+			
+			if (SMCryptoFileRead(file, readData.mutableBytes, rsize, &error) != rsize)
+			{
+				XCTFail(@"Can't read chunk (%@)", [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			if (memcmp(readData.bytes, originalData.bytes + offset, rsize) != 0)
+			{
+				XCTFail(@"Read data are different from written data - offset: %u", offset);
+				goto clean;
+			}
+		}
+		
+		// > Drop the end of the data, it will be appended again.
+		if (index % 128 == 127)
+		{
+			length -= MIN(length, arc4random_uniform(200000));
+			
+			if (SMCryptoFileTruncate(file, length, &error) == false)
+			{
+				XCTFail(@"Can't truncate (%@)", [TestHelper stringWithError:error]);
+				goto clean;
+			}
+		}
+	}
+	
+	// Reopen.
+	if (SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't close file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Compare.
+	if (SMCryptoFileRead(file, readData.mutableBytes, fileSize, &error) != fileSize)
+	{
+		XCTFail(@"Read error (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if ([originalData isEqualToData:readData] == NO)
+	{
+		XCTFail(@"Write and read data are not the same.");
+		goto clean;
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)doTestLargeWriteWithCacheSize:(uint32_t)cacheSize blockSize:(uint32_t)blockSize
+{
+	// Write chunks larger than the cache (mostly written outside of the cache) at any offset, some past the end of data, mixed with small writes kept in cache.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .blockSize = blockSize, .cacheSize = cacheSize };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		maxSize = 4 * 1024 * 1024;
+	NSMutableData		*originalData = [NSMutableData dataWithLength:maxSize];
+	NSMutableData		*chunk = [NSMutableData dataWithLength:maxSize];
+	NSMutableData		*readData = [NSMutableData dataWithLength:maxSize];
+	unsigned			length = 0;
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Write.
+	for (unsigned i = 0; i < 60; i++)
+	{
+		unsigned offset = arc4random_uniform(maxSize - 100);
+		unsigned size = (i % 3 == 0) ? 100 : MIN(maxSize - offset, 2 * cacheSize + arc4random_uniform(300000));
+		
+		arc4random_buf(chunk.mutableBytes, size);
+		
+		if (SMCryptoFilePWrite(file, chunk.bytes, size, offset, &error) == false)
+		{
+			XCTFail(@"Can't write chunk (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+		
+		memcpy(originalData.mutableBytes + offset, chunk.bytes, size);
+		
+		length = MAX(length, offset + size);
+	}
+	
+	// Reopen.
+	if (SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't close file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Compare.
+	if (SMCryptoFileRead(file, readData.mutableBytes, maxSize, &error) != length)
+	{
+		XCTFail(@"Read error (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (memcmp(readData.bytes, originalData.bytes, length) != 0)
+		XCTFail(@"Write and read data are not the same.");
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)doTestBatchedFlushWithCacheSlots:(uint32_t)cacheSlots blockSize:(uint32_t)blockSize
+{
+	// Dirty many cache slots (some adjacent, some partially, some past the end of data), and flush them all at once.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileOptions	options = { .blockSize = blockSize, .cacheSize = 4 * 1024 * 1024, .cacheSlots = cacheSlots };
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		maxSize = 4 * 1024 * 1024;
+	NSMutableData		*originalData = [NSMutableData dataWithLength:maxSize];
+	NSMutableData		*readData = [NSMutableData dataWithLength:maxSize];
+	unsigned			length = 0;
+	
+	arc4random_buf(originalData.mutableBytes, maxSize);
+	
+	// Create file.
+	file = SMCryptoFileCreateWithOptions(path, pass, SMCryptoFileKeySize256, &options, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Write and flush, a few times.
+	for (unsigned round = 0; round < 4; round++)
+	{
+		for (unsigned i = 0; i < cacheSlots; i++)
+		{
+			unsigned offset = arc4random_uniform(maxSize - 10000);
+			unsigned size = 1 + arc4random_uniform(10000);
+			
+			if (SMCryptoFilePWrite(file, (const uint8_t *)originalData.bytes + offset, size, offset, &error) == false)
+			{
+				XCTFail(@"Can't write chunk (%@)", [TestHelper stringWithError:error]);
+				goto clean;
+			}
+			
+			length = MAX(length, offset + size);
+		}
+		
+		if (SMCryptoFileFlush(file, SMCryptoFileSyncNo, &error) == false)
+		{
+			XCTFail(@"Can't flush file (%@)", [TestHelper stringWithError:error]);
+			goto clean;
+		}
+	}
+	
+	// Reopen.
+	if (SMCryptoFileClose(file, &error) == false)
+	{
+		XCTFail(@"Can't close file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	file = SMCryptoFileOpen(path, pass, true, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't open file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Compare (regions never written read as zeros).
+	if (SMCryptoFileRead(file, readData.mutableBytes, maxSize, &error) != length)
+	{
+		XCTFail(@"Read error (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	for (unsigned i = 0; i < length; i++)
+	{
+		uint8_t byte = ((const uint8_t *)readData.bytes)[i];
+		
+		if (byte != 0 && byte != ((const uint8_t *)originalData.bytes)[i])
+		{
+			XCTFail(@"Write and read data are not the same at offset %u.", i);
+			break;
+		}
+	}
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+}
+
+- (void)doTestWriteVectoredWithSegmentCount:(int)segmentCount
+{
+	// Write fragments of random sizes (some empty) with one vectored write, at an unaligned offset, and read them back split differently.
+	const char			*path = [[TestHelper generateTempPath] UTF8String];
+	SMCryptoFileError	error;
+	SMCryptoFile		*file = NULL;
+	const char			*pass = "azerty";
+	
+	const unsigned		offset = 1000;
+	NSMutableData		*originalData = [NSMutableData dataWithLength:segmentCount * 1000];
+	NSMutableData		*readData = [NSMutableData dataWithLength:segmentCount * 1000];
+	struct iovec		*segments = calloc((size_t)segmentCount, sizeof(struct iovec));
+	unsigned			size = 0;
+	
+	arc4random_buf(originalData.mutableBytes, originalData.length);
+	
+	// Create file.
+	file = SMCryptoFileCreate(path, pass, SMCryptoFileKeySize256, &error);
+	
+	if (!file)
+	{
+		XCTFail(@"Can't create AES 256 file (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	// Write.
+	for (int i = 0; i < segmentCount; i++)
+	{
+		unsigned length = arc4random_uniform(1000);
+		
+		segments[i].iov_base = (uint8_t *)originalData.mutableBytes + size;
+		segments[i].iov_len = length;
+		
+		size += length;
+	}
+	
+	SMCryptoFileSeek(file, offset, SMCryptoFileSeekSet, NULL);
+	
+	if (SMCryptoFileWriteV(file, segments, segmentCount, &error) == false)
+	{
+		XCTFail(@"Can't write segments (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (SMCryptoFileTell(file) != offset + size || SMCryptoFileSize(file) != offset + size)
+	{
+		XCTFail(@"Wrong position or size after vectored write - tell: %llu; size: %llu", SMCryptoFileTell(file), SMCryptoFileSize(file));
+		goto clean;
+	}
+	
+	// Read, with the segments in reverse order of sizes.
+	for (int i = 0, position = 0; i < segmentCount; i++)
+	{
+		size_t length = segments[segmentCount - 1 - i].iov_len;
+		
+		segments[i].iov_base = (uint8_t *)readData.mutableBytes + position;
+		segments[i].iov_len = length;
+		
+		position += length;
+	}
+	
+	if (SMCryptoFilePReadV(file, segments, segmentCount, offset, &error) != size)
+	{
+		XCTFail(@"Can't read segments (%@)", [TestHelper stringWithError:error]);
+		goto clean;
+	}
+	
+	if (memcmp(readData.bytes, originalData.bytes, size) != 0)
+		XCTFail(@"Write and read data are not the same.");
+	
+clean:
+	SMCryptoFileClose(file, NULL);
+	unlink(path);
+	free(segments);
+}
+
 @end
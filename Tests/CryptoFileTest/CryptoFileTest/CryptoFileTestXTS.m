@@ -0,0 +1,250 @@
+/*
+ * CryptoFileTestXTS.m
+ *
+ * Copyright 2021 Avérous Julien-Pierre
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#import <XCTest/XCTest.h>
+
+#import "SMCryptoXTS.h"
+
+
+/*
+** CryptoFileTestXTS - Interface
+*/
+#pragma mark - CryptoFileTestXTS - Interface
+
+@interface CryptoFileTestXTS : XCTestCase
+
+@end
+
+
+
+/*
+** CryptoFileTestXTS
+*/
+#pragma mark - CryptoFileTestXTS
+
+@implementation CryptoFileTestXTS
+
+
+/*
+** CryptoFileTestXTS - Tests
+*/
+#pragma mark - CryptoFileTestXTS - Tests
+
+#pragma mark Known answers
+
+- (void)testXTS_KnownAnswer_Vector1
+{
+	// IEEE 1619 - Vector 1.
+	uint8_t key[16] = { 0 };
+	uint8_t plain[32] = { 0 };
+
+	const uint8_t cipher[32] = {
+		0x91, 0x7c, 0xf6, 0x9e, 0xbd, 0x68, 0xb2, 0xec, 0x9b, 0x9f, 0xe9, 0xa3, 0xea, 0xdd, 0xa6, 0x92,
+		0xcd, 0x43, 0xd2, 0xf5, 0x95, 0x98, 0xed, 0x85, 0x8c, 0x02, 0xc2, 0x65, 0x2f, 0xbf, 0x92, 0x2e
+	};
+
+	[self doTestKnownAnswerForDataKey:key tweakKey:key keySize:sizeof(key) unit:0 plain:plain cipher:cipher length:sizeof(plain)];
+}
+
+- (void)testXTS_KnownAnswer_Vector2
+{
+	// IEEE 1619 - Vector 2.
+	uint8_t dataKey[16];
+	uint8_t tweakKey[16];
+	uint8_t plain[32];
+
+	memset(dataKey, 0x11, sizeof(dataKey));
+	memset(tweakKey, 0x22, sizeof(tweakKey));
+	memset(plain, 0x44, sizeof(plain));
+
+	const uint8_t cipher[32] = {
+		0xc4, 0x54, 0x18, 0x5e, 0x6a, 0x16, 0x93, 0x6e, 0x39, 0x33, 0x40, 0x38, 0xac, 0xef, 0x83, 0x8b,
+		0xfb, 0x18, 0x6f, 0xff, 0x74, 0x80, 0xad, 0xc4, 0x28, 0x93, 0x82, 0xec, 0xd6, 0xd3, 0x94, 0xf0
+	};
+
+	[self doTestKnownAnswerForDataKey:dataKey tweakKey:tweakKey keySize:sizeof(dataKey) unit:0x3333333333 plain:plain cipher:cipher length:sizeof(plain)];
+}
+
+#pragma mark Cross-check
+
+- (void)testXTS_CrossCheck_KeySize16
+{
+	[self doTestCrossCheckForKeySize:16];
+}
+
+- (void)testXTS_CrossCheck_KeySize24
+{
+	[self doTestCrossCheckForKeySize:24];
+}
+
+- (void)testXTS_CrossCheck_KeySize32
+{
+	[self doTestCrossCheckForKeySize:32];
+}
+
+#pragma mark Performance
+
+- (void)testXTS_Performance_Bitsliced
+{
+	[self doTestPerformanceForEngine:SMCryptoXTSEngineBitsliced];
+}
+
+- (void)testXTS_Performance_AESNI
+{
+	[self doTestPerformanceForEngine:SMCryptoXTSEngineAESNI];
+}
+
+- (void)testXTS_Performance_VAES
+{
+	[self doTestPerformanceForEngine:SMCryptoXTSEngineVAES];
+}
+
+- (void)testXTS_Performance_AVX512
+{
+	[self doTestPerformanceForEngine:SMCryptoXTSEngineAVX512];
+}
+
+
+
+/*
+** CryptoFileTestXTS - Helpers
+*/
+#pragma mark - CryptoFileTestXTS - Helpers
+
+- (void)doTestKnownAnswerForDataKey:(const uint8_t *)dataKey tweakKey:(const uint8_t *)tweakKey keySize:(size_t)keySize unit:(uint64_t)unit plain:(const uint8_t *)plain cipher:(const uint8_t *)cipher length:(size_t)length
+{
+	SMCryptoXTSContext	ctx;
+	uint8_t				*buffer = alloca(length);
+
+	XCTAssertTrue(SMCryptoXTSContextInit(&ctx, dataKey, tweakKey, keySize));
+
+	for (SMCryptoXTSEngine engine = SMCryptoXTSEngineReference; engine <= SMCryptoXTSEngineAVX512; engine++)
+	{
+		if (SMCryptoXTSEngineIsAvailable(engine) == false)
+			continue;
+
+		// > Encrypt.
+		memset(buffer, 0, length);
+
+		SMCryptoXTSEncryptUnitsWithEngine(engine, &ctx, unit, length, plain, length, buffer);
+		XCTAssertEqual(memcmp(buffer, cipher, length), 0, @"Invalid encryption with engine %s", SMCryptoXTSEngineName(engine));
+
+		// > Decrypt.
+		SMCryptoXTSDecryptUnitsWithEngine(engine, &ctx, unit, length, buffer, length, buffer);
+		XCTAssertEqual(memcmp(buffer, plain, length), 0, @"Invalid decryption with engine %s", SMCryptoXTSEngineName(engine));
+	}
+
+	SMCryptoXTSContextClean(&ctx);
+}
+
+- (void)doTestCrossCheckForKeySize:(size_t)keySize
+{
+	// Each available engine should produce the same bytes as the scalar reference engine, for any unit size and run length.
+	const size_t unitSizes[] = { 16, 48, 64, 256, 272, 4096 };
+
+	for (unsigned iteration = 0; iteration < 64; iteration++)
+	{
+		SMCryptoXTSContext	ctx;
+		uint8_t				dataKey[32];
+		uint8_t				tweakKey[32];
+
+		arc4random_buf(dataKey, sizeof(dataKey));
+		arc4random_buf(tweakKey, sizeof(tweakKey));
+
+		if (SMCryptoXTSContextInit(&ctx, dataKey, tweakKey, keySize) == false)
+		{
+			XCTFail(@"Can't init context for key size %zu", keySize);
+			return;
+		}
+
+		size_t		unitSize = unitSizes[arc4random_uniform(sizeof(unitSizes) / sizeof(unitSizes[0]))];
+		size_t		unitCount = 1 + arc4random_uniform(40);
+		size_t		length = unitSize * unitCount;
+		uint64_t	firstUnit = ((uint64_t)arc4random() << 32) | arc4random();
+
+		NSMutableData	*plainData = [NSMutableData dataWithLength:length];
+		NSMutableData	*referenceData = [NSMutableData dataWithLength:length];
+		NSMutableData	*engineData = [NSMutableData dataWithLength:length];
+
+		uint8_t	*plain = plainData.mutableBytes;
+		uint8_t	*reference = referenceData.mutableBytes;
+		uint8_t	*output = engineData.mutableBytes;
+
+		arc4random_buf(plain, length);
+
+		XCTAssertTrue(SMCryptoXTSEncryptUnitsWithEngine(SMCryptoXTSEngineReference, &ctx, firstUnit, unitSize, plain, length, reference));
+
+		for (SMCryptoXTSEngine engine = SMCryptoXTSEngineReference; engine <= SMCryptoXTSEngineAVX512; engine++)
+		{
+			if (SMCryptoXTSEngineIsAvailable(engine) == false)
+				continue;
+
+			// > Encrypt.
+			SMCryptoXTSEncryptUnitsWithEngine(engine, &ctx, firstUnit, unitSize, plain, length, output);
+
+			if (memcmp(output, reference, length) != 0)
+			{
+				XCTFail(@"Engine %s encryption differs from reference - unitSize: %zu; unitCount: %zu", SMCryptoXTSEngineName(engine), unitSize, unitCount);
+				break;
+			}
+
+			// > Decrypt (in place).
+			SMCryptoXTSDecryptUnitsWithEngine(engine, &ctx, firstUnit, unitSize, output, length, output);
+
+			if (memcmp(output, plain, length) != 0)
+			{
+				XCTFail(@"Engine %s decryption differs from plain - unitSize: %zu; unitCount: %zu", SMCryptoXTSEngineName(engine), unitSize, unitCount);
+				break;
+			}
+		}
+
+		SMCryptoXTSContextClean(&ctx);
+	}
+}
+
+- (void)doTestPerformanceForEngine:(SMCryptoXTSEngine)engine
+{
+	// Crypt 4 MiB as a run of 256 bytes units (SMCryptoFile data blocks).
+	if (SMCryptoXTSEngineIsAvailable(engine) == false)
+	{
+		NSLog(@"Engine %s not available on this CPU - skip.", SMCryptoXTSEngineName(engine));
+		return;
+	}
+
+	SMCryptoXTSContext			ctx;
+	const SMCryptoXTSContext	*context = &ctx;
+	uint8_t						keys[64];
+	size_t						length = 4 * 1024 * 1024;
+	NSMutableData				*data = [NSMutableData dataWithLength:length];
+	uint8_t						*bytes = data.mutableBytes;
+
+	arc4random_buf(keys, sizeof(keys));
+	arc4random_buf(bytes, length);
+
+	XCTAssertTrue(SMCryptoXTSContextInit(&ctx, keys, keys + 32, 32));
+
+	[self measureBlock:^{
+		SMCryptoXTSEncryptUnitsWithEngine(engine, context, 0, 256, bytes, length, bytes);
+		SMCryptoXTSDecryptUnitsWithEngine(engine, context, 0, 256, bytes, length, bytes);
+	}];
+
+	SMCryptoXTSContextClean(&ctx);
+}
+
+@end
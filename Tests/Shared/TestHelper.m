@@ -58,6 +58,7 @@
 		case SMCryptoFileErrorReadOnly:		return @"SMCryptoFileErrorReadOnly";
 		case SMCryptoFileErrorIO:			return @"SMCryptoFileErrorIO";
 		case SMCryptoFileErrorUnknown:		return @"SMCryptoFileErrorUnknown";
+		case SMCryptoFileErrorIntegrity:	return @"SMCryptoFileErrorIntegrity";
 	}
 	
 	return @"-";